@@ -8,6 +8,7 @@
 #include "agh_modem.h"
 #include "agh_ubus.h"
 #include "agh_ubus_handler.h"
+#include "agh_ubus_status.h"
 
 /* Log messages from core domain. */
 #define AGH_LOG_DOMAIN_CORE	"CORE"
@@ -633,6 +634,11 @@ gint main(void) {
 	mstate->uctx = agh_ubus_setup(mstate->comm, &nonfatal_retval);
 	if (nonfatal_retval)
 		agh_log_core_crit("ubus code init failure (code=%" G_GINT16_FORMAT")", nonfatal_retval);
+	else {
+		nonfatal_retval = agh_ubus_status_init(mstate);
+		if (nonfatal_retval)
+			agh_log_core_crit("ubus status object init failure (code=%" G_GINT16_FORMAT")", nonfatal_retval);
+	}
 
 	nonfatal_retval = agh_xmpp_init(mstate);
 	if (nonfatal_retval)
@@ -658,6 +664,8 @@ out:
 		retval = agh_ubus_teardown(mstate->uctx);
 		if (retval)
 			agh_log_core_crit("failure when trying to deinit ubus (code=%" G_GINT16_FORMAT")", retval);
+
+		agh_ubus_status_deinit();
 	}
 
 	retval = agh_xmpp_deinit(mstate);
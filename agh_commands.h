@@ -29,6 +29,9 @@
 /* EVENT keyword, for events */
 #define AGH_CMD_EVENT_KEYWORD AGH_CMD_OUT_KEYWORD"!"
 
+/* CHUNK keyword, for parts of large outgoing texts split by the XMPP code */
+#define AGH_CMD_CHUNK_KEYWORD AGH_CMD_OUT_KEYWORD"+"
+
 struct agh_cmd {
 	config_t *cmd;
 	struct agh_cmd_res *answer;
@@ -299,9 +299,12 @@ static gint agh_mm_handler_sim_id_cb(struct agh_state *mstate, struct agh_cmd *c
 
 static gint agh_mm_handler_modem_showchanges_disable_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
 
-	if (mmstate->modem && mmstate->modem3gpp) {
-		agh_mm_showchanges(mstate, mmstate->modem, mmstate->modem3gpp, FALSE);
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
+
+	if (mmstate->modem && m3gpp) {
+		agh_mm_showchanges(mstate, mmstate->modem, m3gpp, FALSE);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -310,9 +313,12 @@ static gint agh_mm_handler_modem_showchanges_disable_cb(struct agh_state *mstate
 
 static gint agh_mm_handler_modem_showchanges_enable_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
+
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
 
-	if (mmstate->modem && mmstate->modem3gpp) {
-		agh_mm_showchanges(mstate, mmstate->modem, mmstate->modem3gpp, TRUE);
+	if (mmstate->modem && m3gpp) {
+		agh_mm_showchanges(mstate, mmstate->modem, m3gpp, TRUE);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -791,9 +797,12 @@ out:
 
 static gint agh_mm_handler_modem_time_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModemTime *modem_time;
 
-	if (mmstate->time) {
-		mm_modem_time_get_network_time(mmstate->time, mmstate->cancellable, (GAsyncReadyCallback)agh_mm_handler_modem_time_ready, mstate);
+	modem_time = agh_mm_registry_get_time(mmstate->current_modem);
+
+	if (modem_time) {
+		mm_modem_time_get_network_time(modem_time, mmstate->cancellable, (GAsyncReadyCallback)agh_mm_handler_modem_time_ready, mstate);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -802,9 +811,12 @@ static gint agh_mm_handler_modem_time_cb(struct agh_state *mstate, struct agh_cm
 
 static gint agh_mm_handler_modem_operator_name_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
+
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
 
-	if (mmstate->modem3gpp) {
-		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_operator_name(mmstate->modem3gpp), TRUE);
+	if (m3gpp) {
+		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_operator_name(m3gpp), TRUE);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -813,9 +825,12 @@ static gint agh_mm_handler_modem_operator_name_cb(struct agh_state *mstate, stru
 
 static gint agh_mm_handler_modem_imei_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
 
-	if (mmstate->modem3gpp) {
-		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_imei(mmstate->modem3gpp), TRUE);
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
+
+	if (m3gpp) {
+		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_imei(m3gpp), TRUE);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -824,8 +839,11 @@ static gint agh_mm_handler_modem_imei_cb(struct agh_state *mstate, struct agh_cm
 
 static gint agh_mm_handler_modem_showchanges_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
+
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
 
-	if (mmstate->modem3gpp) {
+	if (m3gpp) {
 		agh_cmd_op_match(mstate, agh_modem_showchanges_ops, cmd, 3);
 	}
 
@@ -834,9 +852,12 @@ static gint agh_mm_handler_modem_showchanges_cb(struct agh_state *mstate, struct
 
 static gint agh_mm_handler_modem_operator_code_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	struct agh_mm_state *mmstate = mstate->mmstate;
+	MMModem3gpp *m3gpp;
+
+	m3gpp = agh_mm_registry_get_modem3gpp(mmstate->current_modem);
 
-	if (mmstate->modem3gpp) {
-		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_operator_code(mmstate->modem3gpp), TRUE);
+	if (m3gpp) {
+		agh_cmd_answer_addtext(cmd, mm_modem_3gpp_get_operator_code(m3gpp), TRUE);
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 	}
 
@@ -1411,52 +1432,6 @@ static const struct agh_cmd_operation agh_modem_ops[] = {
 	{ }
 };
 
-static MMObject *agh_mm_handler_index_to_modem(struct agh_state *mstate, gint modem_index) {
-	gchar *modem_path;
-	guint modem_list_length;
-	GList *modems;
-	MMObject *current_modem;
-	GList *l;
-	MMObject *modem_found;
-
-	modem_found = NULL;
-
-	if (modem_index < 0) {
-		agh_log_mm_handler_dbg("modem index should be positive");
-		return modem_found;
-	}
-
-	modems = g_dbus_object_manager_get_objects(G_DBUS_OBJECT_MANAGER(mstate->mmstate->manager));
-
-	if (!modems) {
-		agh_log_mm_handler_dbg("no modems");
-		return modem_found;
-	}
-
-	/* a NULL list is valid, hence this is pointless as of now */
-	modem_list_length = g_list_length(modems);
-
-	if (!modem_list_length) {
-		g_list_free(modems);
-		return modem_found;
-	}
-
-	modem_path = g_strdup_printf(MM_DBUS_MODEM_PREFIX"/%" G_GINT16_FORMAT"", modem_index);
-
-	for (l = modems; l; l = g_list_next (l)) {
-		current_modem = MM_OBJECT(l->data);
-		if (!g_strcmp0(mm_object_get_path(current_modem), modem_path)) {
-			modem_found = current_modem;
-			modems = g_list_remove(modems, l->data);
-			break;
-		}
-	}
-
-	g_free(modem_path);
-	g_list_free_full(modems, g_object_unref);
-	return modem_found;
-}
-
 static gint agh_mm_handler_release_objects(struct agh_state *mstate) {
 	gint retval;
 	struct agh_mm_state *mmstate;
@@ -1471,35 +1446,10 @@ static gint agh_mm_handler_release_objects(struct agh_state *mstate) {
 
 	mmstate = mstate->mmstate;
 
-	if (mmstate->mmobject)
-		g_clear_pointer(&mmstate->mmobject, g_object_unref);
-
-	if (mmstate->modem)
-		g_clear_pointer(&mmstate->modem, g_object_unref);
-
-	if (mmstate->modem3gpp)
-		g_clear_pointer(&mmstate->modem3gpp, g_object_unref);
-
-	if (mmstate->modem3gppussd)
-		g_clear_pointer(&mmstate->modem3gppussd, g_object_unref);
-
-	if (mmstate->modemlocation)
-		g_clear_pointer(&mmstate->modemlocation, g_object_unref);
-
-	if (mmstate->time)
-		g_clear_pointer(&mmstate->time, g_object_unref);
-
-	if (mmstate->firmware)
-		g_clear_pointer(&mmstate->firmware, g_object_unref);
-
-	if (mmstate->oma)
-		g_clear_pointer(&mmstate->oma, g_object_unref);
-
-	if (mmstate->signal)
-		g_clear_pointer(&mmstate->signal, g_object_unref);
-
-	if (mmstate->voice)
-		g_clear_pointer(&mmstate->voice, g_object_unref);
+	/* These are owned by the modems registry. */
+	mmstate->current_modem = NULL;
+	mmstate->mmobject = NULL;
+	mmstate->modem = NULL;
 
 out:
 	return retval;
@@ -1519,36 +1469,21 @@ static gint agh_mm_handler_get_objects(struct agh_state *mstate, gint index) {
 
 	mmstate = mstate->mmstate;
 
-	if (mmstate->mmobject) {
-		agh_log_mm_handler_crit("%s was called with a MMObject already present",__FUNCTION__);
+	if (mmstate->current_modem) {
+		agh_log_mm_handler_crit("%s was called with a modem already present",__FUNCTION__);
 		retval = 72;
 		goto out;
 	}
 
-	mmstate->mmobject = agh_mm_handler_index_to_modem(mstate, index);
-	if (!mmstate->mmobject) {
+	mmstate->current_modem = agh_mm_registry_lookup(mmstate, index);
+	if (!mmstate->current_modem) {
 		agh_log_mm_handler_dbg("can not find an object representing this modem");
 		retval = 73;
 		goto out;
 	}
 
-	mmstate->modem = mm_object_get_modem(mmstate->mmobject);
-
-	mmstate->modem3gpp = mm_object_get_modem_3gpp(mmstate->mmobject);
-
-	mmstate->modem3gppussd = mm_object_get_modem_3gpp_ussd(mmstate->mmobject);
-
-	mmstate->modemlocation = mm_object_get_modem_location(mmstate->mmobject);
-
-	mmstate->time = mm_object_get_modem_time(mmstate->mmobject);
-
-	mmstate->firmware = mm_object_get_modem_firmware(mmstate->mmobject);
-
-	mmstate->oma = mm_object_get_modem_oma(mmstate->mmobject);
-
-	mmstate->signal = mm_object_get_modem_signal(mmstate->mmobject);
-
-	mmstate->voice = mm_object_get_modem_voice(mmstate->mmobject);
+	mmstate->mmobject = mmstate->current_modem->object;
+	mmstate->modem = mmstate->current_modem->modem;
 
 out:
 	if (retval)
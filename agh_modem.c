@@ -15,6 +15,7 @@
 #include "agh_mm_handler.h"
 #include "agh_modem_config.h"
 #include "agh_mm_helpers.h"
+#include "agh_xmpp.h"
 
 /* Log messages from AGH_LOG_DOMAIN_MODEM domain. */
 #define AGH_LOG_DOMAIN_MODEM "MM"
@@ -26,89 +27,243 @@
 struct agh_comm *agh_mm_aghcomm;
 GCancellable *global_cancellable;
 
-static gint agh_mm_async_init(struct agh_state *mstate) {
-	if (!mstate || !mstate->mmstate) {
-		agh_log_mm_crit("missing context");
+/*
+ * Extracts the modem index from a ModemManager modem object path.
+ *
+ * Returns: the index, or -1 when the path does not look like a modem one.
+*/
+static gint agh_mm_modem_path_to_index(const gchar *modem_path) {
+	const gchar *p;
+	gchar *end;
+	gint64 index;
+
+	if (!modem_path || !g_str_has_prefix(modem_path, MM_DBUS_MODEM_PREFIX"/"))
 		return -1;
-	}
 
-	if (mstate->mmstate->pending_bearer_async_ops) {
-		agh_log_mm_crit("called in an invalid state (pending_bearer_async_ops should be 0, but is %" G_GINT16_FORMAT")",mstate->mmstate->pending_bearer_async_ops);
-		return -2;
-	}
+	/* sizeof accounts for the '/' following the prefix */
+	p = modem_path + sizeof(MM_DBUS_MODEM_PREFIX);
 
-	mstate->mmstate->pending_bearer_async_ops++;
+	index = g_ascii_strtoll(p, &end, 10);
+	if (end == p || *end || index < 0 || index > G_MAXINT)
+		return -1;
 
-	return 0;
+	return index;
 }
 
-static gint agh_mm_async_del(struct agh_state *mstate) {
-	if (!mstate || !mstate->mmstate) {
-		agh_log_mm_crit("missing context");
-		return -3;
-	}
+static void agh_mm_registry_interface_removed(GDBusObject *object, GDBusInterface *interface, gpointer user_data) {
+	struct agh_mm_modem *mm = user_data;
 
-	mstate->mmstate->pending_bearer_async_ops--;
-	if (mstate->mmstate->pending_bearer_async_ops+1 > 1) {
-		agh_log_mm_dbg("async_ops (%" G_GINT16_FORMAT" -> %" G_GINT16_FORMAT")",mstate->mmstate->pending_bearer_async_ops+1,mstate->mmstate->pending_bearer_async_ops);
-	}
+	if ((gpointer)interface == (gpointer)mm->modem3gpp)
+		g_clear_object(&mm->modem3gpp);
 
-	return 0;
+	if ((gpointer)interface == (gpointer)mm->time)
+		g_clear_object(&mm->time);
+
+	return;
 }
 
-static gint agh_mm_async_add(struct agh_state *mstate) {
-	if (!mstate || !mstate->mmstate) {
-		agh_log_mm_crit("missing context");
-		return -4;
-	}
+/*
+ * Destroy function for the modems registry hash table values.
+*/
+static void agh_mm_registry_entry_free(gpointer data) {
+	struct agh_mm_modem *mm = data;
 
-	if (!mstate->mmstate->pending_bearer_async_ops) {
-		agh_log_mm_crit("invalid addition attempt");
-		return -5;
-	}
+	if (!mm)
+		return;
+
+	if (mm->interface_removed_id)
+		g_signal_handler_disconnect(mm->object, mm->interface_removed_id);
+
+	g_clear_object(&mm->modem3gpp);
+	g_clear_object(&mm->time);
+	g_clear_object(&mm->modem);
+	g_clear_object(&mm->object);
+	g_free(mm);
+
+	return;
+}
+
+static const gchar * const agh_mm_bringup_stage_names[AGH_MM_BRINGUP_STAGES] = {
+	[AGH_MM_BRINGUP_UNLOCKED] = "unlocked",
+	[AGH_MM_BRINGUP_ENABLED] = "enabled",
+	[AGH_MM_BRINGUP_REGISTERED] = "registered",
+	[AGH_MM_BRINGUP_BEARER_CREATED] = "bearer_created",
+	[AGH_MM_BRINGUP_CONNECTED] = "connected",
+};
+
+const gchar *agh_mm_bringup_stage_name(gint stage) {
 
-	mstate->mmstate->pending_bearer_async_ops++;
-	if (mstate->mmstate->pending_bearer_async_ops > 1) {
-		agh_log_mm_dbg("async_ops (%" G_GINT16_FORMAT" -> %" G_GINT16_FORMAT")",mstate->mmstate->pending_bearer_async_ops-1,mstate->mmstate->pending_bearer_async_ops);
+	if (stage < 0 || stage >= AGH_MM_BRINGUP_STAGES)
+		return NULL;
+
+	return agh_mm_bringup_stage_names[stage];
+}
+
+/*
+ * A modem bring-up starts when it's first seen, or when it goes back to a disabled (or lower) state.
+*/
+static void agh_mm_bringup_reset(struct agh_mm_modem *mm) {
+	gint i;
+
+	mm->bringup_start = g_get_monotonic_time();
+
+	for (i = 0; i < AGH_MM_BRINGUP_STAGES; i++)
+		mm->bringup[i] = -1;
+
+	return;
+}
+
+/*
+ * Records the time a bring-up stage has been reached at, if it was not already.
+*/
+static void agh_mm_bringup_mark(struct agh_mm_modem *mm, gint stage) {
+	gint64 elapsed;
+	gint64 previous;
+	gint i;
+
+	if (!mm || stage < 0 || stage >= AGH_MM_BRINGUP_STAGES || mm->bringup[stage] >= 0)
+		return;
+
+	elapsed = (g_get_monotonic_time() - mm->bringup_start) / 1000;
+	mm->bringup[stage] = elapsed;
+
+	previous = 0;
+	for (i = stage - 1; i >= 0; i--) {
+		if (mm->bringup[i] >= 0) {
+			previous = mm->bringup[i];
+			break;
+		}
 	}
 
-	return 0;
+	agh_log_mm_crit("modem %" G_GINT16_FORMAT" bring-up: %s after %" G_GINT64_FORMAT" ms (+%" G_GINT64_FORMAT" ms)",mm->index,agh_mm_bringup_stage_names[stage],elapsed,elapsed - previous);
+
+	return;
 }
 
-static MMObject *agh_mm_get_mmobject(struct agh_state *mstate, MMModem *modem) {
-	GList *l;
-	GList *modems;
-	struct agh_mm_state *mmstate;
-	MMObject *found;
+/*
+ * Adds a modem to the registry, so commands can find it by index without scanning the manager objects.
+ *
+ * Returns: the registry entry, or NULL on failure.
+*/
+static struct agh_mm_modem *agh_mm_registry_add(struct agh_state *mstate, MMObject *object) {
+	struct agh_mm_modem *mm;
+	gint index;
 
-	found = NULL;
+	mm = NULL;
 
-	if (!mstate || !mstate->mmstate || !mstate->mmstate->manager || !modem) {
-		agh_log_mm_crit("AGH state, AGH MM state or manager object where not present");
+	if (!mstate || !mstate->mmstate || !mstate->mmstate->modems || !object) {
+		agh_log_mm_crit("missing context when adding modem to registry");
 		goto out;
 	}
 
-	mmstate = mstate->mmstate;
-
-	modems = g_dbus_object_manager_get_objects(G_DBUS_OBJECT_MANAGER(mmstate->manager));
+	index = agh_mm_modem_path_to_index(mm_object_get_path(object));
+	if (index < 0) {
+		agh_log_mm_crit("unexpected modem path %s",mm_object_get_path(object));
+		goto out;
+	}
 
-	if (!modems) {
-		agh_log_mm_dbg("no modems list");
+	mm = g_try_malloc0(sizeof(*mm));
+	if (!mm) {
+		agh_log_mm_crit("can not allocate modem registry entry");
 		goto out;
 	}
 
-	for (l = modems; l; l = g_list_next(l)) {
-		if (!g_strcmp0(mm_modem_get_path(modem), mm_object_get_path(MM_OBJECT(l->data)))) {
-			found = MM_OBJECT(l->data);
-			modems = g_list_remove(modems, l->data);
-			break;
-		}
+	mm->index = index;
+	mm->object = g_object_ref(object);
+	agh_mm_bringup_reset(mm);
+
+	mm->modem = mm_object_get_modem(object);
+	if (!mm->modem) {
+		agh_log_mm_crit("MMObject not implementing MMModem interface");
+		agh_mm_registry_entry_free(mm);
+		mm = NULL;
+		goto out;
 	}
 
-	g_list_free_full(modems, g_object_unref);
+	mm->interface_removed_id = g_signal_connect(object, "interface-removed", G_CALLBACK(agh_mm_registry_interface_removed), mm);
+
+	g_hash_table_replace(mstate->mmstate->modems, GINT_TO_POINTER(index), mm);
+	agh_log_mm_dbg("modem %" G_GINT16_FORMAT" added to registry",index);
 
 out:
-	return found;
+	return mm;
+}
+
+static void agh_mm_registry_remove(struct agh_state *mstate, MMObject *object) {
+	gint index;
+
+	if (!mstate->mmstate || !mstate->mmstate->modems)
+		return;
+
+	index = agh_mm_modem_path_to_index(mm_object_get_path(object));
+	if (index < 0)
+		return;
+
+	g_hash_table_remove(mstate->mmstate->modems, GINT_TO_POINTER(index));
+
+	return;
+}
+
+struct agh_mm_modem *agh_mm_registry_lookup(struct agh_mm_state *mmstate, gint index) {
+
+	if (!mmstate || !mmstate->modems || index < 0)
+		return NULL;
+
+	return g_hash_table_lookup(mmstate->modems, GINT_TO_POINTER(index));
+}
+
+/*
+ * Interface proxies are acquired when first needed, and kept until the interface goes away.
+ * The returned objects are owned by the registry entry.
+*/
+MMModem3gpp *agh_mm_registry_get_modem3gpp(struct agh_mm_modem *mm) {
+
+	if (!mm)
+		return NULL;
+
+	if (!mm->modem3gpp)
+		mm->modem3gpp = mm_object_get_modem_3gpp(mm->object);
+
+	return mm->modem3gpp;
+}
+
+MMModemTime *agh_mm_registry_get_time(struct agh_mm_modem *mm) {
+
+	if (!mm)
+		return NULL;
+
+	if (!mm->time)
+		mm->time = mm_object_get_modem_time(mm->object);
+
+	return mm->time;
+}
+
+static struct agh_mm_modem *agh_mm_registry_get(struct agh_state *mstate, MMModem *modem) {
+
+	if (!mstate || !mstate->mmstate || !modem)
+		return NULL;
+
+	return agh_mm_registry_lookup(mstate->mmstate, agh_mm_modem_path_to_index(mm_modem_get_path(modem)));
+}
+
+/*
+ * Returns: a new reference to the MMObject of a modem, or NULL if it's not (or no longer) known.
+*/
+static MMObject *agh_mm_get_mmobject(struct agh_state *mstate, MMModem *modem) {
+	struct agh_mm_modem *mm;
+
+	if (!mstate || !mstate->mmstate || !modem) {
+		agh_log_mm_crit("AGH state or AGH MM state where not present");
+		return NULL;
+	}
+
+	mm = agh_mm_registry_get(mstate, modem);
+	if (!mm) {
+		agh_log_mm_dbg("modem %s not found in registry",mm_modem_get_path(modem));
+		return NULL;
+	}
+
+	return g_object_ref(mm->object);
 }
 
 static gchar *agh_mm_sms_info_string(MMSms *sms) {
@@ -516,13 +671,93 @@ static gchar *agh_mm_call_outside_build_message(MMBearer *b, struct uci_section
 	return g_string_free(s, FALSE);
 }
 
+/*
+ * Bearer setup helper invocations are asynchronous, but performed one at a time: the helper should see bearer state
+ * changes in the same order they happened.
+*/
+struct agh_mm_outside_helper_call {
+	gchar *message;
+	gchar *modem_index;
+};
+
+static GQueue *agh_mm_outside_helper_queue;
+static gboolean agh_mm_outside_helper_busy;
+
+static void agh_mm_outside_helper_call_free(gpointer data) {
+	struct agh_mm_outside_helper_call *c = data;
+
+	if (!c)
+		return;
+
+	g_free(c->message);
+	g_free(c->modem_index);
+	g_free(c);
+
+	return;
+}
+
+static void agh_mm_call_outside_helper_next(struct agh_state *mstate);
+
+static void agh_mm_call_outside_helper_done(gint status, struct agh_ubus_call_result *result, gpointer priv) {
+	struct agh_state *mstate = priv;
+	struct agh_mm_outside_helper_call *c;
+	const gchar *callee_output;
+
+	agh_mm_outside_helper_busy = FALSE;
+
+	c = g_queue_pop_head(agh_mm_outside_helper_queue);
+
+	if (status) {
+		agh_log_mm_crit("ubus call failure (code=%" G_GINT16_FORMAT") - %s",status,status > 0 ? ubus_strerror(status) : "internal error");
+	}
+	else {
+		callee_output = agh_ubus_call_result_json(result);
+
+		if (callee_output && c) {
+			agh_mm_report_event(mstate->comm, "agh_mm_call_outside_helper", c->modem_index, callee_output);
+			c->modem_index = NULL;
+			agh_log_mm_dbg("from call: %s",callee_output);
+		}
+	}
+
+	agh_ubus_call_result_free(result);
+	agh_mm_outside_helper_call_free(c);
+
+	/* We are shutting down. */
+	if (status == AGH_UBUS_CALL_ERROR_CANCELLED) {
+		g_queue_free_full(agh_mm_outside_helper_queue, agh_mm_outside_helper_call_free);
+		agh_mm_outside_helper_queue = NULL;
+		return;
+	}
+
+	agh_mm_call_outside_helper_next(mstate);
+
+	return;
+}
+
+static void agh_mm_call_outside_helper_next(struct agh_state *mstate) {
+	struct agh_mm_outside_helper_call *c;
+	gint status;
+
+	while (!agh_mm_outside_helper_busy && agh_mm_outside_helper_queue && (c = g_queue_peek_head(agh_mm_outside_helper_queue))) {
+		status = agh_ubus_call_async(mstate->uctx, "file", "exec", c->message, 0, agh_mm_call_outside_helper_done, mstate, NULL);
+		if (status) {
+			agh_log_mm_crit("ubus call failure (code=%" G_GINT16_FORMAT") - %s",status,status > 0 ? ubus_strerror(status) : "internal error");
+			agh_mm_outside_helper_call_free(g_queue_pop_head(agh_mm_outside_helper_queue));
+			continue;
+		}
+
+		agh_mm_outside_helper_busy = TRUE;
+	}
+
+	return;
+}
+
 static gint agh_mm_call_outside_helper(struct agh_state *mstate, MMBearer *b, struct uci_section *s) {
 	gchar *ubus_call_bearers_info_message;
-	gchar *ubus_message;
+	struct agh_mm_outside_helper_call *c;
 	gint status;
-	gchar *callee_output;
 
-	ubus_message = NULL;
 	status = 0;
 	ubus_call_bearers_info_message = NULL;
 
@@ -551,129 +786,296 @@ static gint agh_mm_call_outside_helper(struct agh_state *mstate, MMBearer *b, st
 		goto out;
 	}
 
-	ubus_message = g_strdup_printf("{\"command\":\"/opt/agh_bearer_setup_helper.sh\",\"env\":%s}", ubus_call_bearers_info_message);
-
-	status = agh_ubus_call(mstate->uctx, "file", "exec", ubus_message);
-	if (status) {
-		agh_log_mm_crit("ubus call failure (code=%" G_GINT16_FORMAT") - %s",status,ubus_strerror(status));
+	c = g_try_malloc0(sizeof(*c));
+	if (!c) {
+		agh_log_mm_crit("unable to allocate helper call");
+		status = 43;
+		goto out;
 	}
-	else {
-		callee_output = agh_ubus_get_call_result(TRUE);
 
-		if (callee_output) {
-			agh_mm_report_event(mstate->comm, "agh_mm_call_outside_helper", agh_mm_modem_to_index(mm_bearer_get_path(b)), callee_output);
-			agh_log_mm_dbg("from call: %s",callee_output);
-			g_free(callee_output);
-		}
-	}
+	c->message = g_strdup_printf("{\"command\":\"/opt/agh_bearer_setup_helper.sh\",\"env\":%s}", ubus_call_bearers_info_message);
+	c->modem_index = agh_mm_modem_to_index(mm_bearer_get_path(b));
+
+	if (!agh_mm_outside_helper_queue)
+		agh_mm_outside_helper_queue = g_queue_new();
+
+	g_queue_push_tail(agh_mm_outside_helper_queue, c);
+	agh_mm_call_outside_helper_next(mstate);
 
 out:
-	g_free(ubus_message);
 	g_free(ubus_call_bearers_info_message);
 	ubus_call_bearers_info_message = NULL;
 	return status;
 }
 
-static void agh_mm_bearer_update_outside(MMBearer *b, GParamSpec *pspec, gpointer user_data) {
-	struct agh_state *mstate = user_data;
-	gint call_outside_error;
+static void agh_mm_bearer_cancel_retry(struct agh_mm_bearer *sb) {
 
-	if (!b) {
-		agh_log_mm_crit("called with a NULL GObject? I did not think this was possible");
+	if (sb->retry) {
+		g_source_destroy(sb->retry);
+		sb->retry = NULL;
+		sb->retry_tag = 0;
+	}
+
+	return;
+}
+
+/*
+ * Destroy function for the bearers hash table values.
+*/
+static void agh_mm_bearer_free(gpointer data) {
+	struct agh_mm_bearer *sb = data;
+
+	if (!sb)
 		return;
+
+	agh_mm_bearer_cancel_retry(sb);
+
+	if (sb->connected_signal_id) {
+		g_signal_handler_disconnect(sb->bearer, sb->connected_signal_id);
+		sb->connected_signal_id = 0;
 	}
 
-	call_outside_error = agh_mm_call_outside_helper(mstate, b, NULL);
-	if (call_outside_error) {
-		agh_log_mm_crit("failure from agh_mm_call_outside_helper (code=%" G_GINT16_FORMAT")",call_outside_error);
+	g_object_unref(sb->bearer);
+	g_free(sb->modem_path);
+	g_free(sb);
+
+	return;
+}
+
+static void agh_mm_bearer_schedule_retry(struct agh_mm_bearer *sb);
+
+static void agh_mm_bearer_connect_finish(MMBearer *b, GAsyncResult *res, gpointer user_data) {
+	struct agh_state *mstate = user_data;
+	struct agh_mm_bearer *sb;
+	GError *current_gerror;
+
+	current_gerror = NULL;
+
+	if (!mstate || !mstate->mmstate || !mstate->mmstate->bearers) {
+		agh_log_mm_crit("missing context");
+		return;
 	}
 
-	switch(mm_bearer_get_connected(b)) {
+	switch(mm_bearer_connect_finish(b, res, &current_gerror)) {
 		case TRUE:
-			agh_log_mm_dbg("we are connected!");
+			agh_log_mm_dbg("bearer %s successfully connected",mm_bearer_get_path(b));
 			break;
 		case FALSE:
-			agh_log_mm_dbg("we are NOT connected...");
-			g_object_unref(b);
+			agh_log_mm_crit("failed to connect bearer %s",mm_bearer_get_path(b));
+			agh_modem_report_gerror_message(&current_gerror, NULL);
 			break;
 	}
 
+	/* The bearer may have been deleted or its modem removed while the request was in flight. */
+	sb = g_hash_table_lookup(mstate->mmstate->bearers, mm_bearer_get_path(b));
+	if (!sb)
+		return;
+
+	sb->connecting = FALSE;
+
+	if (!mm_bearer_get_connected(b)) {
+		sb->failures++;
+		agh_mm_bearer_schedule_retry(sb);
+	}
+
 	return;
 }
 
-static gint agh_mm_bearer_signal(struct agh_state *mstate, MMBearer *b) {
-	gint retval;
-	gulong signal_id;
+/*
+ * Asks ModemManager to connect a supervised bearer, unless it's connected, a request is already in flight or its modem
+ * is not registered.
+*/
+static void agh_mm_bearer_connect(struct agh_mm_bearer *sb) {
+	struct agh_state *mstate = sb->mstate;
 
-	retval = 0;
+	if (sb->connected || sb->connecting || sb->suspended || mstate->exiting || !mstate->mmstate)
+		return;
 
-	if (!mstate || !mstate->mmstate || !mstate->mmstate->manager || !b) {
-		agh_log_mm_crit("missing context when connecting signals to bearer");
-		retval = 71;
-		goto out;
-	}
+	agh_mm_bearer_cancel_retry(sb);
 
-	signal_id = g_signal_connect(b, "notify::connected", G_CALLBACK(agh_mm_bearer_update_outside), mstate);
-	if (!signal_id) {
-		agh_log_mm_crit("failure while connecting signals to bearer");
-		retval = 72;
-		goto out;
+	sb->connecting = TRUE;
+
+	agh_log_mm_dbg("requesting for bearer %s to be connected", mm_bearer_get_path(sb->bearer));
+	mm_bearer_connect(sb->bearer, mstate->mmstate->cancellable, (GAsyncReadyCallback)agh_mm_bearer_connect_finish, mstate);
+
+	return;
+}
+
+static gboolean agh_mm_bearer_retry(gpointer data) {
+	struct agh_mm_bearer *sb = data;
+
+	sb->retry = NULL;
+	sb->retry_tag = 0;
+
+	agh_mm_bearer_connect(sb);
+
+	return FALSE;
+}
+
+/*
+ * Schedules a reconnection attempt for a bearer, doubling the delay each time up to AGH_MM_BEARER_RETRY_MAX_INTERVAL.
+ * The delay is reset once the bearer gets connected.
+*/
+static void agh_mm_bearer_schedule_retry(struct agh_mm_bearer *sb) {
+	struct agh_state *mstate = sb->mstate;
+
+	if (sb->retry || sb->suspended || mstate->exiting)
+		return;
+
+	if (!sb->retry_delay)
+		sb->retry_delay = AGH_MM_BEARER_RETRY_MIN_INTERVAL;
+
+	agh_log_mm_dbg("bearer %s will be reconnected in %" G_GUINT32_FORMAT" ms",mm_bearer_get_path(sb->bearer),sb->retry_delay);
+
+	sb->retry = g_timeout_source_new(sb->retry_delay);
+	g_source_set_callback(sb->retry, agh_mm_bearer_retry, sb, NULL);
+	sb->retry_tag = g_source_attach(sb->retry, mstate->ctx);
+	g_source_unref(sb->retry);
+
+	if (!sb->retry_tag) {
+		agh_log_mm_crit("failed to attach bearer retry source to GMainContext");
+		sb->retry = NULL;
+		return;
 	}
-	agh_log_mm_dbg("signals connected to bearer %s",mm_bearer_get_path(b));
 
-out:
-	return retval;
+	sb->retry_delay = MIN(sb->retry_delay * 2, AGH_MM_BEARER_RETRY_MAX_INTERVAL);
+
+	return;
 }
 
-static void agh_mm_connect_bearer_finish(MMBearer *b, GAsyncResult *res, gpointer user_data) {
-	struct agh_state *mstate = user_data;
+/*
+ * Called when ModemManager notifies a change of the bearer "connected" property. Only actual transitions are acted upon.
+*/
+static void agh_mm_bearer_update_outside(MMBearer *b, GParamSpec *pspec, gpointer user_data) {
+	struct agh_mm_bearer *sb = user_data;
+	struct agh_state *mstate;
+	gboolean connected;
+	gint call_outside_error;
 
-	if (!mstate || !mstate->mmstate) {
-		agh_log_mm_crit("missing context");
+	if (!b || !sb) {
+		agh_log_mm_crit("called with a NULL GObject or supervision record? I did not think this was possible");
+		return;
+	}
+
+	mstate = sb->mstate;
+	connected = mm_bearer_get_connected(b);
+
+	if (connected == sb->connected)
 		return;
+
+	sb->connected = connected;
+
+	call_outside_error = agh_mm_call_outside_helper(mstate, b, NULL);
+	if (call_outside_error) {
+		agh_log_mm_crit("failure from agh_mm_call_outside_helper (code=%" G_GINT16_FORMAT")",call_outside_error);
 	}
 
-	switch(mm_bearer_connect_finish(b, res, &mstate->mmstate->current_gerror)) {
+	switch(connected) {
 		case TRUE:
-			agh_log_mm_dbg("bearer successfully connected");
+			agh_log_mm_dbg("we are connected!");
+			agh_mm_bearer_cancel_retry(sb);
+			sb->retry_delay = 0;
+
+			/* Data link is up: no point in waiting for XMPP backoff to expire. */
+			agh_xmpp_reconnect_now(mstate);
 			break;
 		case FALSE:
-			agh_log_mm_crit("failed to connect bearer");
-			agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
-			g_object_unref(b);
+			agh_log_mm_dbg("we are NOT connected...");
+			agh_mm_bearer_schedule_retry(sb);
 			break;
 	}
 
-	agh_mm_async_del(mstate);
-
 	return;
 }
 
-static void agh_mm_modem_connect_bearer(gpointer data, gpointer user_data) {
-	MMBearer *b = MM_BEARER(data);
-	struct agh_state *mstate = user_data;
+/*
+ * Starts supervising a bearer: its connection state is tracked via the "notify::connected" signal, and it will be
+ * reconnected when it drops.
+ *
+ * Returns: the supervision record (an already present one, if the bearer was known), or NULL on failure.
+*/
+static struct agh_mm_bearer *agh_mm_bearer_supervise(struct agh_state *mstate, const gchar *modem_path, MMBearer *b) {
+	struct agh_mm_bearer *sb;
 	const gchar *bpath;
 
-	if (!b) {
-		agh_log_mm_crit("can not connect a NULL bearer");
-		return;
+	sb = NULL;
+
+	if (!mstate || !mstate->mmstate || !mstate->mmstate->bearers || !b) {
+		agh_log_mm_crit("missing context when supervising bearer");
+		goto out;
+	}
+
+	bpath = mm_bearer_get_path(b);
+
+	sb = g_hash_table_lookup(mstate->mmstate->bearers, bpath);
+	if (sb)
+		goto out;
+
+	sb = g_try_malloc0(sizeof(*sb));
+	if (!sb) {
+		agh_log_mm_crit("can not allocate bearer supervision record");
+		goto out;
+	}
+
+	sb->mstate = mstate;
+	sb->bearer = g_object_ref(b);
+	sb->modem_path = g_strdup(modem_path);
+	sb->connected = mm_bearer_get_connected(b);
+
+	sb->connected_signal_id = g_signal_connect(b, "notify::connected", G_CALLBACK(agh_mm_bearer_update_outside), sb);
+	if (!sb->connected_signal_id) {
+		agh_log_mm_crit("failure while connecting signals to bearer");
+		agh_mm_bearer_free(sb);
+		sb = NULL;
+		goto out;
 	}
 
-	if (mm_bearer_get_connected(b))
+	g_hash_table_insert(mstate->mmstate->bearers, g_strdup(bpath), sb);
+	agh_log_mm_dbg("supervising bearer %s",bpath);
+
+out:
+	return sb;
+}
+
+/*
+ * Stops reconnection attempts for bearers of a modem that is no longer registered. They'll be resumed when the modem
+ * registers again.
+*/
+static void agh_mm_bearers_suspend(struct agh_state *mstate, const gchar *modem_path) {
+	GHashTableIter iter;
+	gpointer value;
+	struct agh_mm_bearer *sb;
+
+	if (!mstate->mmstate || !mstate->mmstate->bearers)
 		return;
 
-	bpath = mm_bearer_get_path(b);
+	g_hash_table_iter_init(&iter, mstate->mmstate->bearers);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		sb = value;
+
+		if (g_strcmp0(sb->modem_path, modem_path))
+			continue;
 
-	agh_mm_async_add(mstate);
+		sb->suspended = TRUE;
+		agh_mm_bearer_cancel_retry(sb);
+	}
 
-	agh_log_mm_dbg("requesting for bearer %s to be connected", bpath);
-	agh_mm_bearer_signal(mstate, g_object_ref(b));
-	mm_bearer_connect(b, mstate->mmstate->cancellable, (GAsyncReadyCallback)agh_mm_connect_bearer_finish, mstate);
 	return;
 }
 
+static gboolean agh_mm_bearer_of_modem(gpointer key, gpointer value, gpointer user_data) {
+	struct agh_mm_bearer *sb = value;
+
+	return !g_strcmp0(sb->modem_path, user_data);
+}
+
+/*
+ * Bearers list requests in flight are counted per modem, so the safety-net sweep only skips busy modems. The callback
+ * should call agh_mm_modem_bearers_done.
+*/
 static gint agh_mm_modem_bearers(struct agh_state *mstate, MMModem *modem, GAsyncReadyCallback cb) {
 	gint retval;
+	struct agh_mm_modem *mm;
 
 	retval = 0;
 
@@ -683,7 +1085,9 @@ static gint agh_mm_modem_bearers(struct agh_state *mstate, MMModem *modem, GAsyn
 		goto out;
 	}
 
-	agh_mm_async_init(mstate);
+	mm = agh_mm_registry_get(mstate, modem);
+	if (mm)
+		mm->pending_bearer_ops++;
 
 	mm_modem_list_bearers(modem, mstate->mmstate->cancellable, (GAsyncReadyCallback)cb, mstate);
 
@@ -691,85 +1095,79 @@ out:
 	return retval;
 }
 
+static void agh_mm_modem_bearers_done(struct agh_state *mstate, MMModem *modem) {
+	struct agh_mm_modem *mm;
+
+	mm = agh_mm_registry_get(mstate, modem);
+	if (mm && mm->pending_bearer_ops)
+		mm->pending_bearer_ops--;
+
+	return;
+}
+
+/*
+ * Supervises and connects the bearers of a registered modem. Used when the modem registers, and by the safety-net sweep;
+ * bearers waiting for a reconnection attempt are left to their backoff.
+*/
 static void agh_mm_modem_connect_bearers(GObject *o, GAsyncResult *res, gpointer user_data) {
 	struct agh_state *mstate = user_data;
 	GList *current_bearers;
+	GList *l;
 	MMModem *modem = MM_MODEM(o);
+	struct agh_mm_bearer *sb;
+	GError *current_gerror;
+
+	current_gerror = NULL;
 
 	if (!mstate || !mstate->mmstate) {
 		agh_log_mm_crit("missing context");
 		return;
 	}
 
-	current_bearers = mm_modem_list_bearers_finish(modem, res, &mstate->mmstate->current_gerror);
+	current_bearers = mm_modem_list_bearers_finish(modem, res, &current_gerror);
 	if (!current_bearers) {
 		agh_log_mm_crit("problem when checking bearers");
-		agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
-		goto out;
-	}
-
-	g_list_foreach(current_bearers, agh_mm_modem_connect_bearer, mstate);
-
-	g_list_free_full(current_bearers, g_object_unref);
-
-out:
-	agh_mm_async_del(mstate);
-	return;
-}
-
-static gint agh_mm_modem_delete_all_bearers_sync(struct agh_state *mstate, MMModem *modem) {
-	GList *current_bearers;
-	GList *l;
-	MMBearer *b;
-	gint retval;
-
-	retval = 0;
-
-	current_bearers = mm_modem_list_bearers_sync(modem, NULL, &mstate->mmstate->current_gerror);
-	if (!current_bearers) {
-		agh_log_mm_crit("problem when requesting bearers list for deletion");
-		agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
-		retval = 15;
+		agh_modem_report_gerror_message(&current_gerror, NULL);
 		goto out;
 	}
 
 	for (l = current_bearers; l; l = g_list_next(l)) {
-		b = MM_BEARER(l->data);
-		if (b) {
-			if (!mm_modem_delete_bearer_sync(modem, mm_bearer_get_path(b), NULL, &mstate->mmstate->current_gerror)) {
-				agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
-				retval = 81;
-			}
-			else {
-				agh_log_mm_dbg("bearer delete OK");
-			}
+		sb = agh_mm_bearer_supervise(mstate, mm_modem_get_path(modem), MM_BEARER(l->data));
+		if (!sb)
+			continue;
+
+		if (sb->suspended) {
+			sb->suspended = FALSE;
+			sb->retry_delay = 0;
 		}
+
+		if (!sb->retry)
+			agh_mm_bearer_connect(sb);
 	}
 
 	g_list_free_full(current_bearers, g_object_unref);
 
 out:
-	return retval;
+	agh_mm_modem_bearers_done(mstate, modem);
+	return;
 }
 
-static gint agh_mm_checker_get_modem(struct agh_state *mstate, MMObject *modem) {
+static gint agh_mm_checker_get_modem(struct agh_state *mstate, struct agh_mm_modem *mm) {
 	gint retval;
-	MMModem *m;
 	MMModemState state;
 
 	retval = 0;
 
-	m = mm_object_get_modem(modem);
-	if (!m) {
-		agh_log_mm_crit("failure obtaining modem object");
-		retval = 74;
+	/* a previous request for this modem is still in flight */
+	if (mm->pending_bearer_ops) {
+		agh_log_mm_dbg("skipping modem %" G_GINT16_FORMAT" due to pending asynchronous operations on bearers (%" G_GINT16_FORMAT")",mm->index,mm->pending_bearer_ops);
 		goto out;
 	}
 
-	state = mm_modem_get_state(m);
+	state = mm_modem_get_state(mm->modem);
 
 	if (state == MM_MODEM_STATE_REGISTERED || state == MM_MODEM_STATE_CONNECTED) {
-		retval = agh_mm_modem_bearers(mstate, m, agh_mm_modem_connect_bearers);
+		retval = agh_mm_modem_bearers(mstate, mm->modem, agh_mm_modem_connect_bearers);
 		if (retval) {
 			agh_log_mm_crit("failure from agh_mm_modem_bearers (code=%" G_GINT16_FORMAT")",retval);
 			goto out;
@@ -777,16 +1175,13 @@ static gint agh_mm_checker_get_modem(struct agh_state *mstate, MMObject *modem)
 	}
 
 out:
-	if (m)
-		g_object_unref(m);
-
 	return retval;
 }
 
 static gboolean agh_mm_checker(gpointer data) {
 	struct agh_state *mstate = data;
-	GList *modems;
-	GList *l;
+	GHashTableIter iter;
+	gpointer value;
 	gint retval;
 
 	/* agh_log_mm_dbg("tick"); */
@@ -798,32 +1193,21 @@ static gboolean agh_mm_checker(gpointer data) {
 		return FALSE;
 	}
 
-	if (mstate->mmstate->pending_bearer_async_ops) {
-
-		if (mstate->mmstate->pending_bearer_async_ops > 1 || mstate->mmstate->pending_bearer_async_ops < 0) {
-			agh_log_mm_crit("skipping check due to pending asynchronous operations on bearers (%" G_GINT16_FORMAT")",mstate->mmstate->pending_bearer_async_ops);
-		}
-
-		return TRUE;
-	}
-
-	modems = g_dbus_object_manager_get_objects(G_DBUS_OBJECT_MANAGER(mstate->mmstate->manager));
-	if (!modems) {
+	if (!mstate->mmstate->modems || !g_hash_table_size(mstate->mmstate->modems)) {
 		agh_log_mm_dbg("no more modems; see you next time!");
 		mstate->mmstate->bearers_check = NULL;
 		mstate->mmstate->bearers_check_tag = 0;
 		return FALSE;
 	}
 
-	for (l = modems; l; l = g_list_next(l)) {
-		retval = agh_mm_checker_get_modem(mstate, (MMObject *)(l->data));
+	g_hash_table_iter_init(&iter, mstate->mmstate->modems);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		retval = agh_mm_checker_get_modem(mstate, value);
 		if (retval) {
 			agh_log_mm_crit("got failure from agh_mm_checker_get_modem (code=%" G_GINT16_FORMAT")",retval);
 		}
 	}
 
-	g_list_free_full(modems, g_object_unref);
-
 	return TRUE;
 }
 
@@ -841,8 +1225,12 @@ static gint agh_mm_start_bearer_checker(struct agh_state *mstate) {
 
 	mmstate = mstate->mmstate;
 
+	/* Bearers are supervised via their signals; the periodic sweep is just a safety net, and may be disabled. */
+	if (!mmstate->bearer_check_interval)
+		goto out;
+
 	if (!mmstate->bearers_check) {
-		agh_log_mm_dbg("activating bearers checker (will run every %"G_GINT32_FORMAT" usecs)",mmstate->bearer_check_interval);
+		agh_log_mm_dbg("activating bearers checker (will run every %"G_GINT32_FORMAT" msecs)",mmstate->bearer_check_interval);
 		mmstate->bearers_check = g_timeout_source_new(mmstate->bearer_check_interval);
 		g_source_set_callback(mmstate->bearers_check, agh_mm_checker, mstate, NULL);
 		mmstate->bearers_check_tag = g_source_attach(mmstate->bearers_check, mstate->ctx);
@@ -872,7 +1260,10 @@ static void agh_mm_connect_bearer(GObject *o, GAsyncResult *res, gpointer user_d
 	struct agh_state *mstate;
 	struct uci_section *section;
 	gint call_outside_error;
+	struct agh_mm_bearer *sb;
+	GError *current_gerror;
 
+	current_gerror = NULL;
 	b = NULL;
 
 	mstate = agh_mm_config_build_bearer_ctx_get_mstate(bctx);
@@ -882,10 +1273,10 @@ static void agh_mm_connect_bearer(GObject *o, GAsyncResult *res, gpointer user_d
 		goto out;
 	}
 
-	b = mm_modem_create_bearer_finish(modem, res, &mstate->mmstate->current_gerror);
+	b = mm_modem_create_bearer_finish(modem, res, &current_gerror);
 	if (!b) {
 		agh_log_mm_crit("bearer creation failed for modem %s",mm_modem_get_path(modem));
-		agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
+		agh_modem_report_gerror_message(&current_gerror, NULL);
 		goto out;
 	}
 
@@ -899,6 +1290,12 @@ static void agh_mm_connect_bearer(GObject *o, GAsyncResult *res, gpointer user_d
 		agh_log_mm_crit("failure from agh_mm_call_outside_helper (code=%" G_GINT16_FORMAT")",call_outside_error);
 	}
 
+	agh_mm_bringup_mark(agh_mm_registry_get(mstate, modem), AGH_MM_BRINGUP_BEARER_CREATED);
+
+	sb = agh_mm_bearer_supervise(mstate, mm_modem_get_path(modem), b);
+	if (sb)
+		agh_mm_bearer_connect(sb);
+
 out:
 	if (b)
 		g_object_unref(b);
@@ -1034,7 +1431,9 @@ static void agh_mm_add_and_connect_bearers_from_config_check_sim(MMModem *modem,
 	struct uci_section *system_profile_bearer;
 	gint retval;
 	const gchar **bearer_paths;
+	GError *current_gerror;
 
+	current_gerror = NULL;
 	bearers_to_build = NULL;
 	sim = NULL;
 
@@ -1043,16 +1442,20 @@ static void agh_mm_add_and_connect_bearers_from_config_check_sim(MMModem *modem,
 		goto out;
 	}
 
-	sim = mm_modem_get_sim_finish(modem, res, &mstate->mmstate->current_gerror);
+	sim = mm_modem_get_sim_finish(modem, res, &current_gerror);
 	if (!sim) {
 		agh_log_mm_crit("unable to get SIM for modem %s while checking for defined bearers",mm_modem_get_path(modem));
-		agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
+		agh_modem_report_gerror_message(&current_gerror, NULL);
 		goto out;
 	}
 
 	bearer_paths = (const gchar **)mm_modem_get_bearer_paths(modem);
 	if (bearer_paths && bearer_paths[0]) {
-		agh_log_mm_dbg("not creating bearers for this modem due to already present ones");
+		agh_log_mm_dbg("not creating bearers for this modem due to already present ones, connecting them");
+		retval = agh_mm_modem_bearers(mstate, modem, agh_mm_modem_connect_bearers);
+		if (retval)
+			agh_log_mm_crit("failure while connecting present bearers (code=%" G_GINT16_FORMAT")",retval);
+
 		goto out;
 	}
 
@@ -1170,26 +1573,34 @@ static void agh_mm_modem_delete_bearer(gpointer data, gpointer user_data) {
 static void agh_mm_modem_delete_bearers(GObject *o, GAsyncResult *res, gpointer user_data) {
 	struct agh_state *mstate = user_data;
 	GList *current_bearers;
+	GList *l;
 	MMModem *modem = MM_MODEM(o);
+	GError *current_gerror;
+
+	current_gerror = NULL;
 
 	if (!mstate || !mstate->mmstate) {
 		agh_log_mm_crit("missing context");
 		goto out;
 	}
 
-	current_bearers = mm_modem_list_bearers_finish(modem, res, &mstate->mmstate->current_gerror);
+	current_bearers = mm_modem_list_bearers_finish(modem, res, &current_gerror);
 	if (!current_bearers) {
 		agh_log_mm_crit("problem when deleting bearers");
-		agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
+		agh_modem_report_gerror_message(&current_gerror, NULL);
 		goto out;
 	}
 
+	if (mstate->mmstate->bearers)
+		for (l = current_bearers; l; l = g_list_next(l))
+			g_hash_table_remove(mstate->mmstate->bearers, mm_bearer_get_path(MM_BEARER(l->data)));
+
 	g_list_foreach(current_bearers, agh_mm_modem_delete_bearer, modem);
 
 	g_list_free_full(current_bearers, g_object_unref);
 
 out:
-	agh_mm_async_del(mstate);
+	agh_mm_modem_bearers_done(mstate, modem);
 	return;
 }
 
@@ -1309,19 +1720,22 @@ static gint agh_mm_modem_signals(struct agh_state *mstate, MMModem *modem, MMMod
 }
 
 static void agh_mm_modem_enable_finish(MMModem *modem, GAsyncResult *res, struct agh_state *mstate) {
+	GError *current_gerror;
+
+	current_gerror = NULL;
 
 	if (!mstate || !mstate->mmstate) {
 		agh_log_mm_crit("missing context");
 		return;
 	}
 
-	switch(mm_modem_enable_finish(modem, res, &mstate->mmstate->current_gerror)) {
+	switch(mm_modem_enable_finish(modem, res, &current_gerror)) {
 		case TRUE:
 			agh_log_mm_dbg("OK");
 			break;
 		case FALSE:
 			agh_log_mm_crit("can not enable modem");
-			agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
+			agh_modem_report_gerror_message(&current_gerror, NULL);
 			break;
 	}
 
@@ -1406,18 +1820,22 @@ static gint agh_mm_modem_enable_setup(struct agh_state *mstate, MMModem *modem)
 }
 
 static void agh_mm_sim_pin_unlock_finish(MMSim *sim, GAsyncResult *res, struct agh_state *mstate) {
+	GError *current_gerror;
+
+	current_gerror = NULL;
+
 	if (!mstate || !mstate->mmstate) {
 		agh_log_mm_crit("missing context");
 		return;
 	}
 
-	switch(mm_sim_send_pin_finish(sim, res, &mstate->mmstate->current_gerror)) {
+	switch(mm_sim_send_pin_finish(sim, res, &current_gerror)) {
 		case TRUE:
 			agh_log_mm_dbg("unlock was successful! See you!");
 			break;
 		case FALSE:
 			agh_log_mm_crit("unlock failed!");
-			agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, NULL);
+			agh_modem_report_gerror_message(&current_gerror, NULL);
 			break;
 	}
 
@@ -1432,7 +1850,9 @@ static void agh_mm_sim_pin_unlock_stage1(MMModem *modem, GAsyncResult *res, stru
 	guint left_pin_retries;
 	MMUnlockRetries *retries;
 	gint error_code;
+	GError *current_gerror;
 
+	current_gerror = NULL;
 	retries = NULL;
 	sim = NULL;
 
@@ -1441,10 +1861,10 @@ static void agh_mm_sim_pin_unlock_stage1(MMModem *modem, GAsyncResult *res, stru
 		goto out;
 	}
 
-	sim = mm_modem_get_sim_finish(modem, res, &mmstate->current_gerror);
+	sim = mm_modem_get_sim_finish(modem, res, &current_gerror);
 	if (!sim) {
 		agh_log_mm_crit("unable to get SIM for modem %s",mm_modem_get_path(modem));
-		agh_modem_report_gerror_message(&mmstate->current_gerror, NULL);
+		agh_modem_report_gerror_message(&current_gerror, NULL);
 		goto out;
 	}
 
@@ -1564,6 +1984,7 @@ static gint agh_mm_modem_unlock(struct agh_state *mstate, MMModem *modem) {
 
 static void agh_mm_statechange(MMModem *modem, MMModemState oldstate, MMModemState newstate, MMModemStateChangeReason reason, gpointer user_data) {
 	struct agh_state *mstate = user_data;
+	struct agh_mm_modem *mm;
 	gint retval;
 
 	retval = 0;
@@ -1576,6 +1997,27 @@ static void agh_mm_statechange(MMModem *modem, MMModemState oldstate, MMModemSta
 	if (retval)
 		agh_log_mm_crit("failure from agh_mm_modem_signals (code=%" G_GINT16_FORMAT")",retval);
 
+	if (newstate < MM_MODEM_STATE_REGISTERED && oldstate >= MM_MODEM_STATE_REGISTERED)
+		agh_mm_bearers_suspend(mstate, mm_modem_get_path(modem));
+
+	mm = agh_mm_registry_get(mstate, modem);
+	if (mm) {
+		if (newstate < oldstate && newstate <= MM_MODEM_STATE_DISABLED)
+			agh_mm_bringup_reset(mm);
+
+		if (newstate >= MM_MODEM_STATE_DISABLED)
+			agh_mm_bringup_mark(mm, AGH_MM_BRINGUP_UNLOCKED);
+
+		if (newstate >= MM_MODEM_STATE_ENABLED)
+			agh_mm_bringup_mark(mm, AGH_MM_BRINGUP_ENABLED);
+
+		if (newstate >= MM_MODEM_STATE_REGISTERED)
+			agh_mm_bringup_mark(mm, AGH_MM_BRINGUP_REGISTERED);
+
+		if (newstate == MM_MODEM_STATE_CONNECTED)
+			agh_mm_bringup_mark(mm, AGH_MM_BRINGUP_CONNECTED);
+	}
+
 	switch(newstate) {
 		case MM_MODEM_STATE_FAILED:
 			agh_mm_report_event(mstate->comm, AGH_MM_MODEM_EVENT_NAME, agh_mm_modem_to_index(mm_modem_get_path(modem)), mm_modem_state_failed_reason_get_string(mm_modem_get_state_failed_reason(modem)));
@@ -1638,6 +2080,13 @@ static void agh_mm_statechange(MMModem *modem, MMModemState oldstate, MMModemSta
 			break;
 		case MM_MODEM_STATE_CONNECTED:
 			agh_log_mm_crit("modem %s is connected!",mm_modem_get_path(modem));
+
+			/* Found already connected (e.g. we were restarted): start supervising its bearers. */
+			if (oldstate < MM_MODEM_STATE_REGISTERED) {
+				retval = agh_mm_modem_bearers(mstate, modem, agh_mm_modem_connect_bearers);
+				if (retval)
+					agh_log_mm_crit("failure while supervising bearers (code=%" G_GINT16_FORMAT")",retval);
+			}
 			break;
 	}
 
@@ -1779,21 +2228,23 @@ out:
 }
 
 static gint agh_mm_handle_modem(struct agh_state *mstate, MMObject *modem) {
+	struct agh_mm_modem *mm;
 	MMModem *m;
 	MMModem3gpp *m3gpp;
 	gint retval;
 	gulong signal_id;
 
 	retval = 0;
-	m3gpp = NULL;
 
-	m = mm_object_get_modem(modem);
-	if (!m) {
-		agh_log_mm_crit("MMObject not implementing MMModem interface");
+	mm = agh_mm_registry_add(mstate, modem);
+	if (!mm) {
+		agh_log_mm_crit("unable to add modem to registry");
 		retval = 1;
 		goto out;
 	}
 
+	m = mm->modem;
+
 	signal_id = g_signal_connect(m, "state-changed", G_CALLBACK(agh_mm_statechange), mstate);
 	if (!signal_id) {
 		agh_log_mm_crit("unable to connect state-changed signal");
@@ -1803,17 +2254,11 @@ static gint agh_mm_handle_modem(struct agh_state *mstate, MMObject *modem) {
 
 	agh_mm_statechange(m, MM_MODEM_STATE_UNKNOWN, mm_modem_get_state(m), MM_MODEM_STATE_CHANGE_REASON_UNKNOWN, mstate);
 
-	m3gpp = mm_object_get_modem_3gpp(modem);
+	m3gpp = agh_mm_registry_get_modem3gpp(mm);
 	if (m3gpp)
 		agh_mm_handle_modem_showchanges(mstate, m, m3gpp);
 
 out:
-	if (m)
-		g_object_unref(m);
-
-	if (m3gpp)
-		g_object_unref(m3gpp);
-
 	return retval;
 }
 
@@ -1840,6 +2285,9 @@ static gint agh_mm_unhandle_modem(struct agh_state *mstate, MMObject *modem) {
 	else
 		agh_log_mm_crit("%" G_GINT16_FORMAT" handlers matched during modem signal disconnect (MMModem)",num_handlers);
 
+	if (mstate->mmstate && mstate->mmstate->bearers)
+		g_hash_table_foreach_remove(mstate->mmstate->bearers, agh_mm_bearer_of_modem, (gpointer)mm_modem_get_path(m));
+
 	m3gpp = mm_object_get_modem_3gpp(modem);
 	if (m3gpp)
 		agh_mm_showchanges(mstate, m, m3gpp, FALSE);
@@ -1851,6 +2299,8 @@ out:
 	if (m3gpp)
 		g_object_unref(m3gpp);
 
+	agh_mm_registry_remove(mstate, modem);
+
 	return retval;
 }
 
@@ -1921,6 +2371,12 @@ static gint agh_mm_mngr_deinit(struct agh_state *mstate) {
 		mmstate->bearers_check_tag = 0;
 	}
 
+	if (mmstate->bearers)
+		g_hash_table_remove_all(mmstate->bearers);
+
+	if (mmstate->modems)
+		g_hash_table_remove_all(mmstate->modems);
+
 	if (mmstate->current_cmd) {
 		agh_log_mm_crit("current_cmd ptr was still present");
 		agh_cmd_free(mmstate->current_cmd);
@@ -1969,53 +2425,186 @@ out:
 	return retval;
 }
 
-static gint agh_mm_disable_all_modems_sync(struct agh_state *mstate) {
+/*
+ * Modems are disabled, and their bearers deleted, concurrently while exiting. Results are dispatched in a private
+ * GMainContext, so nothing else runs meanwhile; the whole operation is bound by AGH_MM_SHUTDOWN_DEADLINE.
+*/
+struct agh_mm_shutdown {
+	GMainContext *ctx;
+	GCancellable *cancellable;
+	gint pending;
+	gboolean expired;
+};
+
+struct agh_mm_shutdown_modem {
+	struct agh_mm_shutdown *shutdown;
+	MMModem *modem;
+	gint64 start;
+	gint pending_deletes;
+	gboolean failed;
+};
+
+static void agh_mm_shutdown_modem_done(struct agh_mm_shutdown_modem *sm) {
+
+	agh_log_mm_crit("modem %s shut down %s in %" G_GINT64_FORMAT" ms",mm_modem_get_path(sm->modem),sm->failed ? "with errors" : "cleanly",(g_get_monotonic_time() - sm->start) / 1000);
+
+	sm->shutdown->pending--;
+
+	g_object_unref(sm->modem);
+	g_free(sm);
+
+	return;
+}
+
+static void agh_mm_shutdown_delete_bearer_finish(MMModem *modem, GAsyncResult *res, gpointer user_data) {
+	struct agh_mm_shutdown_modem *sm = user_data;
+	GError *current_gerror;
+
+	current_gerror = NULL;
+
+	if (!mm_modem_delete_bearer_finish(modem, res, &current_gerror)) {
+		agh_log_mm_crit("can not delete bearer");
+		agh_modem_report_gerror_message(&current_gerror, NULL);
+		sm->failed = TRUE;
+	}
+
+	sm->pending_deletes--;
+	if (!sm->pending_deletes)
+		agh_mm_shutdown_modem_done(sm);
+
+	return;
+}
+
+static void agh_mm_shutdown_list_bearers_finish(MMModem *modem, GAsyncResult *res, gpointer user_data) {
+	struct agh_mm_shutdown_modem *sm = user_data;
+	GError *current_gerror;
+	GList *current_bearers;
 	GList *l;
-	GList *modems;
+
+	current_gerror = NULL;
+
+	current_bearers = mm_modem_list_bearers_finish(modem, res, &current_gerror);
+	if (current_gerror) {
+		agh_log_mm_crit("problem when requesting bearers list for deletion");
+		agh_modem_report_gerror_message(&current_gerror, NULL);
+		sm->failed = TRUE;
+	}
+
+	for (l = current_bearers; l; l = g_list_next(l)) {
+		sm->pending_deletes++;
+		mm_modem_delete_bearer(modem, mm_bearer_get_path(MM_BEARER(l->data)), sm->shutdown->cancellable, (GAsyncReadyCallback)agh_mm_shutdown_delete_bearer_finish, sm);
+	}
+
+	g_list_free_full(current_bearers, g_object_unref);
+
+	if (!sm->pending_deletes)
+		agh_mm_shutdown_modem_done(sm);
+
+	return;
+}
+
+static void agh_mm_shutdown_disable_finish(MMModem *modem, GAsyncResult *res, gpointer user_data) {
+	struct agh_mm_shutdown_modem *sm = user_data;
+	GError *current_gerror;
+
+	current_gerror = NULL;
+
+	if (!mm_modem_disable_finish(modem, res, &current_gerror)) {
+		agh_log_mm_crit("problem while disabling modem %s",mm_modem_get_path(modem));
+		agh_modem_report_gerror_message(&current_gerror, NULL);
+		sm->failed = TRUE;
+		agh_mm_shutdown_modem_done(sm);
+		return;
+	}
+
+	agh_log_mm_dbg("modem %s is now disabled",mm_modem_get_path(modem));
+	mm_modem_list_bearers(modem, sm->shutdown->cancellable, (GAsyncReadyCallback)agh_mm_shutdown_list_bearers_finish, sm);
+
+	return;
+}
+
+static gboolean agh_mm_shutdown_deadline(gpointer data) {
+	struct agh_mm_shutdown *shutdown = data;
+
+	agh_log_mm_crit("shutdown deadline expired with %" G_GINT16_FORMAT" modems still pending, cancelling",shutdown->pending);
+
+	shutdown->expired = TRUE;
+	g_cancellable_cancel(shutdown->cancellable);
+
+	return FALSE;
+}
+
+static gint agh_mm_disable_all_modems(struct agh_state *mstate) {
+	struct agh_mm_shutdown shutdown;
+	struct agh_mm_shutdown_modem *sm;
+	GHashTableIter iter;
+	gpointer value;
+	GSource *deadline;
+	gint64 start;
 	gint retval;
-	struct agh_mm_state *mmstate;
-	MMModem *m;
 
 	retval = 0;
 
-	if (!mstate || !mstate->mmstate || !mstate->mmstate->manager) {
+	if (!mstate || !mstate->mmstate || !mstate->mmstate->manager || !mstate->mmstate->modems) {
 		agh_log_mm_crit("AGH state, AGH MM state or manager object where not present");
 		retval = 20;
 		goto out;
 	}
 
-	mmstate = mstate->mmstate;
-
-	modems = g_dbus_object_manager_get_objects(G_DBUS_OBJECT_MANAGER(mmstate->manager));
-
-	if (!modems) {
-		agh_log_mm_dbg("seems no modems have been found)");
-		retval = 21;
+	if (!g_hash_table_size(mstate->mmstate->modems)) {
+		agh_log_mm_dbg("seems no modems have been found");
 		goto out;
 	}
 
-	for (l = modems; l; l = g_list_next(l)) {
-		m = mm_object_get_modem(MM_OBJECT(l->data));
-		if (m) {
-			g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(m), 45 * 1000);
-			if (!mm_modem_disable_sync(m, NULL, &mmstate->current_gerror)) {
-				agh_log_mm_crit("problem while disabling modem");
-				agh_modem_report_gerror_message(&mmstate->current_gerror, NULL);
-				retval = 83;
-			}
-			else {
-				agh_log_mm_dbg("modem %s is now disabled",mm_modem_get_path(m));
-				retval = agh_mm_modem_delete_all_bearers_sync(mstate, m);
-				if (retval) {
-					agh_log_mm_crit("got failure from agh_mm_modem_delete_all_bearers_sync (code=%" G_GINT16_FORMAT")",retval);
-				}
-			}
+	start = g_get_monotonic_time();
+
+	shutdown.ctx = g_main_context_new();
+	shutdown.cancellable = g_cancellable_new();
+	shutdown.pending = 0;
+	shutdown.expired = FALSE;
 
-			g_object_unref(m);
+	/* Async results are delivered to the thread-default context at the time of the call. */
+	g_main_context_push_thread_default(shutdown.ctx);
+
+	g_hash_table_iter_init(&iter, mstate->mmstate->modems);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		sm = g_try_malloc0(sizeof(*sm));
+		if (!sm) {
+			agh_log_mm_crit("can not allocate modem shutdown context");
+			retval = 83;
+			continue;
 		}
+
+		sm->shutdown = &shutdown;
+		sm->modem = g_object_ref(((struct agh_mm_modem *)value)->modem);
+		sm->start = start;
+
+		shutdown.pending++;
+
+		g_dbus_proxy_set_default_timeout(G_DBUS_PROXY(sm->modem), AGH_MM_SHUTDOWN_DEADLINE);
+		mm_modem_disable(sm->modem, shutdown.cancellable, (GAsyncReadyCallback)agh_mm_shutdown_disable_finish, sm);
 	}
 
-	g_list_free_full(modems, g_object_unref);
+	deadline = g_timeout_source_new(AGH_MM_SHUTDOWN_DEADLINE);
+	g_source_set_callback(deadline, agh_mm_shutdown_deadline, &shutdown, NULL);
+	g_source_attach(deadline, shutdown.ctx);
+
+	/* Once cancelled, the remaining operations complete right away. */
+	while (shutdown.pending)
+		g_main_context_iteration(shutdown.ctx, TRUE);
+
+	g_source_destroy(deadline);
+	g_source_unref(deadline);
+
+	g_main_context_pop_thread_default(shutdown.ctx);
+
+	agh_log_mm_crit("modems shutdown took %" G_GINT64_FORMAT" ms",(g_get_monotonic_time() - start) / 1000);
+
+	if (shutdown.expired)
+		retval = 84;
+
+	g_object_unref(shutdown.cancellable);
+	g_main_context_unref(shutdown.ctx);
 
 out:
 	return retval;
@@ -2185,6 +2774,7 @@ out:
 gint agh_mm_deinit(struct agh_state *mstate) {
 	struct agh_mm_state *mmstate;
 	gint ret;
+	gint nonfatal_retval;
 
 	ret = 0;
 
@@ -2204,16 +2794,13 @@ gint agh_mm_deinit(struct agh_state *mstate) {
 		mmstate->cancellable = NULL;
 	}
 
-	agh_mm_disable_all_modems_sync(mstate);
+	nonfatal_retval = agh_mm_disable_all_modems(mstate);
+	if (nonfatal_retval)
+		agh_log_mm_crit("failure from agh_mm_disable_all_modems (code=%" G_GINT16_FORMAT")",nonfatal_retval);
 
 	if (mmstate->watch_id)
 		agh_mm_watch_deinit(mstate);
 
-	if (mmstate->pending_bearer_async_ops) {
-		agh_log_mm_crit("something was wrong (%" G_GINT16_FORMAT" pending async ops)",mstate->mmstate->pending_bearer_async_ops);
-		mmstate->pending_bearer_async_ops = 0;
-	}
-
 	agh_mm_aghcomm = NULL;
 
 	if (mmstate->mctx) {
@@ -2226,6 +2813,16 @@ gint agh_mm_deinit(struct agh_state *mstate) {
 	mmstate->allow_sms = FALSE;
 	mmstate->bearer_check_interval = 0;
 
+	if (mmstate->bearers) {
+		g_hash_table_destroy(mmstate->bearers);
+		mmstate->bearers = NULL;
+	}
+
+	if (mmstate->modems) {
+		g_hash_table_destroy(mmstate->modems);
+		mmstate->modems = NULL;
+	}
+
 	g_free(mmstate);
 	mstate->mmstate = NULL;
 
@@ -2254,6 +2851,8 @@ static gint agh_mm_init_ready(struct agh_state *mstate) {
 	}
 
 	mstate->mmstate = mmstate;
+	mmstate->bearers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, agh_mm_bearer_free);
+	mmstate->modems = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, agh_mm_registry_entry_free);
 
 	ret = agh_modem_validate_config(mmstate, NULL, "agh_modem", TRUE);
 	if (ret) {
@@ -2406,16 +3005,19 @@ out:
 }
 
 static void agh_mm_modem_set_modes_result(MMModem *modem, GAsyncResult *res, struct agh_state *mstate) {
+	GError *current_gerror;
+
+	current_gerror = NULL;
 
 	if (!mstate || !mstate->mmstate) {
 		agh_log_mm_crit("missing context");
 		return;
 	}
 
-	switch(mm_modem_set_current_modes_finish(modem, res, &mstate->mmstate->current_gerror)) {
+	switch(mm_modem_set_current_modes_finish(modem, res, &current_gerror)) {
 		case FALSE:
 			agh_log_mm_crit("failure setting modes for %s",mm_modem_get_path(modem));
-			agh_modem_report_gerror_message(&mstate->mmstate->current_gerror, mstate->comm);
+			agh_modem_report_gerror_message(&current_gerror, mstate->comm);
 			break;
 		case TRUE:
 			agh_mm_report_event(mstate->comm, "modes_changed", agh_mm_modem_to_index(mm_modem_get_path(modem)), ":)");
@@ -14,6 +14,60 @@
 /* modem event name */
 #define AGH_MM_MODEM_EVENT_NAME "modem"
 
+/* Bearer reconnection backoff bounds, in milliseconds. */
+#define AGH_MM_BEARER_RETRY_MIN_INTERVAL 2000
+#define AGH_MM_BEARER_RETRY_MAX_INTERVAL 300000
+
+/* Overall time allowed for disabling modems and deleting their bearers while exiting, in milliseconds. */
+#define AGH_MM_SHUTDOWN_DEADLINE 30000
+
+/* Supervision record of a bearer. */
+struct agh_mm_bearer {
+	struct agh_state *mstate;
+	MMBearer *bearer;
+	gchar *modem_path;
+	gulong connected_signal_id;
+
+	/* connection state as of the last "notify::connected" signal */
+	gboolean connected;
+	gboolean connecting;
+
+	/* the modem is not registered: do not try to reconnect */
+	gboolean suspended;
+
+	guint failures;
+	guint retry_delay;
+	GSource *retry;
+	guint retry_tag;
+};
+
+/* Modem bring-up stages, timed to see where boot-to-connected time goes. */
+#define AGH_MM_BRINGUP_UNLOCKED 0
+#define AGH_MM_BRINGUP_ENABLED 1
+#define AGH_MM_BRINGUP_REGISTERED 2
+#define AGH_MM_BRINGUP_BEARER_CREATED 3
+#define AGH_MM_BRINGUP_CONNECTED 4
+#define AGH_MM_BRINGUP_STAGES 5
+
+/* A modem known to ModemManager, keyed by its index in the modems registry. */
+struct agh_mm_modem {
+	gint index;
+	MMObject *object;
+	MMModem *modem;
+	gulong interface_removed_id;
+
+	/* acquired when first needed, see agh_mm_registry_get_* */
+	MMModem3gpp *modem3gpp;
+	MMModemTime *time;
+
+	/* bearers list requests in flight for this modem */
+	gint pending_bearer_ops;
+
+	/* when bring-up started (monotonic time), and milliseconds after which each stage was reached; -1 if not yet */
+	gint64 bringup_start;
+	gint64 bringup[AGH_MM_BRINGUP_STAGES];
+};
+
 struct agh_mm_state {
 	GError *current_gerror;
 	GCancellable *cancellable;
@@ -26,20 +80,18 @@ struct agh_mm_state {
 	struct uci_package *uci_package;
 	GSource *bearers_check;
 	guint bearers_check_tag;
-	gint pending_bearer_async_ops;
 
-	/* MM Objects, used in agh_mm_handler */
+	/* bearer path -> struct agh_mm_bearer */
+	GHashTable *bearers;
+
+	/* modem index -> struct agh_mm_modem, maintained from the manager object-added / object-removed signals */
+	GHashTable *modems;
+
+	/* MM Objects, used in agh_mm_handler; borrowed from the modems registry while a command is being handled */
+	struct agh_mm_modem *current_modem;
 	MMObject *mmobject;
 	MMModem *modem;
-	MMModem3gpp *modem3gpp;
-	MMModem3gppUssd *modem3gppussd;
-	MMModemLocation *modemlocation;
 	MMModemMessaging *messaging;
-	MMModemTime *time;
-	MMModemFirmware *firmware;
-	MMModemOma *oma;
-	MMModemSignal *signal;
-	MMModemVoice *voice;
 
 	/* current command, used in agh_mm_handler (async calls) */
 	struct agh_cmd *current_cmd;
@@ -59,6 +111,11 @@ gint agh_mm_report_sms(struct agh_comm *comm, MMSms *sms);
 gint agh_mm_modem_set_modes(struct agh_state *mstate, MMModem *modem, const gchar *allowed_modes, const gchar *preferred_mode);
 gint agh_mm_showchanges(struct agh_state *mstate, MMModem *modem, MMModem3gpp *m3gpp, gboolean attach_signals);
 
+struct agh_mm_modem *agh_mm_registry_lookup(struct agh_mm_state *mmstate, gint index);
+MMModem3gpp *agh_mm_registry_get_modem3gpp(struct agh_mm_modem *mm);
+MMModemTime *agh_mm_registry_get_time(struct agh_mm_modem *mm);
+const gchar *agh_mm_bringup_stage_name(gint stage);
+
 void agh_mm_testwait(gint secs);
 
 #endif
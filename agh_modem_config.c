@@ -367,7 +367,7 @@ static gint agh_mm_init_default_settings(struct agh_mm_state *mmstate) {
 	}
 
 	agh_log_mm_config_dbg("default settings are being applied");
-	mmstate->bearer_check_interval = 45000;
+	mmstate->bearer_check_interval = 300000;
 	mmstate->allow_sms = TRUE;
 
 out:
@@ -418,7 +418,7 @@ static gint agh_modem_validate_config_global_settings(struct agh_mm_state *mmsta
 			goto out;
 		}
 
-		if (checkval_tmp < 5000 || checkval_tmp > 60000) {
+		if (checkval_tmp && (checkval_tmp < 5000 || checkval_tmp > 3600000)) {
 			agh_log_mm_config_crit("unacceptable value (%" G_GINT16_FORMAT") for bearers_check_interval option",checkval_tmp);
 			retval = 104;
 		}
@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-or-later
 
+#include <string.h>
 #include <glib-unix.h>
 #include <libubox/blobmsg_json.h>
 #include "agh_ubus.h"
@@ -14,7 +15,6 @@
 #define agh_log_ubus_dbg(message, ...) agh_log_dbg(AGH_LOG_DOMAIN_UBUS, message, ##__VA_ARGS__)
 #define agh_log_ubus_crit(message, ...) agh_log_crit(AGH_LOG_DOMAIN_UBUS, message, ##__VA_ARGS__)
 
-gchar *agh_ubus_call_data_str;
 gint agh_ubus_connection_state;
 struct agh_comm *agh_ubus_aghcomm;
 
@@ -28,8 +28,6 @@ gint agh_ubus_teardown(struct agh_ubus_ctx *uctx) {
 
 	retval = 0;
 
-	g_free(agh_ubus_call_data_str);
-	agh_ubus_call_data_str = NULL;
 	agh_ubus_aghcomm = NULL;
 
 	if (!uctx) {
@@ -38,189 +36,1183 @@ gint agh_ubus_teardown(struct agh_ubus_ctx *uctx) {
 		goto wayout;
 	}
 
+	if (uctx->calls) {
+		while (!g_queue_is_empty(uctx->calls))
+			agh_ubus_call_cancel(uctx, ((struct agh_ubus_call *)g_queue_peek_head(uctx->calls))->id);
+
+		g_queue_free(uctx->calls);
+		uctx->calls = NULL;
+	}
+
+	if (uctx->agh_ubus_fdsrc) {
+		g_source_destroy(uctx->agh_ubus_fdsrc);
+		uctx->agh_ubus_fdsrc = NULL;
+	}
+	uctx->agh_ubus_fdsrc_tag = 0;
+
 	if (uctx->ctx) {
 		ubus_free(uctx->ctx);
 		uctx->ctx = NULL;
 	}
 
-	if (uctx->agh_ubus_timeoutsrc) {
-		g_source_destroy(uctx->agh_ubus_timeoutsrc);
-		uctx->agh_ubus_timeoutsrc = NULL;
-	}
-	uctx->agh_ubus_timeoutsrc_tag = 0;
+	if (uctx->agh_ubus_timeoutsrc) {
+		g_source_destroy(uctx->agh_ubus_timeoutsrc);
+		uctx->agh_ubus_timeoutsrc = NULL;
+	}
+	uctx->agh_ubus_timeoutsrc_tag = 0;
+
+	if (uctx->event_masks) {
+		g_hash_table_destroy(uctx->event_masks);
+		uctx->event_masks = NULL;
+	}
+
+	if (uctx->id_cache) {
+		g_hash_table_destroy(uctx->id_cache);
+		uctx->id_cache = NULL;
+	}
+
+	if (uctx->objects) {
+		g_queue_free(uctx->objects);
+		uctx->objects = NULL;
+	}
+
+	if (uctx->logstream_ctx) {
+		agh_ubus_logstream_deinit(uctx);
+		uctx->logstream_ctx = NULL;
+	}
+
+	agh_ubus_connection_state = AGH_UBUS_STATE_INIT;
+
+	g_free(uctx);
+
+wayout:
+	return retval;
+}
+
+/*
+ * Invoked when ubus connection is lost.
+ *
+ * Returns: nothing.
+*/
+static void agh_ubus_disconnect_cb(struct ubus_context *ctx) {
+	agh_ubus_connection_state = AGH_UBUS_STATE_RECONNECTING;
+	agh_log_ubus_crit("we got disconnected!");
+	return;
+}
+
+static gboolean agh_ubus_handle_events(gpointer data);
+static gboolean agh_ubus_socket_io(gint fd, GIOCondition condition, gpointer data);
+
+/*
+ * Attaches the timeout GSource used to (re)connect to ubus, unless already present. The connection attempt is made after
+ * uctx->reconnect_delay ms.
+ *
+ * Returns: an integer with value 0 on success, or 1 when the GSource could not be attached.
+*/
+static gint agh_ubus_schedule_connect(struct agh_ubus_ctx *uctx) {
+
+	if (uctx->agh_ubus_timeoutsrc)
+		return 0;
+
+	uctx->agh_ubus_timeoutsrc = g_timeout_source_new(uctx->reconnect_delay);
+	g_source_set_callback(uctx->agh_ubus_timeoutsrc, agh_ubus_handle_events, uctx, NULL);
+	uctx->agh_ubus_timeoutsrc_tag = g_source_attach(uctx->agh_ubus_timeoutsrc, uctx->gmctx);
+	g_source_unref(uctx->agh_ubus_timeoutsrc);
+
+	if (!uctx->agh_ubus_timeoutsrc_tag) {
+		agh_log_ubus_crit("error while attaching the ubus timeout source to GMainContext");
+		uctx->agh_ubus_timeoutsrc = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Starts watching the ubus socket, so incoming data is dispatched as soon as it arrives.
+ * Note that ubus_reconnect opens a new socket, so this needs to be done after each (re)connection.
+ *
+ * Returns: an integer with value 0 on success, or 1 when the GSource could not be attached.
+*/
+static gint agh_ubus_watch_socket(struct agh_ubus_ctx *uctx) {
+
+	if (uctx->agh_ubus_fdsrc) {
+		g_source_destroy(uctx->agh_ubus_fdsrc);
+		uctx->agh_ubus_fdsrc = NULL;
+		uctx->agh_ubus_fdsrc_tag = 0;
+	}
+
+	uctx->agh_ubus_fdsrc = g_unix_fd_source_new(uctx->ctx->sock.fd, G_IO_IN | G_IO_PRI | G_IO_ERR | G_IO_HUP);
+	g_source_set_callback(uctx->agh_ubus_fdsrc, G_SOURCE_FUNC(agh_ubus_socket_io), uctx, NULL);
+	uctx->agh_ubus_fdsrc_tag = g_source_attach(uctx->agh_ubus_fdsrc, uctx->gmctx);
+	g_source_unref(uctx->agh_ubus_fdsrc);
+
+	if (!uctx->agh_ubus_fdsrc_tag) {
+		agh_log_ubus_crit("error while attaching the ubus socket source to GMainContext");
+		uctx->agh_ubus_fdsrc = NULL;
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * This function is invoked by GLib whenever there is something to read on the ubus socket (or the socket has been closed).
+ * Should we get disconnected, the agh_ubus_disconnect_cb function is invoked by ubus_handle_event: in that case this GSource
+ * is removed, and the timeout one is attached again to reconnect. If logstreaming is connected, it's state is changed so it
+ * deinits the log channel, and waits for us to re-establish an ubus connection.
+*/
+static gboolean agh_ubus_socket_io(gint fd, GIOCondition condition, gpointer data) {
+	struct agh_ubus_ctx *uctx = data;
+
+	if (agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED)
+		ubus_handle_event(uctx->ctx);
+
+	/* Should not happen, but we don't want to spin on a dead socket. */
+	if ((agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED) && (condition & (G_IO_ERR | G_IO_HUP))) {
+		agh_log_ubus_crit("ubus socket error");
+		agh_ubus_connection_state = AGH_UBUS_STATE_RECONNECTING;
+	}
+
+	if (agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED)
+		return TRUE;
+
+	if (uctx->logstream_ctx && (uctx->logstream_ctx->logstream_state != AGH_UBUS_LOGSTREAM_STATE_CONNECTED))
+		uctx->logstream_ctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_RECONNECT;
+
+	/* We can do this because we already called g_source_unref on this GSource. */
+	uctx->agh_ubus_fdsrc = NULL;
+	uctx->agh_ubus_fdsrc_tag = 0;
+
+	if (agh_ubus_connection_state == AGH_UBUS_STATE_RECONNECTING) {
+		/* The first attempt is made right away. */
+		uctx->disconnected_at = g_get_monotonic_time();
+		uctx->reconnect_delay = 0;
+		uctx->reconnect_attempts = 0;
+		agh_ubus_schedule_connect(uctx);
+	}
+
+	return FALSE;
+}
+
+/*
+ * Looks up the ID of the object at path, answering from the cache when possible. *cached is set to TRUE when the ID came from
+ * the cache, so the caller knows it may be stale.
+ *
+ * Returns: 0 on success, or a value coming from ubus_lookup_id.
+*/
+static gint agh_ubus_lookup_id(struct agh_ubus_ctx *uctx, const gchar *path, guint32 *id, gboolean *cached) {
+	gpointer cached_id;
+	gint retval;
+
+	*cached = FALSE;
+
+	if (uctx->id_cache && g_hash_table_lookup_extended(uctx->id_cache, path, NULL, &cached_id)) {
+		uctx->id_cache_hits++;
+		*id = GPOINTER_TO_UINT(cached_id);
+		*cached = TRUE;
+		return 0;
+	}
+
+	uctx->id_cache_misses++;
+
+	retval = ubus_lookup_id(uctx->ctx, path, id);
+	if (retval)
+		return retval;
+
+	if (uctx->id_cache)
+		g_hash_table_insert(uctx->id_cache, g_strdup(path), GUINT_TO_POINTER(*id));
+
+	return 0;
+}
+
+static void agh_ubus_id_cache_forget(struct agh_ubus_ctx *uctx, const gchar *path) {
+
+	if (uctx->id_cache)
+		g_hash_table_remove(uctx->id_cache, path);
+
+	return;
+}
+
+/*
+ * Invoked when an object is added to or removed from ubus: any cached ID for its path is dropped.
+*/
+static void agh_ubus_id_cache_event(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg) {
+	struct agh_ubus_ctx *uctx = container_of(ev, struct agh_ubus_ctx, id_cache_handler);
+	static const struct blobmsg_policy path_policy = { .name = "path", .type = BLOBMSG_TYPE_STRING };
+	struct blob_attr *path_attr;
+
+	path_attr = NULL;
+
+	if (!uctx->id_cache)
+		return;
+
+	if (msg)
+		blobmsg_parse(&path_policy, 1, &path_attr, blob_data(msg), blob_len(msg));
+
+	if (path_attr)
+		agh_ubus_id_cache_forget(uctx, blobmsg_get_string(path_attr));
+	else
+		g_hash_table_remove_all(uctx->id_cache);
+
+	return;
+}
+
+/*
+ * Invoked on every successful (re)connection: cached IDs may no longer be valid, and event handler registrations need to be
+ * renewed, for our own handler as well as for every enabled event mask. Objects we publish are added, unless ubus_reconnect
+ * already took care of them, and log streaming is restarted right away if it was interrupted.
+*/
+static void agh_ubus_connected(struct agh_ubus_ctx *uctx) {
+	struct ubus_object *obj;
+	struct agh_ubus_event_mask *m;
+	GHashTableIter iter;
+	gpointer value;
+	GList *l;
+	gint retval;
+
+	if (uctx->id_cache)
+		g_hash_table_remove_all(uctx->id_cache);
+
+	uctx->id_cache_handler.cb = agh_ubus_id_cache_event;
+
+	if ( (retval = ubus_register_event_handler(uctx->ctx, &uctx->id_cache_handler, AGH_UBUS_EVENT_OBJECT_ADD)) )
+		agh_log_ubus_crit("unable to watch for ubus objects being added (code=%" G_GINT16_FORMAT")", retval);
+
+	if ( (retval = ubus_register_event_handler(uctx->ctx, &uctx->id_cache_handler, AGH_UBUS_EVENT_OBJECT_REMOVE)) )
+		agh_log_ubus_crit("unable to watch for ubus objects being removed (code=%" G_GINT16_FORMAT")", retval);
+
+	if (uctx->objects) {
+		for (l = uctx->objects->head; l; l = g_list_next(l)) {
+			obj = l->data;
+
+			if (obj->id)
+				continue;
+
+			if ( (retval = ubus_add_object(uctx->ctx, obj)) )
+				agh_log_ubus_crit("unable to add object %s (code=%" G_GINT16_FORMAT")", obj->name, retval);
+		}
+	}
+
+	if (uctx->event_masks) {
+		g_hash_table_iter_init(&iter, uctx->event_masks);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			m = value;
+
+			if (!m->enabled)
+				continue;
+
+			if ( (retval = ubus_register_event_handler(uctx->ctx, &m->handler, m->mask)) )
+				agh_log_ubus_crit("unable to register event mask %s (code=%" G_GINT16_FORMAT")", m->mask, retval);
+		}
+	}
+
+	if (uctx->logstream_ctx)
+		agh_ubus_logstream_restart(uctx);
+
+	if (uctx->disconnected_at) {
+		uctx->reconnections++;
+		uctx->last_recovery_time = g_get_monotonic_time() - uctx->disconnected_at;
+		uctx->disconnected_at = 0;
+		agh_log_ubus_dbg("ubus connection recovered in %" G_GINT64_FORMAT" ms, after %u attempts", uctx->last_recovery_time / 1000, uctx->reconnect_attempts);
+	}
+
+	uctx->reconnect_delay = 0;
+	uctx->reconnect_attempts = 0;
+
+	return;
+}
+
+/*
+ * Publishes an object on ubus: it is added right away when connected, or as soon as a connection is established.
+ * The object should stay valid until agh_ubus_teardown is invoked.
+ *
+ * Returns: an integer with value 0 on success, -1 when no AGH ubus context or object are given, or a value coming from
+ * ubus_add_object.
+*/
+gint agh_ubus_object_add(struct agh_ubus_ctx *uctx, struct ubus_object *obj) {
+	gint retval;
+
+	retval = 0;
+
+	if (!uctx || !obj)
+		return -1;
+
+	if (!uctx->objects)
+		uctx->objects = g_queue_new();
+
+	g_queue_push_tail(uctx->objects, obj);
+
+	if ((agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED) && !obj->id)
+		retval = ubus_add_object(uctx->ctx, obj);
+
+	return retval;
+}
+
+/*
+ * This function is invoked by GLib, as a timeout GSource attached to a GMainContext, while we are not connected to ubus.
+ *
+ * After a successful completion of the agh_ubus_setup function, we expect to be at state AGH_UBUS_STATE_INIT.
+ * We'll execute the corresponding branch of the switch statemenet in the function, trying to establish a connection.
+ * Upon a successful connection, we install the agh_ubus_disconnect_cb handler as the "connection lost" one
+ * (ctx->connection_lost), start watching the ubus socket via agh_ubus_socket_io, and restore what needs to be after a
+ * (re)connection (see agh_ubus_connected).
+ * When in the AGH_UBUS_STATE_RECONNECTING state, we try to reconnect to ubus, and do the same on success.
+ * Each failed attempt schedules the next one, doubling the delay up to AGH_UBUS_CONNECT_RETRY_MAX_INTERVAL; so once ubusd
+ * is back, we are connected again within that interval.
+*/
+static gboolean agh_ubus_handle_events(gpointer data) {
+	struct agh_ubus_ctx *uctx = data;
+
+	/* We can do this because we already called g_source_unref on this GSource. */
+	uctx->agh_ubus_timeoutsrc = NULL;
+	uctx->agh_ubus_timeoutsrc_tag = 0;
+
+	uctx->reconnect_attempts++;
+
+	switch(agh_ubus_connection_state) {
+		case AGH_UBUS_STATE_INIT:
+			uctx->ctx = ubus_connect(AGH_UBUS_UNIX_SOCKET);
+
+			if (!uctx->ctx)
+				break;
+
+			agh_log_ubus_dbg("ubus connection established with local ID %08x",uctx->ctx->local_id);
+			uctx->ctx->connection_lost = agh_ubus_disconnect_cb;
+
+			if (agh_ubus_watch_socket(uctx)) {
+				ubus_free(uctx->ctx);
+				uctx->ctx = NULL;
+				break;
+			}
+
+			agh_ubus_connection_state = AGH_UBUS_STATE_CONNECTED;
+			agh_ubus_connected(uctx);
+			return FALSE;
+		case AGH_UBUS_STATE_RECONNECTING:
+			if (ubus_reconnect(uctx->ctx, AGH_UBUS_UNIX_SOCKET))
+				break;
+
+			agh_log_ubus_dbg("ubus connection re-established with local ID %08x",uctx->ctx->local_id);
+
+			if (agh_ubus_watch_socket(uctx))
+				break;
+
+			agh_ubus_connection_state = AGH_UBUS_STATE_CONNECTED;
+			agh_ubus_connected(uctx);
+			return FALSE;
+		case AGH_UBUS_STATE_STOP:
+			agh_log_ubus_dbg("AGH_UBUS_STATE_STOP, bye bye!");
+			return FALSE;
+		default:
+			agh_log_ubus_crit("unknown state");
+			agh_ubus_connection_state = AGH_UBUS_STATE_STOP;
+			return FALSE;
+	}
+
+	if (!uctx->reconnect_delay)
+		uctx->reconnect_delay = AGH_UBUS_CONNECT_RETRY_MIN_INTERVAL;
+	else
+		uctx->reconnect_delay = MIN(uctx->reconnect_delay * 2, AGH_UBUS_CONNECT_RETRY_MAX_INTERVAL);
+
+	agh_ubus_schedule_connect(uctx);
+
+	return FALSE;
+}
+
+/*
+ * Releases an ubus call result.
+*/
+void agh_ubus_call_result_free(struct agh_ubus_call_result *res) {
+
+	if (!res)
+		return;
+
+	free(res->blob);
+	g_free(res->json);
+	g_free(res);
+
+	return;
+}
+
+/*
+ * Stores data resulting from an ubus call in the result context pointed to by *resptr; should some data already be present,
+ * it's replaced. The blob is only copied here: rendering it to JSON is left to agh_ubus_call_result_json, should it be needed.
+*/
+static void agh_ubus_call_result_store(struct agh_ubus_call_result **resptr, struct blob_attr *msg) {
+
+	agh_ubus_call_result_free(*resptr);
+	*resptr = NULL;
+
+	if (!msg)
+		return;
+
+	*resptr = g_try_malloc0(sizeof(**resptr));
+	if (!*resptr) {
+		agh_log_ubus_crit("can not allocate call result");
+		return;
+	}
+
+	(*resptr)->blob = blob_memdup(msg);
+	if (!(*resptr)->blob) {
+		agh_log_ubus_crit("can not copy call result");
+		g_free(*resptr);
+		*resptr = NULL;
+	}
+
+	return;
+}
+
+/*
+ * Returns: the JSON representation of an ubus call result, rendered at first request, or NULL on failure. The string is owned
+ * by the result context.
+*/
+const gchar *agh_ubus_call_result_json(struct agh_ubus_call_result *res) {
+
+	if (!res || !res->blob)
+		return NULL;
+
+	if (!res->json)
+		res->json = blobmsg_format_json_with_cb(res->blob, true, NULL, NULL, 0);
+
+	return res->json;
+}
+
+static void agh_ubus_event_filter_free(gpointer data) {
+	struct agh_ubus_event_filter *f = data;
+
+	if (!f)
+		return;
+
+	g_free(f->field);
+	g_free(f->value);
+	g_free(f);
+
+	return;
+}
+
+static void agh_ubus_event_filters_clear(struct agh_ubus_event_mask *m) {
+
+	if (m->filters) {
+		g_queue_free_full(m->filters, agh_ubus_event_filter_free);
+		m->filters = NULL;
+	}
+
+	g_free(m->filter_str);
+	m->filter_str = NULL;
+	g_strfreev(m->fields);
+	m->fields = NULL;
+	g_free(m->fields_str);
+	m->fields_str = NULL;
+
+	return;
+}
+
+static void agh_ubus_event_aggregate_free(gpointer data) {
+	struct agh_ubus_event_aggregate *a = data;
+
+	if (!a)
+		return;
+
+	g_free(a->key);
+	g_free(a->type);
+	g_free(a->msg);
+	g_free(a);
+
+	return;
+}
+
+/*
+ * Ends the current aggregation window of a mask, if any, passing every aggregate to the mask flush callback.
+ *
+ * Returns: nothing.
+*/
+static void agh_ubus_event_aggregate_flush(struct agh_ubus_event_mask *m) {
+	struct agh_ubus_event_aggregate *a;
+
+	if (m->aggregate_src) {
+		g_source_destroy(m->aggregate_src);
+		m->aggregate_src = NULL;
+		m->aggregate_src_tag = 0;
+	}
+
+	if (!m->aggregated)
+		return;
+
+	while ( (a = g_queue_pop_head(m->aggregated)) ) {
+		g_hash_table_remove(m->aggregated_index, a->key);
+
+		if (m->flush_cb)
+			m->flush_cb(m, a->type, a->msg, a->count);
+
+		agh_ubus_event_aggregate_free(a);
+	}
+
+	return;
+}
+
+static gboolean agh_ubus_event_aggregate_window_cb(gpointer data) {
+	struct agh_ubus_event_mask *m = data;
+
+	m->aggregate_src = NULL;
+	m->aggregate_src_tag = 0;
+
+	agh_ubus_event_aggregate_flush(m);
+
+	return FALSE;
+}
+
+/*
+ * Drops pending aggregates of a mask, without reporting them.
+ *
+ * Returns: nothing.
+*/
+static void agh_ubus_event_aggregate_clear(struct agh_ubus_event_mask *m) {
+
+	if (m->aggregate_src) {
+		g_source_destroy(m->aggregate_src);
+		m->aggregate_src = NULL;
+		m->aggregate_src_tag = 0;
+	}
+
+	if (m->aggregated_index) {
+		g_hash_table_destroy(m->aggregated_index);
+		m->aggregated_index = NULL;
+	}
+
+	if (m->aggregated) {
+		g_queue_free_full(m->aggregated, agh_ubus_event_aggregate_free);
+		m->aggregated = NULL;
+	}
+
+	return;
+}
+
+static void agh_ubus_event_mask_free(gpointer data) {
+	struct agh_ubus_event_mask *m = data;
+
+	if (!m)
+		return;
+
+	agh_ubus_event_filters_clear(m);
+	agh_ubus_event_aggregate_clear(m);
+	g_free(m->aggregate_key);
+	g_free(m->mask);
+	g_free(m);
+
+	return;
+}
+
+/*
+ * Parses a filter in the form "field=value,field2=value2" to a GQueue of struct agh_ubus_event_filter, stored in *filtersptr.
+ *
+ * Returns: an integer with value 0 on success, -3 when the filter is not valid, -4 on memory allocation failure.
+*/
+static gint agh_ubus_event_filter_parse(const gchar *filter, GQueue **filtersptr) {
+	GQueue *filters;
+	gchar **conditions;
+	gchar **condition;
+	gchar *separator;
+	struct agh_ubus_event_filter *f;
+	gint retval;
+
+	retval = 0;
+	filters = g_queue_new();
+	conditions = g_strsplit(filter, AGH_UBUS_EVENT_LIST_SEPARATOR, -1);
+
+	for (condition = conditions; *condition; condition++) {
+		separator = strstr(*condition, AGH_UBUS_EVENT_FILTER_SEPARATOR);
+
+		if (!separator || (separator == *condition)) {
+			agh_log_ubus_dbg("invalid filter condition: %s", *condition);
+			retval = -3;
+			goto wayout;
+		}
+
+		f = g_try_malloc0(sizeof(*f));
+		if (!f) {
+			agh_log_ubus_crit("can not allocate filter condition");
+			retval = -4;
+			goto wayout;
+		}
+
+		f->field = g_strndup(*condition, separator - *condition);
+		f->value = g_strdup(separator + strlen(AGH_UBUS_EVENT_FILTER_SEPARATOR));
+		g_queue_push_tail(filters, f);
+	}
+
+	if (g_queue_is_empty(filters)) {
+		retval = -3;
+		goto wayout;
+	}
+
+	*filtersptr = filters;
+	filters = NULL;
+
+wayout:
+	if (filters)
+		g_queue_free_full(filters, agh_ubus_event_filter_free);
+
+	g_strfreev(conditions);
+	return retval;
+}
+
+/*
+ * Sets the filter (see agh_ubus_event_filter_parse) and fields projection list ("field,field2") of an event mask, replacing
+ * the previous ones. NULL or empty strings clear them.
+ *
+ * Returns: an integer with value 0 on success, -3 when the filter is not valid, -4 on memory allocation failure. In both
+ * cases, the mask is left untouched.
+*/
+static gint agh_ubus_event_mask_set_filter(struct agh_ubus_event_mask *m, const gchar *filter, const gchar *fields) {
+	GQueue *filters;
+	gint retval;
+
+	filters = NULL;
+
+	if (filter && *filter) {
+		if ( (retval = agh_ubus_event_filter_parse(filter, &filters)) )
+			return retval;
+	}
+
+	agh_ubus_event_filters_clear(m);
+
+	if (filters) {
+		m->filters = filters;
+		m->filter_str = g_strdup(filter);
+	}
+
+	if (fields && *fields) {
+		m->fields = g_strsplit(fields, AGH_UBUS_EVENT_LIST_SEPARATOR, -1);
+		m->fields_str = g_strdup(fields);
+	}
+
+	return 0;
+}
+
+/*
+ * Looks up an event mask.
+ *
+ * Returns: the event mask, or NULL when not found.
+*/
+struct agh_ubus_event_mask *agh_ubus_event_lookup(struct agh_ubus_ctx *uctx, const gchar *mask) {
+
+	if (!uctx || !uctx->event_masks || !mask)
+		return NULL;
+
+	return g_hash_table_lookup(uctx->event_masks, mask);
+}
+
+/*
+ * Registers an ubus event handler for a specified event mask, allocating the event masks table if not already allocated.
+ * Every mask gets its own handler, filter (see agh_ubus_event_filter_parse), fields projection list ("field,field2"),
+ * rate limit and counters, so masks can be tuned or removed without affecting the others.
+ * This function may terminate the program uncleanly.
+ *
+ * Returns: an integer with value 0 on success.
+ *  - -1 = no AGH ubus context, NULL mask specified or NULL callback given
+ *  - -2 = specified mask was already present
+ *  - -3 = invalid filter
+ *  - -4 = memory allocation failure
+ *
+ * Any other value comes from ubus_register_event_handler, which I suppose / hope, returns positive values only.
+ * I am not sure of that, but it seems an enum is consistently used in here.
+*/
+gint agh_ubus_event_add(struct agh_ubus_ctx *uctx, ubus_event_handler_t cb, const gchar *mask, const gchar *filter, const gchar *fields) {
+	gint retval;
+	struct agh_ubus_event_mask *m;
+
+	retval = 0;
+	m = NULL;
+
+	if (!uctx || !mask || !cb) {
+		agh_log_ubus_crit("no AGH ubus context, NULL mask specified or NULL callback given");
+		retval = -1;
+		goto wayout;
+	}
+
+	if (agh_ubus_event_lookup(uctx, mask)) {
+		agh_log_ubus_dbg("mask already present");
+		retval = -2;
+		goto wayout;
+	}
+
+	m = g_try_malloc0(sizeof(*m));
+	if (!m) {
+		agh_log_ubus_crit("can not allocate event mask");
+		retval = -4;
+		goto wayout;
+	}
+
+	m->mask = g_strdup(mask);
+	m->uctx = uctx;
+	m->handler.cb = cb;
+
+	if ( (retval = agh_ubus_event_mask_set_filter(m, filter, fields)) )
+		goto wayout;
+
+	/* While not connected, the handler is registered as soon as a connection is established (see agh_ubus_connected). */
+	if (agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED) {
+		retval = ubus_register_event_handler(uctx->ctx, &m->handler, mask);
+		if (retval) {
+			agh_log_ubus_dbg("ubus_register_event_handler returned a failure (code=%" G_GINT16_FORMAT")",retval);
+			goto wayout;
+		}
+	}
+
+	m->enabled = TRUE;
+
+	if (!uctx->event_masks)
+		uctx->event_masks = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, agh_ubus_event_mask_free);
+
+	g_hash_table_insert(uctx->event_masks, m->mask, m);
+	m = NULL;
+
+wayout:
+	agh_ubus_event_mask_free(m);
+	return retval;
+}
+
+/*
+ * Stops an event mask handler, if it was running, reporting events still being aggregated.
+ *
+ * Returns: 0 on success, or a value coming from ubus_unregister_event_handler.
+*/
+static gint agh_ubus_event_mask_stop(struct agh_ubus_event_mask *m) {
+	gint retval;
+
+	retval = 0;
+
+	agh_ubus_event_aggregate_flush(m);
+
+	if (!m->enabled)
+		return retval;
+
+	/* Never registered, since we were not connected. */
+	if (!m->handler.obj.id) {
+		m->enabled = FALSE;
+		return retval;
+	}
+
+	if ( (retval = ubus_unregister_event_handler(m->uctx->ctx, &m->handler)) ) {
+		agh_log_ubus_crit("ubus_unregister_event_handler returned a failure (code=%" G_GINT16_FORMAT")",retval);
+		return retval;
+	}
+
+	m->enabled = FALSE;
+
+	return retval;
+}
+
+/*
+ * Removes a single event mask.
+ *
+ * Returns: an integer with value 0 on success.
+ *  - -1 = no AGH ubus context or NULL mask specified
+ *  - -2 = mask not found
+ *
+ * Any other value comes from ubus_unregister_event_handler.
+*/
+gint agh_ubus_event_remove(struct agh_ubus_ctx *uctx, const gchar *mask) {
+	struct agh_ubus_event_mask *m;
+	gint retval;
+
+	if (!uctx || !mask)
+		return -1;
+
+	m = agh_ubus_event_lookup(uctx, mask);
+	if (!m)
+		return -2;
+
+	if ( (retval = agh_ubus_event_mask_stop(m)) )
+		return retval;
+
+	g_hash_table_remove(uctx->event_masks, mask);
+
+	if (!g_hash_table_size(uctx->event_masks)) {
+		g_hash_table_destroy(uctx->event_masks);
+		uctx->event_masks = NULL;
+	}
+
+	return retval;
+}
+
+/*
+ * Enables or disables reporting of events for a mask. A disabled mask is unregistered from ubus, so its events are not even
+ * received, but it keeps its settings and counters.
+ *
+ * Returns: an integer with value 0 on success.
+ *  - -1 = no AGH ubus context or NULL mask specified
+ *  - -2 = mask not found
+ *
+ * Any other value comes from ubus_(un)register_event_handler.
+*/
+gint agh_ubus_event_set_enabled(struct agh_ubus_ctx *uctx, const gchar *mask, gboolean enabled) {
+	struct agh_ubus_event_mask *m;
+	gint retval;
+
+	retval = 0;
+
+	if (!uctx || !mask)
+		return -1;
+
+	m = agh_ubus_event_lookup(uctx, mask);
+	if (!m)
+		return -2;
+
+	if (!enabled)
+		return agh_ubus_event_mask_stop(m);
+
+	if (m->enabled)
+		return retval;
+
+	if ((agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED) && (retval = ubus_register_event_handler(uctx->ctx, &m->handler, m->mask)) ) {
+		agh_log_ubus_dbg("ubus_register_event_handler returned a failure (code=%" G_GINT16_FORMAT")",retval);
+		return retval;
+	}
+
+	m->enabled = TRUE;
+
+	return retval;
+}
+
+/*
+ * Sets the maximum number of events per second reported for a mask; 0 means no limit.
+ *
+ * Returns: an integer with value 0 on success, -1 on invalid arguments, -2 when the mask is not found.
+*/
+gint agh_ubus_event_set_rate_limit(struct agh_ubus_ctx *uctx, const gchar *mask, guint rate_limit) {
+	struct agh_ubus_event_mask *m;
+
+	if (!uctx || !mask)
+		return -1;
+
+	m = agh_ubus_event_lookup(uctx, mask);
+	if (!m)
+		return -2;
+
+	m->rate_limit = rate_limit;
+	m->window_events = 0;
+
+	return 0;
+}
+
+/*
+ * Replaces filter and fields projection list of a mask.
+ *
+ * Returns: an integer with value 0 on success, -1 on invalid arguments, -2 when the mask is not found, -3 for an invalid
+ * filter, -4 on memory allocation failure.
+*/
+gint agh_ubus_event_set_filter(struct agh_ubus_ctx *uctx, const gchar *mask, const gchar *filter, const gchar *fields) {
+	struct agh_ubus_event_mask *m;
+
+	if (!uctx || !mask)
+		return -1;
 
-	if (uctx->event_masks) {
-		g_queue_free_full(uctx->event_masks, g_free);
-		uctx->event_masks = NULL;
-	}
+	m = agh_ubus_event_lookup(uctx, mask);
+	if (!m)
+		return -2;
 
-	if (uctx->event_handler) {
-		g_free(uctx->event_handler);
-		uctx->event_handler = NULL;
-	}
+	return agh_ubus_event_mask_set_filter(m, filter, fields);
+}
 
-	if (uctx->logstream_ctx) {
-		agh_ubus_logstream_deinit(uctx);
-		uctx->logstream_ctx = NULL;
+/*
+ * Sets the aggregation window of a mask, in milliseconds: events received during it are collapsed by type, and by the value
+ * of the key field when given, keeping the latest one. At the end of the window, flush_cb is invoked once per aggregate.
+ * A window of 0 disables aggregation; pending aggregates are flushed whenever the window changes.
+ *
+ * Returns: an integer with value 0 on success, -1 on invalid arguments, -2 when the mask is not found.
+*/
+gint agh_ubus_event_set_window(struct agh_ubus_ctx *uctx, const gchar *mask, guint window, const gchar *key, agh_ubus_event_flush_cb flush_cb) {
+	struct agh_ubus_event_mask *m;
+
+	if (!uctx || !mask || (window > AGH_UBUS_EVENT_MAX_AGGREGATE_WINDOW) || (window && !flush_cb))
+		return -1;
+
+	m = agh_ubus_event_lookup(uctx, mask);
+	if (!m)
+		return -2;
+
+	agh_ubus_event_aggregate_flush(m);
+
+	g_free(m->aggregate_key);
+	m->aggregate_key = NULL;
+
+	m->aggregate_window = window;
+	m->flush_cb = flush_cb;
+
+	if (!window) {
+		agh_ubus_event_aggregate_clear(m);
+		return 0;
 	}
 
-	agh_ubus_connection_state = AGH_UBUS_STATE_INIT;
+	if (key && *key)
+		m->aggregate_key = g_strdup(key);
 
-	g_free(uctx);
+	if (!m->aggregated) {
+		m->aggregated = g_queue_new();
+		m->aggregated_index = g_hash_table_new(g_str_hash, g_str_equal);
+	}
 
-wayout:
-	return retval;
+	return 0;
 }
 
 /*
- * Invoked when ubus connection is lost.
+ * Builds the key events are collapsed by: the event type, followed by the value of the mask aggregate key field, if any.
  *
- * Returns: nothing.
+ * Returns: a newly allocated string.
 */
-static void agh_ubus_disconnect_cb(struct ubus_context *ctx) {
-	agh_ubus_connection_state++;
-	agh_log_ubus_crit("we got disconnected!");
-	return;
+static gchar *agh_ubus_event_aggregate_key(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg) {
+	struct blob_attr *cur;
+	gchar *value;
+	gchar *key;
+	gint rem;
+
+	if (!m->aggregate_key || !msg)
+		return g_strdup(type);
+
+	value = NULL;
+
+	blobmsg_for_each_attr(cur, msg, rem) {
+		if (!g_strcmp0(blobmsg_name(cur), m->aggregate_key)) {
+			if (blobmsg_type(cur) == BLOBMSG_TYPE_STRING)
+				value = g_strdup(blobmsg_get_string(cur));
+			else
+				value = blobmsg_format_json(cur, false);
+
+			break;
+		}
+	}
+
+	key = g_strdup_printf("%s\n%s", type, value ? value : "");
+	g_free(value);
+
+	return key;
 }
 
 /*
- * This function is invoked by GLib, as a timeout GSource attached to a GMainContext.
+ * Adds an event to the current aggregation window of a mask, starting one if needed.
  *
- * After a successful completion of the agh_ubus_setup function, we expect to be at state AGH_UBUS_STATE_INIT.
- * We'll execute the corresponding branch of the switch statemenet in the function, until a connection can be established.
- * Upon a successful connection, we install the agh_ubus_disconnect_cb handler as the "connection lost" one
- * (ctx->connection_lost) and enter the AGH_UBUS_STATE_CONNECTED switch branch at next invocation, where we handle events
- * invoking the related ubus function.
- * Should a disconnection occur, we expect the agh_ubus_disconnect_cb function to be invoked. (It will simply increment the agh_ubus_connection_state variable.)
- * At this point, we should be in the AGH_UBUS_STATE_RECONNECTING state, where we constantly try to reconnect to ubus. If logstreaming
- * is not connected, it's state is changed so it should deinit the log channel and start busy-waiting for us to (re-)establish
- * an ubus connection.
+ * Returns: TRUE when the event has been aggregated, or suppressed since it could not be, FALSE when the mask does not
+ * aggregate events and it should be reported right away.
 */
-static gboolean agh_ubus_handle_events(gpointer data) {
-	struct agh_ubus_ctx *uctx = data;
+gboolean agh_ubus_event_aggregate(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg) {
+	struct agh_ubus_event_aggregate *a;
+	gchar *key;
+
+	if (!m->aggregate_window || !m->aggregated)
+		return FALSE;
+
+	key = agh_ubus_event_aggregate_key(m, type, msg);
+
+	a = g_hash_table_lookup(m->aggregated_index, key);
+	if (a) {
+		g_free(key);
+		g_free(a->msg);
+		a->msg = msg ? blob_memdup(msg) : NULL;
+		a->count++;
+		m->collapsed++;
+	}
+	else {
+		a = g_try_malloc0(sizeof(*a));
+		if (!a) {
+			agh_log_ubus_crit("can not allocate aggregate, event suppressed");
+			g_free(key);
+			m->suppressed++;
+			return TRUE;
+		}
 
-	switch(agh_ubus_connection_state) {
-		case AGH_UBUS_STATE_INIT:
-			uctx->ctx = ubus_connect(AGH_UBUS_UNIX_SOCKET);
+		a->key = key;
+		a->type = g_strdup(type);
+		a->msg = msg ? blob_memdup(msg) : NULL;
+		a->count = 1;
+		g_queue_push_tail(m->aggregated, a);
+		g_hash_table_insert(m->aggregated_index, a->key, a);
+	}
 
-			if (uctx->ctx) {
-				agh_log_ubus_dbg("ubus connection established with local ID %08x",uctx->ctx->local_id);
-				uctx->ctx->connection_lost = agh_ubus_disconnect_cb;
-				agh_ubus_connection_state++;
-			}
+	if (!m->aggregate_src) {
+		m->aggregate_src = g_timeout_source_new(m->aggregate_window);
+		g_source_set_callback(m->aggregate_src, agh_ubus_event_aggregate_window_cb, m, NULL);
+		m->aggregate_src_tag = g_source_attach(m->aggregate_src, m->uctx->gmctx);
+		g_source_unref(m->aggregate_src);
 
-			break;
-		case AGH_UBUS_STATE_CONNECTED:
-			ubus_handle_event(uctx->ctx);
-			break;
-		case AGH_UBUS_STATE_RECONNECTING:
-			if (uctx->logstream_ctx && (uctx->logstream_ctx->logstream_state != 2))
-				uctx->logstream_ctx->logstream_state = 3;
+		if (!m->aggregate_src_tag) {
+			agh_log_ubus_crit("error while attaching the aggregation window GSource to GMainContext");
+			m->aggregate_src = NULL;
+			agh_ubus_event_aggregate_flush(m);
+		}
+	}
 
-			if (!ubus_reconnect(uctx->ctx, AGH_UBUS_UNIX_SOCKET)) {
-				agh_log_ubus_dbg("ubus connection re-established with local ID %08x",uctx->ctx->local_id);
-				agh_ubus_connection_state--;
-			}
+	return TRUE;
+}
 
-			break;
-		case AGH_UBUS_STATE_STOP:
-			agh_log_ubus_dbg("AGH_UBUS_STATE_STOP, bye bye!");
+/*
+ * Checks a blob attribute value against a filter value, given as a string.
+*/
+static gboolean agh_ubus_event_value_matches(struct blob_attr *attr, const gchar *value) {
+	gchar *eptr;
+	gint64 num;
 
-			/* We can do this because we already called g_source_unref on this GSource. */
-			uctx->agh_ubus_timeoutsrc = NULL;
-			return FALSE;
+	switch(blobmsg_type(attr)) {
+		case BLOBMSG_TYPE_STRING:
+			return !g_strcmp0(blobmsg_get_string(attr), value);
+		case BLOBMSG_TYPE_INT8:
+			if (!g_strcmp0(value, "true"))
+				return blobmsg_get_bool(attr);
+
+			if (!g_strcmp0(value, "false"))
+				return !blobmsg_get_bool(attr);
+
+			break;
+		case BLOBMSG_TYPE_INT16:
+		case BLOBMSG_TYPE_INT32:
+		case BLOBMSG_TYPE_INT64:
+			break;
 		default:
-			agh_log_ubus_crit("unknown state");
-			agh_ubus_connection_state = AGH_UBUS_STATE_STOP;
+			return FALSE;
 	}
 
-	return TRUE;
+	num = g_ascii_strtoll(value, &eptr, 10);
+	if ((eptr == value) || (*eptr != '\0'))
+		return FALSE;
+
+	switch(blobmsg_type(attr)) {
+		case BLOBMSG_TYPE_INT8:
+			return (gint64)blobmsg_get_u8(attr) == num;
+		case BLOBMSG_TYPE_INT16:
+			return (gint64)(gint16)blobmsg_get_u16(attr) == num;
+		case BLOBMSG_TYPE_INT32:
+			return (gint64)(gint32)blobmsg_get_u32(attr) == num;
+		default:
+			return (gint64)blobmsg_get_u64(attr) == num;
+	}
 }
 
 /*
- * Invoked upon reception of data resulting from an ubus call.
- * Result is placed on the agh_ubus_call_data_str global pointer variable. If any content is stored there, it's freed.
- * After this function exits, agh_ubus_call_data_str may still be NULL.
- *
- * Returns: nothing.
+ * Evaluates mask filters on the event blob.
 */
-static void agh_receive_call_result_data(struct ubus_request *req, int type, struct blob_attr *msg) {
+static gboolean agh_ubus_event_filters_match(struct agh_ubus_event_mask *m, struct blob_attr *msg) {
+	struct agh_ubus_event_filter *f;
+	struct blob_attr *cur;
+	GList *l;
+	gint rem;
+	gboolean found;
 
-	g_free(agh_ubus_call_data_str);
-	agh_ubus_call_data_str = NULL;
+	if (!m->filters)
+		return TRUE;
 
 	if (!msg)
-		return;
+		return FALSE;
 
-	agh_ubus_call_data_str = blobmsg_format_json_with_cb(msg, true, NULL, NULL, 0);
-	return;
+	for (l = m->filters->head; l; l = g_list_next(l)) {
+		f = l->data;
+		found = FALSE;
+
+		blobmsg_for_each_attr(cur, msg, rem) {
+			if (!g_strcmp0(blobmsg_name(cur), f->field)) {
+				found = agh_ubus_event_value_matches(cur, f->value);
+				break;
+			}
+		}
+
+		if (!found)
+			return FALSE;
+	}
+
+	return TRUE;
 }
 
 /*
- * Registers an ubus event handler for a specified event mask, allocating a GQueue of masks strings if not already allocated.
- * New event masks strings are added to that GQueue if successfully added.
- * This function may terminate the program uncleanly.
- *
- * Returns: an integer with value 0 on success.
- *  - -1 = no AGH ubus context, NULL mask specified or NULL callback given
- *  - -2 = specified mask was already present
+ * Decides whether an event received by a mask handler should be reported, updating the mask counters. This works on the
+ * event blob, so events we are not interested in are never formatted.
  *
- * Any other value comes from ubus_register_event_handler, which I suppose / hope, returns positive values only.
- * I am not sure of that, but it seems an enum is consistently used in here.
+ * Returns: TRUE when the event should be reported, FALSE when it should be suppressed.
 */
-gint agh_ubus_event_add(struct agh_ubus_ctx *uctx, ubus_event_handler_t cb, const gchar *mask) {
-	gint retval;
-	gchar *mask_tmp;
-	guint i;
-	guint num_masks;
+gboolean agh_ubus_event_accept(struct agh_ubus_event_mask *m, struct blob_attr *msg) {
+	gint64 now;
 
-	retval = 0;
+	m->received++;
 
-	if (!uctx || !mask || !cb) {
-		agh_log_ubus_crit("no AGH ubus context, NULL mask specified or NULL callback given");
-		retval = -1;
-		goto wayout;
+	if (!m->enabled || !agh_ubus_event_filters_match(m, msg)) {
+		m->suppressed++;
+		return FALSE;
 	}
 
-	if (uctx->event_masks) {
-		num_masks = g_queue_get_length(uctx->event_masks);
-		for (i=0;i<num_masks;i++) {
-			mask_tmp = g_queue_peek_nth(uctx->event_masks, i);
-			if (!g_strcmp0(mask_tmp, mask)) {
-				agh_log_ubus_dbg("mask already present");
-				retval = -2;
-				goto wayout;
-			}
+	if (m->rate_limit) {
+		now = g_get_monotonic_time();
 
+		if ((now - m->window_start) >= G_USEC_PER_SEC) {
+			m->window_start = now;
+			m->window_events = 0;
 		}
+
+		if (m->window_events >= m->rate_limit) {
+			m->suppressed++;
+			return FALSE;
+		}
+
+		m->window_events++;
 	}
 
-	uctx->event_handler->cb = cb;
+	m->forwarded++;
 
-	retval = ubus_register_event_handler(uctx->ctx, uctx->event_handler, mask);
-	if (retval) {
-		agh_log_ubus_dbg("ubus_register_event_handler returned a failure (code=%" G_GINT16_FORMAT")",retval);
-		uctx->event_handler->cb = NULL;
-		goto wayout;
+	return TRUE;
+}
+
+/*
+ * Formats an event as JSON, keeping only the fields in the mask projection list, if any.
+ *
+ * Returns: a newly allocated string, or NULL on failure.
+*/
+gchar *agh_ubus_event_render(struct agh_ubus_event_mask *m, struct blob_attr *msg) {
+	struct blob_buf b;
+	struct blob_attr *cur;
+	gchar *res;
+	gint rem;
+
+	if (!msg)
+		return NULL;
+
+	if (!m || !m->fields)
+		return blobmsg_format_json(msg, true);
+
+	memset(&b, 0, sizeof(b));
+
+	if (blob_buf_init(&b, 0)) {
+		agh_log_ubus_crit("blob_buf init failure");
+		return NULL;
 	}
 
-	if (!uctx->event_masks)
-		uctx->event_masks = g_queue_new();
+	blobmsg_for_each_attr(cur, msg, rem) {
+		if (g_strv_contains((const gchar * const *)m->fields, blobmsg_name(cur)))
+			blobmsg_add_blob(&b, cur);
+	}
 
-	g_queue_push_tail(uctx->event_masks, g_strdup(mask));
+	res = blobmsg_format_json(b.head, true);
+	blob_buf_free(&b);
 
-wayout:
-	return retval;
+	return res;
 }
 
 /*
- * This function "resets" the list of masks we're interested in being notified about.
+ * Returns: the event mask an ubus event handler belongs to.
+*/
+struct agh_ubus_event_mask *agh_ubus_event_handler_to_mask(struct ubus_event_handler *ev) {
+	return container_of(ev, struct agh_ubus_event_mask, handler);
+}
+
+/*
+ * This function "resets" the list of masks, by unregistering all of the event handlers and freeing the masks table.
  *
- * Returns: on success, an integer with value 0 is returned. A value of -10 is returned when the specified AGH ubus context is NULL, or no masks GQueue was found.
+ * Returns: an integer with value 0 on success, -10 when AGH ubus context or uctx->event_masks is NULL.
  * Any other error comes directly from ubus_unregister_event_handler, and should be positive, as they seem to consistently use an enum.
+ * In this case, masks whose handler could not be unregistered are kept.
 */
 gint agh_ubus_event_disable(struct agh_ubus_ctx *uctx) {
+	GHashTableIter iter;
+	gpointer value;
 	gint retval;
+	gint ubus_retval;
 
 	retval = -10;
 
@@ -229,38 +1221,173 @@ gint agh_ubus_event_disable(struct agh_ubus_ctx *uctx) {
 		return retval;
 	}
 
-	if ( (retval = ubus_unregister_event_handler(uctx->ctx, uctx->event_handler)) ) {
-		agh_log_ubus_crit("ubus_unregister_event_handler returned a failure (code=%" G_GINT16_FORMAT")",retval);
-		return retval;
+	retval = 0;
+
+	g_hash_table_iter_init(&iter, uctx->event_masks);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		if ( (ubus_retval = agh_ubus_event_mask_stop(value)) ) {
+			retval = ubus_retval;
+			continue;
+		}
+
+		g_hash_table_iter_remove(&iter);
 	}
 
-	g_queue_free_full(uctx->event_masks, g_free);
-	uctx->event_masks = NULL;
-	uctx->event_handler->cb = NULL;
+	if (!g_hash_table_size(uctx->event_masks)) {
+		g_hash_table_destroy(uctx->event_masks);
+		uctx->event_masks = NULL;
+	}
 
 	return retval;
 }
 
 /*
- * This function performs ubus calls.
- * It relies on the ubus APIs, so it may return errors directly from them.
- * Call results are stored in the agh_ubus_call_data_str global pointer; the string to which it pointed before calling this function is freed.
+ * Initializes a blob_buf, and fills it with the given JSON message, if any.
+ *
+ * Returns: an integer with value 0 on success, AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE when the message could not be parsed,
+ * or a value coming from blob_buf_init.
+*/
+static gint agh_ubus_call_message(struct blob_buf *bbuf, const gchar *message) {
+	gint retval;
+
+	if ( (retval = blob_buf_init(bbuf, 0)) ) {
+		agh_log_ubus_crit("blob_buf init failure");
+		return retval;
+	}
+
+	if (message && !blobmsg_add_json_from_string(bbuf, message)) {
+		agh_log_ubus_dbg("failure while parsing JSON message");
+		return AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE;
+	}
+
+	return 0;
+}
+
+/*
+ * Releases an asynchronous call structure, and its deadline GSource.
+*/
+static void agh_ubus_call_free(struct agh_ubus_call *call) {
+
+	if (call->deadline) {
+		g_source_destroy(call->deadline);
+		call->deadline = NULL;
+		call->deadline_tag = 0;
+	}
+
+	g_free(call->path);
+	g_free(call->method);
+	free(call->msg);
+	agh_ubus_call_result_free(call->result);
+	g_free(call);
+
+	return;
+}
+
+/*
+ * Removes an asynchronous call from the list of those in progress, invokes its callback and frees it.
+*/
+static void agh_ubus_call_finish(struct agh_ubus_call *call, gint status) {
+	struct agh_ubus_ctx *uctx = call->uctx;
+
+	if (uctx->calls)
+		g_queue_remove(uctx->calls, call);
+
+	agh_log_ubus_dbg("call %" G_GUINT16_FORMAT" (%s %s) completed (code=%" G_GINT16_FORMAT")", call->id, call->path, call->method, status);
+
+	/* Result ownership goes to the callback. */
+	if (call->cb) {
+		call->cb(status, call->result, call->priv);
+		call->result = NULL;
+	}
+
+	agh_ubus_call_free(call);
+
+	return;
+}
+
+static void agh_ubus_call_data_cb(struct ubus_request *req, int type, struct blob_attr *msg) {
+	struct agh_ubus_call *call = req->priv;
+
+	agh_ubus_call_result_store(&call->result, msg);
+	return;
+}
+
+static void agh_ubus_call_complete_cb(struct ubus_request *req, int ret);
+
+/*
+ * Invokes an asynchronous call again, after looking up the object ID once more: the cached one was stale.
  *
- * Some notes:
- * 1 - Should blob_buf_init fail, returning -ENOMEM.
- * 2 - At the end of this function, we check for bbuf not being NULL: we experienced segfaults otherwise.
- *     (I think it's because of blob_buf_free accessing buf->buf via free, but did not check.)
+ * Returns: 0 on success, or a value coming from ubus functions.
+*/
+static gint agh_ubus_call_retry(struct agh_ubus_call *call) {
+	struct agh_ubus_ctx *uctx = call->uctx;
+	guint32 id;
+	gint retval;
+
+	id = 0;
+
+	agh_log_ubus_dbg("call %" G_GUINT16_FORMAT": object ID for %s was stale, retrying", call->id, call->path);
+
+	agh_ubus_id_cache_forget(uctx, call->path);
+
+	if ( (retval = agh_ubus_lookup_id(uctx, call->path, &id, &call->cached_id)) )
+		return retval;
+
+	if ( (retval = ubus_invoke_async(uctx->ctx, id, call->method, call->msg, &call->req)) )
+		return retval;
+
+	call->req.data_cb = agh_ubus_call_data_cb;
+	call->req.complete_cb = agh_ubus_call_complete_cb;
+	call->req.priv = call;
+
+	ubus_complete_request_async(uctx->ctx, &call->req);
+
+	return 0;
+}
+
+static void agh_ubus_call_complete_cb(struct ubus_request *req, int ret) {
+	struct agh_ubus_call *call = req->priv;
+
+	if ((ret == UBUS_STATUS_NOT_FOUND) && call->cached_id && call->msg && !agh_ubus_call_retry(call))
+		return;
+
+	agh_ubus_call_finish(call, ret);
+	return;
+}
+
+/*
+ * Invoked by GLib when an asynchronous call did not complete in time.
+*/
+static gboolean agh_ubus_call_deadline_cb(gpointer data) {
+	struct agh_ubus_call *call = data;
+
+	agh_log_ubus_crit("call %" G_GUINT16_FORMAT" (%s %s) timed out", call->id, call->path, call->method);
+
+	/* We can do this because we already called g_source_unref on this GSource. */
+	call->deadline = NULL;
+	call->deadline_tag = 0;
+
+	ubus_abort_request(call->uctx->ctx, &call->req);
+	agh_ubus_call_finish(call, UBUS_STATUS_TIMEOUT);
+
+	return FALSE;
+}
+
+/*
+ * Starts an ubus call, without waiting for it to complete: the cb callback will be invoked on completion, or after timeout
+ * seconds (AGH_UBUS_CALL_DEFAULT_TIMEOUT when 0) if the call did not complete by then. The callback is not invoked when this
+ * function fails.
+ * On success, an ID that can be used to cancel the call is stored in *idptr, if not NULL.
  *
  * Returns: an integer value with value 0 on success, or
- *  - AGH_UBUS_CALL_ERROR_BAD_ARGS (-80) when "path" or "method" parameters where NULL
- * - AGH_UBUS_CALL_ERROR_ALLOCFAILURE (-81) on memory allocation failure
- * - AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE (-82) when JSON message parsing failed.
- * Any other value should be considered as returned by other functions
- * (e.g.: -ENOMEM may be returned due to failure in blob_buf_init).
- * For all positive value errors, we recommend the usage of ubus_strerror.
-*/
-gint agh_ubus_call(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *method, const gchar *message) {
+ *  - AGH_UBUS_CALL_ERROR_BAD_ARGS (-80) when there is no ubus connection, or "path" or "method" parameters where NULL
+ *  - AGH_UBUS_CALL_ERROR_ALLOCFAILURE (-81) on memory allocation failure, or when the deadline could not be set
+ *  - AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE (-82) when JSON message parsing failed.
+ * Any other value should be considered as returned by ubus functions, or blob_buf_init.
+*/
+gint agh_ubus_call_async(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *method, const gchar *message, guint timeout, agh_ubus_call_done_cb cb, gpointer priv, guint *idptr) {
 	struct blob_buf *bbuf;
+	struct agh_ubus_call *call;
 	guint32 id;
 	gint retval;
 
@@ -268,15 +1395,18 @@ gint agh_ubus_call(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *me
 	retval = 0;
 	bbuf = NULL;
 
-	g_free(agh_ubus_call_data_str);
-	agh_ubus_call_data_str = NULL;
-
-	if (!path || !method) {
-		agh_log_ubus_dbg("path or method are NULL, and this is not legal");
+	if (!uctx || !uctx->ctx || !path || !method) {
+		agh_log_ubus_dbg("no ubus context, or path or method are NULL");
 		retval = AGH_UBUS_CALL_ERROR_BAD_ARGS;
 		goto wayout;
 	}
 
+	if (!timeout)
+		timeout = AGH_UBUS_CALL_DEFAULT_TIMEOUT;
+
+	if (timeout > AGH_UBUS_CALL_MAX_TIMEOUT)
+		timeout = AGH_UBUS_CALL_MAX_TIMEOUT;
+
 	bbuf = g_try_malloc0(sizeof(*bbuf));
 	if (!bbuf) {
 		agh_log_ubus_crit("can not allocate a blob_buf structure");
@@ -284,23 +1414,70 @@ gint agh_ubus_call(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *me
 		goto wayout;
 	}
 
-	if ( (retval = blob_buf_init(bbuf, 0)) ) {
-		agh_log_ubus_crit("blob_buf init failure");
+	if ( (retval = agh_ubus_call_message(bbuf, message)) )
 		goto wayout;
-	}
 
-	if (message && !blobmsg_add_json_from_string(bbuf, message)) {
-		agh_log_ubus_dbg("failure while parsing JSON message");
-		retval = AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE;
+	call = g_try_malloc0(sizeof(*call));
+	if (!call) {
+		agh_log_ubus_crit("can not allocate call structure");
+		retval = AGH_UBUS_CALL_ERROR_ALLOCFAILURE;
 		goto wayout;
 	}
 
-	if ( (retval = ubus_lookup_id(uctx->ctx, path, &id)) ) {
+	if ( (retval = agh_ubus_lookup_id(uctx, path, &id, &call->cached_id)) ) {
 		agh_log_ubus_dbg("failure from ubus_lookup_id");
+		g_free(call);
+		goto wayout;
+	}
+
+	if ( (retval = ubus_invoke_async(uctx->ctx, id, method, bbuf->head, &call->req)) ) {
+		agh_log_ubus_dbg("failure from ubus_invoke_async");
+		g_free(call);
+		goto wayout;
+	}
+
+	/* Kept in case the call needs to be retried; this is not fatal. */
+	if (call->cached_id)
+		call->msg = blob_memdup(bbuf->head);
+
+	call->req.data_cb = agh_ubus_call_data_cb;
+	call->req.complete_cb = agh_ubus_call_complete_cb;
+	call->req.priv = call;
+	call->uctx = uctx;
+	call->path = g_strdup(path);
+	call->method = g_strdup(method);
+	call->cb = cb;
+	call->priv = priv;
+
+	uctx->call_id++;
+	if (!uctx->call_id)
+		uctx->call_id++;
+
+	call->id = uctx->call_id;
+
+	call->deadline = g_timeout_source_new_seconds(timeout);
+	g_source_set_callback(call->deadline, agh_ubus_call_deadline_cb, call, NULL);
+	call->deadline_tag = g_source_attach(call->deadline, uctx->gmctx);
+	g_source_unref(call->deadline);
+
+	if (!call->deadline_tag) {
+		agh_log_ubus_crit("error while attaching the call deadline GSource to GMainContext");
+		call->deadline = NULL;
+		ubus_abort_request(uctx->ctx, &call->req);
+		agh_ubus_call_free(call);
+		retval = AGH_UBUS_CALL_ERROR_ALLOCFAILURE;
 		goto wayout;
 	}
 
-	retval = ubus_invoke(uctx->ctx, id, method, bbuf->head, agh_receive_call_result_data, NULL, 80 * 1000);
+	if (!uctx->calls)
+		uctx->calls = g_queue_new();
+
+	g_queue_push_tail(uctx->calls, call);
+
+	ubus_complete_request_async(uctx->ctx, &call->req);
+
+	if (idptr)
+		*idptr = call->id;
 
 wayout:
 
@@ -313,36 +1490,38 @@ wayout:
 }
 
 /*
- * Returns a pointer to a string holding the data resulting from an ubus call.
+ * Cancels an asynchronous call in progress. Its callback is invoked with AGH_UBUS_CALL_ERROR_CANCELLED status.
  *
- * Optionally, this function will copy the text.
- *
- * Returns: a pointer pointing to the string (optionally the copied one) or NULL on failure.
- *
- * This function may terminate the program uncleanly.
+ * Returns: an integer with value 0 on success, or
+ *  - 1: no AGH ubus context
+ *  - 2: no call with the given ID is in progress
 */
-gchar *agh_ubus_get_call_result(gboolean dup) {
-	gchar *res;
+gint agh_ubus_call_cancel(struct agh_ubus_ctx *uctx, guint id) {
+	struct agh_ubus_call *call;
+	GList *l;
 
-	res = NULL;
+	if (!uctx) {
+		agh_log_ubus_crit("no AGH ubus context");
+		return 1;
+	}
 
-	if (agh_ubus_call_data_str) {
+	call = NULL;
 
-		if (dup) {
-			res = g_strdup(agh_ubus_call_data_str);
-			g_free(agh_ubus_call_data_str);
-			agh_ubus_call_data_str = NULL;
+	if (uctx->calls)
+		for (l = uctx->calls->head; l; l = g_list_next(l)) {
+			if (((struct agh_ubus_call *)l->data)->id == id) {
+				call = l->data;
+				break;
+			}
 		}
-		else
-			res = agh_ubus_call_data_str;
 
-	}
-	else {
-		agh_log_ubus_dbg("no data to return");
-		agh_log_ubus_dbg("caller asked us to return global pointer");
-	}
+	if (!call)
+		return 2;
 
-	return res;
+	ubus_abort_request(uctx->ctx, &call->req);
+	agh_ubus_call_finish(call, AGH_UBUS_CALL_ERROR_CANCELLED);
+
+	return 0;
 }
 
 /*
@@ -358,14 +1537,12 @@ gchar *agh_ubus_get_call_result(gboolean dup) {
 *
  * Failure values (*retvptr):
  *  - -1 = failure while allocating AGH ubus context
- *  - -2 = failure while allocating ubus event handler structure
  *  - -3 = GSource attach failure
  *
  * Note: this function may terminate the program uncleanly.
 */
 struct agh_ubus_ctx *agh_ubus_setup(struct agh_comm *comm, gint *retvptr) {
 	struct agh_ubus_ctx *uctx;
-	struct ubus_event_handler *event_handler;
 
 	uctx = NULL;
 
@@ -377,7 +1554,6 @@ struct agh_ubus_ctx *agh_ubus_setup(struct agh_comm *comm, gint *retvptr) {
 	/* global vars */
 	agh_ubus_connection_state = AGH_UBUS_STATE_INIT;
 	agh_ubus_aghcomm = comm;
-	agh_ubus_call_data_str = NULL;
 
 	uctx = g_try_malloc0(sizeof(*uctx));
 	if (!uctx) {
@@ -386,25 +1562,10 @@ struct agh_ubus_ctx *agh_ubus_setup(struct agh_comm *comm, gint *retvptr) {
 		goto wayout;
 	}
 
-	event_handler = g_try_malloc0(sizeof(*event_handler));
-	if (!event_handler) {
-		agh_log_ubus_crit("can not allocate ubus event handler struct");
-		*retvptr = -2;
-		goto wayout;
-	}
-
 	uctx->gmctx = comm->ctx;
-	uctx->event_handler = event_handler;
-
-	uctx->agh_ubus_timeoutsrc = g_timeout_source_new(AGH_UBUS_POLL_INTERVAL);
-	g_source_set_callback(uctx->agh_ubus_timeoutsrc, agh_ubus_handle_events, uctx, NULL);
-	uctx->agh_ubus_timeoutsrc_tag = g_source_attach(uctx->agh_ubus_timeoutsrc, uctx->gmctx);
-
-	g_source_unref(uctx->agh_ubus_timeoutsrc);
+	uctx->id_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
-	if (!uctx->agh_ubus_timeoutsrc_tag) {
-		agh_log_ubus_crit("error while attaching the ubus timeout source to GMainContext");
-		uctx->agh_ubus_timeoutsrc = NULL;
+	if (agh_ubus_schedule_connect(uctx)) {
 		*retvptr = -3;
 		goto wayout;
 	}
@@ -414,7 +1575,9 @@ wayout:
 	if (*retvptr) {
 
 		if (uctx) {
-			g_free(uctx->event_handler);
+			if (uctx->id_cache)
+				g_hash_table_destroy(uctx->id_cache);
+
 			g_free(uctx);
 			uctx = NULL;
 		}
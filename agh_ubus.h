@@ -7,14 +7,29 @@
 #include <glib.h>
 
 #define AGH_UBUS_UNIX_SOCKET "/var/run/ubus.sock"
-#define AGH_UBUS_POLL_INTERVAL 800
+
+/*
+ * Interval between connection attempts, in ms: the first attempt is made right away, then the interval doubles up to the
+ * maximum. Once connected, we wait for data on the ubus socket instead.
+*/
+#define AGH_UBUS_CONNECT_RETRY_MIN_INTERVAL 50
+#define AGH_UBUS_CONNECT_RETRY_MAX_INTERVAL 2000
 
 /* ubus calls failure reasons */
 #define AGH_UBUS_CALL_ERROR_BAD_ARGS -80
 #define AGH_UBUS_CALL_ERROR_ALLOCFAILURE -81
 #define AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE -82
+#define AGH_UBUS_CALL_ERROR_CANCELLED -83
 /* end of ubus calls failure reasons */
 
+/* Asynchronous ubus calls: default and maximum deadline, in seconds. */
+#define AGH_UBUS_CALL_DEFAULT_TIMEOUT 80
+#define AGH_UBUS_CALL_MAX_TIMEOUT 3600
+
+/* ubus events signalling objects appearing or going away, used to invalidate cached object IDs */
+#define AGH_UBUS_EVENT_OBJECT_ADD "ubus.object.add"
+#define AGH_UBUS_EVENT_OBJECT_REMOVE "ubus.object.remove"
+
 /* agh_ubus_handle_events states */
 #define AGH_UBUS_STATE_INIT 0
 #define AGH_UBUS_STATE_CONNECTED 1
@@ -22,27 +37,157 @@
 #define AGH_UBUS_STATE_STOP 3
 /* end of agh_ubus_handle_events states */
 
+/* Event masks filter and projection lists separators */
+#define AGH_UBUS_EVENT_LIST_SEPARATOR ","
+#define AGH_UBUS_EVENT_FILTER_SEPARATOR "="
+
+/* Maximum events aggregation window, in milliseconds. */
+#define AGH_UBUS_EVENT_MAX_AGGREGATE_WINDOW 60000
+
+/* A top-level field an event should contain, with the given value. */
+struct agh_ubus_event_filter {
+	gchar *field;
+	gchar *value;
+};
+
+/* Events collapsed during an aggregation window: the latest one, and how many of them were received. */
+struct agh_ubus_event_aggregate {
+	gchar *key;
+	gchar *type;
+	struct blob_attr *msg;
+	guint count;
+};
+
+struct agh_ubus_event_mask;
+
+/* Invoked for every aggregate at the end of an aggregation window. */
+typedef void (*agh_ubus_event_flush_cb)(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg, guint count);
+
+struct agh_ubus_event_mask {
+	/* every mask has its own handler */
+	struct ubus_event_handler handler;
+	struct agh_ubus_ctx *uctx;
+	gchar *mask;
+	gboolean enabled;
+
+	/* Conditions an event should satisfy to be reported: all of them, when more than one is given. */
+	GQueue *filters;
+	gchar *filter_str;
+
+	/* Top-level fields to report; NULL means the whole event. */
+	gchar **fields;
+	gchar *fields_str;
+
+	/* Maximum number of events reported per second, 0 means no limit. */
+	guint rate_limit;
+	gint64 window_start;
+	guint window_events;
+
+	/*
+	 * Aggregation window, in milliseconds; 0 means events are reported as soon as they are received.
+	 * Events are collapsed by type and, if set, by the value of the aggregate_key field.
+	*/
+	guint aggregate_window;
+	gchar *aggregate_key;
+	GQueue *aggregated;
+	GHashTable *aggregated_index;
+	GSource *aggregate_src;
+	guint aggregate_src_tag;
+	agh_ubus_event_flush_cb flush_cb;
+
+	guint64 received;
+	guint64 forwarded;
+	guint64 suppressed;
+	guint64 collapsed;
+};
+
 struct agh_ubus_ctx {
 	GMainContext *gmctx;
 	GSource *agh_ubus_timeoutsrc;
 	guint agh_ubus_timeoutsrc_tag;
+	GSource *agh_ubus_fdsrc;
+	guint agh_ubus_fdsrc_tag;
 	struct ubus_context *ctx;
-	struct ubus_event_handler *event_handler;
-	GQueue *event_masks;
+	/* event masks, by mask */
+	GHashTable *event_masks;
 	struct agh_ubus_logstream_ctx *logstream_ctx;
+
+	/* asynchronous calls in progress */
+	GQueue *calls;
+	guint call_id;
+
+	/* reconnection backoff and statistics */
+	guint reconnect_delay;
+	guint reconnect_attempts;
+	gint64 disconnected_at;
+	guint64 reconnections;
+	gint64 last_recovery_time;
+
+	/* objects we publish on ubus; not owned by us */
+	GQueue *objects;
+
+	/* object path to ID cache */
+	GHashTable *id_cache;
+	struct ubus_event_handler id_cache_handler;
+	guint64 id_cache_hits;
+	guint64 id_cache_misses;
+};
+
+/*
+ * Data returned by an ubus call: the raw blob, and its JSON representation, rendered only when asked for.
+*/
+struct agh_ubus_call_result {
+	struct blob_attr *blob;
+	gchar *json;
+};
+
+/*
+ * Invoked when an asynchronous ubus call completes, fails, times out or is cancelled. status is an ubus status code, or one of
+ * the AGH_UBUS_CALL_ERROR_* values; result may be NULL. When not NULL, result is owned by the callback, and should be released
+ * via agh_ubus_call_result_free.
+*/
+typedef void (*agh_ubus_call_done_cb)(gint status, struct agh_ubus_call_result *result, gpointer priv);
+
+struct agh_ubus_call {
+	struct ubus_request req;
+	struct agh_ubus_ctx *uctx;
+	guint id;
+	gchar *path;
+	gchar *method;
+	struct blob_attr *msg;
+	gboolean cached_id;
+	struct agh_ubus_call_result *result;
+	agh_ubus_call_done_cb cb;
+	gpointer priv;
+	GSource *deadline;
+	guint deadline_tag;
 };
 
-extern gchar *agh_ubus_call_data_str;
 extern gint agh_ubus_connection_state;
 extern struct agh_comm *agh_ubus_aghcomm;
 
 struct agh_ubus_ctx *agh_ubus_setup(struct agh_comm *comm, gint *retvptr);
 gint agh_ubus_teardown(struct agh_ubus_ctx *uctx);
-gint agh_ubus_call(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *method, const gchar *message);
-gchar *agh_ubus_get_call_result(gboolean dup);
+const gchar *agh_ubus_call_result_json(struct agh_ubus_call_result *res);
+void agh_ubus_call_result_free(struct agh_ubus_call_result *res);
+gint agh_ubus_call_async(struct agh_ubus_ctx *uctx, const gchar *path, const gchar *method, const gchar *message, guint timeout, agh_ubus_call_done_cb cb, gpointer priv, guint *idptr);
+gint agh_ubus_call_cancel(struct agh_ubus_ctx *uctx, guint id);
+
+/* ubus objects */
+gint agh_ubus_object_add(struct agh_ubus_ctx *uctx, struct ubus_object *obj);
 
 /* ubus events */
-gint agh_ubus_event_add(struct agh_ubus_ctx *uctx, ubus_event_handler_t cb, const gchar *mask);
+gint agh_ubus_event_add(struct agh_ubus_ctx *uctx, ubus_event_handler_t cb, const gchar *mask, const gchar *filter, const gchar *fields);
+gint agh_ubus_event_remove(struct agh_ubus_ctx *uctx, const gchar *mask);
+gint agh_ubus_event_set_enabled(struct agh_ubus_ctx *uctx, const gchar *mask, gboolean enabled);
+gint agh_ubus_event_set_rate_limit(struct agh_ubus_ctx *uctx, const gchar *mask, guint rate_limit);
+gint agh_ubus_event_set_filter(struct agh_ubus_ctx *uctx, const gchar *mask, const gchar *filter, const gchar *fields);
+gint agh_ubus_event_set_window(struct agh_ubus_ctx *uctx, const gchar *mask, guint window, const gchar *key, agh_ubus_event_flush_cb flush_cb);
+gboolean agh_ubus_event_aggregate(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg);
 gint agh_ubus_event_disable(struct agh_ubus_ctx *uctx);
+struct agh_ubus_event_mask *agh_ubus_event_lookup(struct agh_ubus_ctx *uctx, const gchar *mask);
+gboolean agh_ubus_event_accept(struct agh_ubus_event_mask *m, struct blob_attr *msg);
+gchar *agh_ubus_event_render(struct agh_ubus_event_mask *m, struct blob_attr *msg);
+struct agh_ubus_event_mask *agh_ubus_event_handler_to_mask(struct ubus_event_handler *ev);
 
 #endif
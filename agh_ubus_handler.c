@@ -42,9 +42,75 @@ static gint agh_ubus_cmd_list_cb(struct agh_state *mstate, struct agh_cmd *cmd)
 }
 
 /*
- * Performs ubus calls.
+ * Adds a description of an ubus call failure to a command answer.
+*/
+static void agh_ubus_handler_call_error(struct agh_cmd *cmd, gint status) {
+
+	switch(status) {
+		case AGH_UBUS_CALL_ERROR_BAD_ARGS:
+			agh_cmd_answer_addtext(cmd, "BAD_ARGS", TRUE);
+			break;
+		case AGH_UBUS_CALL_ERROR_ALLOCFAILURE:
+			agh_cmd_answer_addtext(cmd, "BBUF_MALLOC_FAILURE", TRUE);
+			break;
+		case AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE:
+			agh_cmd_answer_addtext(cmd, "INVALID_JSON", TRUE);
+			break;
+		case AGH_UBUS_CALL_ERROR_CANCELLED:
+			agh_cmd_answer_addtext(cmd, "CANCELLED", TRUE);
+			break;
+		case -ENOMEM:
+			agh_cmd_answer_addtext(cmd, "ENOMEM", TRUE);
+			break;
+		default:
+			agh_cmd_answer_addtext(cmd, ubus_strerror(status), TRUE);
+			break;
+	}
+
+	return;
+}
+
+struct agh_ubus_handler_call {
+	struct agh_state *mstate;
+	struct agh_cmd *cmd;
+};
+
+/*
+ * Invoked when an ubus call started via the "call" subcommand completes: the answer is sent now.
+*/
+static void agh_ubus_handler_call_done(gint status, struct agh_ubus_call_result *result, gpointer priv) {
+	struct agh_ubus_handler_call *hcall = priv;
+	struct agh_state *mstate = hcall->mstate;
+	struct agh_message *answer;
+	const gchar *json;
+
+	if (status == UBUS_STATUS_OK) {
+		json = agh_ubus_call_result_json(result);
+		agh_cmd_answer_set_status(hcall->cmd, AGH_CMD_ANSWER_STATUS_OK);
+		agh_cmd_answer_set_data(hcall->cmd, TRUE);
+		agh_cmd_answer_addtext(hcall->cmd, g_strdup_printf("\n%s", json ? json : ""), FALSE);
+	}
+	else
+		agh_ubus_handler_call_error(hcall->cmd, status);
+
+	if (mstate->comm && !mstate->comm->teardown_in_progress) {
+		answer = agh_cmd_answer_msg(hcall->cmd, mstate->comm, NULL);
+		if (agh_msg_send(answer, mstate->comm, NULL)) {
+			agh_msg_dealloc(answer);
+		}
+	}
+
+	agh_ubus_call_result_free(result);
+	agh_cmd_free(hcall->cmd);
+	g_free(hcall);
+
+	return;
+}
+
+/*
+ * Performs ubus calls, asynchronously: the answer is sent when the call completes, or after the specified timeout (in seconds).
  *
- * Returns: 0 on success, 101 when mandatory path argument is missing.
+ * Returns: 0 on success, 101 when mandatory path argument is missing, 102 on allocation failure.
 */
 static gint agh_ubus_cmd_call_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	gint status;
@@ -55,12 +121,16 @@ static gint agh_ubus_cmd_call_cb(struct agh_state *mstate, struct agh_cmd *cmd)
 	const gchar *path;
 	const gchar *method;
 	const gchar *message;
+	gint timeout;
+	guint call_id;
 
-	gchar *res;
+	struct agh_ubus_handler_call *hcall;
 
 	path = NULL;
 	method = NULL;
 	message = NULL;
+	timeout = 0;
+	call_id = 0;
 	retval = 0;
 
 	arg = agh_cmd_get_arg(cmd, 2, CONFIG_TYPE_STRING);
@@ -80,43 +150,104 @@ static gint agh_ubus_cmd_call_cb(struct agh_state *mstate, struct agh_cmd *cmd)
 	if (arg)
 		message = config_setting_get_string(arg);
 
-	status = agh_ubus_call(mstate->uctx, path, method, message);
+	arg = agh_cmd_get_arg(cmd, 5, CONFIG_TYPE_INT);
+	if (arg)
+		timeout = config_setting_get_int(arg);
 
-	switch(status) {
-		case AGH_UBUS_CALL_ERROR_BAD_ARGS:
-			agh_cmd_answer_addtext(cmd, "BAD_ARGS", TRUE);
-			break;
-		case AGH_UBUS_CALL_ERROR_ALLOCFAILURE:
-			agh_cmd_answer_addtext(cmd, "BBUF_MALLOC_FAILURE", TRUE);
-			break;
-		case AGH_UBUS_CALL_ERROR_INVALID_JSON_MESSAGE:
-			agh_cmd_answer_addtext(cmd, "INVALID_JSON", TRUE);
-			break;
-		case -ENOMEM:
-			agh_cmd_answer_addtext(cmd, "ENOMEM", TRUE);
-			break;
-		case UBUS_STATUS_OK:
-			res = agh_ubus_get_call_result(TRUE);
-			agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
-			agh_cmd_answer_set_data(cmd, TRUE);
-			agh_cmd_answer_addtext(cmd, g_strdup_printf("\n%s", res), FALSE);
-			g_free(res);
-			break;
-		default:
-			agh_cmd_answer_addtext(cmd, ubus_strerror(status), TRUE);
-			break;
+	if (timeout < 0) {
+		agh_cmd_answer_addtext(cmd, "INVALID_TIMEOUT", TRUE);
+		goto wayout;
+	}
+
+	hcall = g_try_malloc0(sizeof(*hcall));
+	if (!hcall) {
+		agh_log_ubus_handler_crit("unable to allocate call context");
+		retval = 102;
+		goto wayout;
+	}
+
+	hcall->mstate = mstate;
+	hcall->cmd = agh_cmd_copy(cmd);
+	if (!hcall->cmd) {
+		agh_log_ubus_handler_crit("command copy failed");
+		g_free(hcall);
+		retval = 102;
+		goto wayout;
 	}
 
+	status = agh_ubus_call_async(mstate->uctx, path, method, message, timeout, agh_ubus_handler_call_done, hcall, &call_id);
+	if (status) {
+		agh_cmd_free(hcall->cmd);
+		g_free(hcall);
+		agh_ubus_handler_call_error(cmd, status);
+		goto wayout;
+	}
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("async_ubus_call=%" G_GUINT16_FORMAT"", call_id), FALSE);
+
 wayout:
 	return retval;
 }
 
 /*
- * This function runs when an ubus event has been received.
+ * Cancels an ubus call in progress.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_cancel_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg;
+	gint call_id;
+
+	call_id = 0;
+
+	arg = agh_cmd_get_arg(cmd, 2, CONFIG_TYPE_INT);
+	if (arg)
+		call_id = config_setting_get_int(arg);
+
+	if ((call_id <= 0) || agh_ubus_call_cancel(mstate->uctx, call_id)) {
+		agh_cmd_answer_addtext(cmd, "NO_SUCH_CALL", TRUE);
+		return 0;
+	}
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(cmd, "OK", TRUE);
+
+	return 0;
+}
+
+/*
+ * Reports ubus statistics.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_stats_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	struct agh_ubus_ctx *uctx = mstate->uctx;
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("id_cache_hits=%" G_GUINT64_FORMAT"", uctx->id_cache_hits), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("id_cache_misses=%" G_GUINT64_FORMAT"", uctx->id_cache_misses), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("id_cache_entries=%" G_GUINT16_FORMAT"", uctx->id_cache ? g_hash_table_size(uctx->id_cache) : 0), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("calls_in_progress=%" G_GUINT16_FORMAT"", uctx->calls ? g_queue_get_length(uctx->calls) : 0), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("reconnections=%" G_GUINT64_FORMAT"", uctx->reconnections), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("last_recovery_time_ms=%" G_GINT64_FORMAT"", uctx->last_recovery_time / 1000), FALSE);
+
+	if (uctx->logstream_ctx) {
+		agh_cmd_answer_addtext(cmd, g_strdup_printf("logstream_filtered=%" G_GUINT64_FORMAT"", uctx->logstream_ctx->filtered), FALSE);
+		agh_cmd_answer_addtext(cmd, g_strdup_printf("logstream_folded=%" G_GUINT64_FORMAT"", uctx->logstream_ctx->folded), FALSE);
+		agh_cmd_answer_addtext(cmd, g_strdup_printf("logstream_suppressed=%" G_GUINT64_FORMAT"", uctx->logstream_ctx->suppressed), FALSE);
+	}
+
+	return 0;
+}
+
+/*
+ * Reports an ubus event; count is 0 for events reported as soon as they are received, and the number of collapsed events
+ * otherwise.
  *
  * Returns: <nothing>.
 */
-static void agh_ubus_handler_receive_event(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg) {
+static void agh_ubus_handler_emit_event(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg, guint count) {
 	struct agh_cmd *agh_event;
 	gchar *event_message;
 	gint error_value;
@@ -134,13 +265,17 @@ static void agh_ubus_handler_receive_event(struct ubus_context *ctx, struct ubus
 		return;
 	}
 
-	event_message = blobmsg_format_json(msg, true);
+	event_message = agh_ubus_event_render(m, msg);
 
 	if (event_message) {
 		agh_cmd_answer_set_data(agh_event, TRUE);
 		agh_cmd_answer_set_status(agh_event, AGH_CMD_ANSWER_STATUS_OK);
 		agh_cmd_answer_addtext(agh_event, "\""AGH_UBUS_HANDLER_UBUS_EVENTs_NAME"\"", TRUE);
-		agh_cmd_answer_addtext(agh_event, g_strdup_printf("\n{ \"%s\": %s }\n", type, event_message), FALSE);
+
+		if (count)
+			agh_cmd_answer_addtext(agh_event, g_strdup_printf("\n{ \"%s\": %s, \"count\": %u }\n", type, event_message, count), FALSE);
+		else
+			agh_cmd_answer_addtext(agh_event, g_strdup_printf("\n{ \"%s\": %s }\n", type, event_message), FALSE);
 	}
 	else {
 		agh_cmd_answer_set_status(agh_event, AGH_CMD_ANSWER_STATUS_FAIL);
@@ -154,8 +289,45 @@ static void agh_ubus_handler_receive_event(struct ubus_context *ctx, struct ubus
 	return;
 }
 
+/*
+ * Invoked at the end of an aggregation window, once per collapsed events group.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_handler_flush_events(struct agh_ubus_event_mask *m, const gchar *type, struct blob_attr *msg, guint count) {
+	agh_ubus_handler_emit_event(m, type, msg, count);
+	return;
+}
+
+/*
+ * This function runs when an ubus event has been received.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_handler_receive_event(struct ubus_context *ctx, struct ubus_event_handler *ev, const char *type, struct blob_attr *msg) {
+	struct agh_ubus_event_mask *m;
+
+	if (!agh_ubus_aghcomm || agh_ubus_aghcomm->teardown_in_progress) {
+		agh_log_ubus_handler_crit("discarding event due to missing agh_ubus_aghcomm, or agh_ubus_aghcomm teardown being in progress");
+		return;
+	}
+
+	/* Filters are evaluated on the blob: events nobody asked for are never formatted nor queued. */
+	m = agh_ubus_event_handler_to_mask(ev);
+	if (!agh_ubus_event_accept(m, msg))
+		return;
+
+	if (agh_ubus_event_aggregate(m, type, msg))
+		return;
+
+	agh_ubus_handler_emit_event(m, type, msg, 0);
+
+	return;
+}
+
 /*
  * Listen for new ubus events, and maintain an internal (to AGH) mask list.
+ * An optional filter ("field=value,field2=value2") and fields projection list ("field,field2") may follow the mask.
  *
  * Returns: always 0;
 */
@@ -163,8 +335,12 @@ static gint agh_ubus_cmd_listen_add_cb(struct agh_state *mstate, struct agh_cmd
 	gint ubus_retval;
 	config_setting_t *arg;
 	const gchar *current_mask;
+	const gchar *filter;
+	const gchar *fields;
 
 	ubus_retval = 0;
+	filter = NULL;
+	fields = NULL;
 
 	arg = agh_cmd_get_arg(cmd, 3, CONFIG_TYPE_STRING);
 
@@ -173,12 +349,26 @@ static gint agh_ubus_cmd_listen_add_cb(struct agh_state *mstate, struct agh_cmd
 	else
 		current_mask = config_setting_get_string(arg);
 
-	ubus_retval = agh_ubus_event_add(mstate->uctx, agh_ubus_handler_receive_event, current_mask);
+	arg = agh_cmd_get_arg(cmd, 4, CONFIG_TYPE_STRING);
+	if (arg)
+		filter = config_setting_get_string(arg);
+
+	arg = agh_cmd_get_arg(cmd, 5, CONFIG_TYPE_STRING);
+	if (arg)
+		fields = config_setting_get_string(arg);
+
+	ubus_retval = agh_ubus_event_add(mstate->uctx, agh_ubus_handler_receive_event, current_mask, filter, fields);
 
 	switch(ubus_retval) {
 		case -2:
 			agh_cmd_answer_addtext(cmd, "ALREADY_PRESENT", TRUE);
 			break;
+		case -3:
+			agh_cmd_answer_addtext(cmd, "INVALID_FILTER", TRUE);
+			break;
+		case -4:
+			agh_cmd_answer_addtext(cmd, "ALLOCATION_FAILURE", TRUE);
+			break;
 		case UBUS_STATUS_OK:
 			agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 			agh_cmd_answer_addtext(cmd, "OK", TRUE);
@@ -195,7 +385,7 @@ static gint agh_ubus_cmd_listen_add_cb(struct agh_state *mstate, struct agh_cmd
  * Disable ubus events reporting.
  *
  * Returns: an integer with value 0 on success, or
- *  - 101: when no ubus context or event masks queue are found.
+ *  - 101: when no ubus context or event masks table are found.
 */
 static gint agh_ubus_cmd_listen_reset_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	gint retval;
@@ -221,12 +411,164 @@ wayout:
 	return retval;
 }
 
+/*
+ * Answers an event mask related command, given the return value of the agh_ubus_event_* function it invoked.
+ *
+ * Returns: nothing.
+*/
+static void agh_ubus_cmd_listen_answer(struct agh_cmd *cmd, gint ubus_retval) {
+
+	switch(ubus_retval) {
+		case -1:
+			agh_cmd_answer_addtext(cmd, "INVALID_ARGUMENTS", TRUE);
+			break;
+		case -2:
+			agh_cmd_answer_addtext(cmd, "NOT_FOUND", TRUE);
+			break;
+		case -3:
+			agh_cmd_answer_addtext(cmd, "INVALID_FILTER", TRUE);
+			break;
+		case -4:
+			agh_cmd_answer_addtext(cmd, "ALLOCATION_FAILURE", TRUE);
+			break;
+		case UBUS_STATUS_OK:
+			agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+			agh_cmd_answer_addtext(cmd, "OK", TRUE);
+			break;
+		default:
+			agh_cmd_answer_addtext(cmd, ubus_strerror(ubus_retval), TRUE);
+			break;
+	}
+
+	return;
+}
+
+/*
+ * Returns: the event mask argument of an event mask related command, or NULL if not present.
+*/
+static const gchar *agh_ubus_cmd_listen_mask(struct agh_cmd *cmd) {
+	config_setting_t *arg;
+
+	arg = agh_cmd_get_arg(cmd, 3, CONFIG_TYPE_STRING);
+	if (!arg)
+		return NULL;
+
+	return config_setting_get_string(arg);
+}
+
+/*
+ * Stops reporting events for a single mask.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_listen_remove_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_remove(mstate->uctx, agh_ubus_cmd_listen_mask(cmd)));
+	return 0;
+}
+
+/*
+ * Temporarily enables or disables a mask, keeping its settings and counters.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_listen_enable_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_set_enabled(mstate->uctx, agh_ubus_cmd_listen_mask(cmd), TRUE));
+	return 0;
+}
+
+static gint agh_ubus_cmd_listen_disable_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_set_enabled(mstate->uctx, agh_ubus_cmd_listen_mask(cmd), FALSE));
+	return 0;
+}
+
+/*
+ * Sets the maximum number of events per second reported for a mask.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_listen_limit_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg;
+	gint rate_limit;
+
+	arg = agh_cmd_get_arg(cmd, 4, CONFIG_TYPE_INT);
+	if (!arg) {
+		agh_cmd_answer_addtext(cmd, "INVALID_LIMIT", TRUE);
+		return 0;
+	}
+
+	rate_limit = config_setting_get_int(arg);
+	if (rate_limit < 0) {
+		agh_cmd_answer_addtext(cmd, "INVALID_LIMIT", TRUE);
+		return 0;
+	}
+
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_set_rate_limit(mstate->uctx, agh_ubus_cmd_listen_mask(cmd), rate_limit));
+	return 0;
+}
+
+/*
+ * Replaces filter and fields projection list of a mask. Omitted ones are cleared.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_listen_filter_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg;
+	const gchar *filter;
+	const gchar *fields;
+
+	filter = NULL;
+	fields = NULL;
+
+	arg = agh_cmd_get_arg(cmd, 4, CONFIG_TYPE_STRING);
+	if (arg)
+		filter = config_setting_get_string(arg);
+
+	arg = agh_cmd_get_arg(cmd, 5, CONFIG_TYPE_STRING);
+	if (arg)
+		fields = config_setting_get_string(arg);
+
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_set_filter(mstate->uctx, agh_ubus_cmd_listen_mask(cmd), filter, fields));
+	return 0;
+}
+
+/*
+ * Sets the aggregation window of a mask: events received during it are collapsed, and reported once, along with their count.
+ *
+ * Returns: always 0.
+*/
+static gint agh_ubus_cmd_listen_window_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg;
+	gint window;
+	const gchar *key;
+
+	key = NULL;
+
+	arg = agh_cmd_get_arg(cmd, 4, CONFIG_TYPE_INT);
+	if (!arg) {
+		agh_cmd_answer_addtext(cmd, "INVALID_WINDOW", TRUE);
+		return 0;
+	}
+
+	window = config_setting_get_int(arg);
+	if ((window < 0) || (window > AGH_UBUS_EVENT_MAX_AGGREGATE_WINDOW)) {
+		agh_cmd_answer_addtext(cmd, "INVALID_WINDOW", TRUE);
+		return 0;
+	}
+
+	arg = agh_cmd_get_arg(cmd, 5, CONFIG_TYPE_STRING);
+	if (arg)
+		key = config_setting_get_string(arg);
+
+	agh_ubus_cmd_listen_answer(cmd, agh_ubus_event_set_window(mstate->uctx, agh_ubus_cmd_listen_mask(cmd), window, key, agh_ubus_handler_flush_events));
+	return 0;
+}
+
 /* AGH_CMD_UBUS_LISTEN subcommands struct */
 static const struct agh_cmd_operation agh_ubus_handler_listen_subcommands[] = {
 	{
 		.op_name = AGH_CMD_UBUS_LISTEN_ADD,
 		.min_args = 0,
-		.max_args = 1,
+		.max_args = 3,
 		.cmd_cb = agh_ubus_cmd_listen_add_cb
 	},
 	{
@@ -235,6 +577,42 @@ static const struct agh_cmd_operation agh_ubus_handler_listen_subcommands[] = {
 		.max_args = 0,
 		.cmd_cb = agh_ubus_cmd_listen_reset_cb
 	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_REMOVE,
+		.min_args = 1,
+		.max_args = 1,
+		.cmd_cb = agh_ubus_cmd_listen_remove_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_ENABLE,
+		.min_args = 1,
+		.max_args = 1,
+		.cmd_cb = agh_ubus_cmd_listen_enable_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_DISABLE,
+		.min_args = 1,
+		.max_args = 1,
+		.cmd_cb = agh_ubus_cmd_listen_disable_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_LIMIT,
+		.min_args = 2,
+		.max_args = 2,
+		.cmd_cb = agh_ubus_cmd_listen_limit_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_FILTER,
+		.min_args = 1,
+		.max_args = 3,
+		.cmd_cb = agh_ubus_cmd_listen_filter_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_LISTEN_WINDOW,
+		.min_args = 2,
+		.max_args = 3,
+		.cmd_cb = agh_ubus_cmd_listen_window_cb
+	},
 
 	{ }
 };
@@ -242,16 +620,16 @@ static const struct agh_cmd_operation agh_ubus_handler_listen_subcommands[] = {
 /*
  * Handle ubus events related commands. With no subcommands, gives back current status.
  *
- * Returns: an integer with value 0 on success, 101 when no event masks queue is present and no subcommand has been found.
+ * Returns: an integer with value 0 on success, 101 when no event masks table is present and no subcommand has been found.
 */
 static gint agh_ubus_cmd_listen_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
 	config_setting_t *arg;
-	guint i;
-	guint num_events;
-	const gchar *current_event_mask;
+	GHashTableIter iter;
+	gpointer value;
+	struct agh_ubus_event_mask *current_event_mask;
+	GString *status;
 	gint retval;
 
-	i = 0;
 	retval = 0;
 
 	arg = agh_cmd_get_arg(cmd, 2, CONFIG_TYPE_STRING);
@@ -267,11 +645,32 @@ static gint agh_ubus_cmd_listen_cb(struct agh_state *mstate, struct agh_cmd *cmd
 
 		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
 
-		num_events = g_queue_get_length(mstate->uctx->event_masks);
+		g_hash_table_iter_init(&iter, mstate->uctx->event_masks);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			current_event_mask = value;
+
+			status = g_string_new(current_event_mask->mask);
+			g_string_append_printf(status, " enabled=%s", current_event_mask->enabled ? "true" : "false");
+
+			if (current_event_mask->filter_str)
+				g_string_append_printf(status, " filter=%s", current_event_mask->filter_str);
+
+			if (current_event_mask->fields_str)
+				g_string_append_printf(status, " fields=%s", current_event_mask->fields_str);
 
-		for (i=0;i<num_events;i++) {
-			current_event_mask = g_queue_peek_nth(mstate->uctx->event_masks, i);
-			agh_cmd_answer_addtext(cmd, current_event_mask, TRUE);
+			if (current_event_mask->rate_limit)
+				g_string_append_printf(status, " limit=%u", current_event_mask->rate_limit);
+
+			if (current_event_mask->aggregate_window)
+				g_string_append_printf(status, " window=%u", current_event_mask->aggregate_window);
+
+			if (current_event_mask->aggregate_key)
+				g_string_append_printf(status, " key=%s", current_event_mask->aggregate_key);
+
+			g_string_append_printf(status, " received=%" G_GUINT64_FORMAT" forwarded=%" G_GUINT64_FORMAT" suppressed=%" G_GUINT64_FORMAT" collapsed=%" G_GUINT64_FORMAT"",
+				current_event_mask->received, current_event_mask->forwarded, current_event_mask->suppressed, current_event_mask->collapsed);
+
+			agh_cmd_answer_addtext(cmd, g_string_free(status, FALSE), FALSE);
 		}
 
 		goto wayout;
@@ -285,14 +684,24 @@ wayout:
 }
 
 /*
- * Enables log streaming.
+ * Enables log streaming. Arguments, when present, are logstream filter conditions (see agh_ubus_logstream_filter_add) and batching
+ * options (see agh_ubus_logstream_batch_option); when logstream is already active, they replace the current ones.
  *
  * Returns: an integer with value 0 on success, or 101 when ubus context was NULL.
 */
 static gint agh_ubus_cmd_logstream_enable_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	struct agh_ubus_logstream_filter *filter;
+	struct agh_ubus_logstream_batch batch;
+	config_setting_t *arg;
+	const gchar *spec;
+	gboolean options;
+	gint option_ret;
 	gint logstream_ret;
+	guint i;
 	gint retval;
 
+	filter = NULL;
+	options = FALSE;
 	retval = 0;
 
 	/* We should not be there if this is true... */
@@ -302,8 +711,52 @@ static gint agh_ubus_cmd_logstream_enable_cb(struct agh_state *mstate, struct ag
 		goto wayout;
 	}
 
+	agh_ubus_logstream_batch_init(&batch);
+
+	for (i = 3; agh_cmd_get_arg(cmd, i, CONFIG_TYPE_NONE); i++) {
+		options = TRUE;
+		spec = NULL;
+
+		arg = agh_cmd_get_arg(cmd, i, CONFIG_TYPE_STRING);
+		if (arg)
+			spec = config_setting_get_string(arg);
+
+		option_ret = agh_ubus_logstream_batch_option(&batch, spec);
+		if (option_ret < 0) {
+			if (!filter) {
+				filter = agh_ubus_logstream_filter_new();
+				if (!filter) {
+					agh_cmd_answer_addtext(cmd, "ALLOCATION_FAILURE", TRUE);
+					goto wayout;
+				}
+			}
+
+			option_ret = agh_ubus_logstream_filter_add(filter, spec);
+		}
+
+		if (option_ret) {
+			agh_cmd_answer_addtext(cmd, "INVALID_FILTER", TRUE);
+			agh_ubus_logstream_filter_free(filter);
+			goto wayout;
+		}
+	}
+
 	logstream_ret = agh_ubus_logstream_init(mstate->uctx);
 
+	/* Changing the options of an active logstream is fine. */
+	if ((logstream_ret == 2) && options)
+		logstream_ret = 0;
+
+	if (!logstream_ret) {
+		logstream_ret = agh_ubus_logstream_set_filter(mstate->uctx, filter);
+		filter = NULL;
+	}
+
+	if (!logstream_ret)
+		logstream_ret = agh_ubus_logstream_set_batch(mstate->uctx, &batch);
+
+	agh_ubus_logstream_filter_free(filter);
+
 	switch(logstream_ret) {
 		case 0:
 			agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
@@ -362,7 +815,8 @@ static const struct agh_cmd_operation agh_ubus_handler_logstream_subcommands[] =
 	{
 		.op_name = AGH_CMD_UBUS_LOGSTREAM_ACTIVATE,
 		.min_args = 0,
-		.max_args = 0,
+		/* 5 filter conditions, and 3 batching options */
+		.max_args = 8,
 		.cmd_cb = agh_ubus_cmd_logstream_enable_cb
 	},
 	{
@@ -406,19 +860,32 @@ static const struct agh_cmd_operation agh_ubus_handler_subcommands[] = {
 	{
 		.op_name = AGH_CMD_UBUS_CALL,
 		.min_args = 1,
-		.max_args = 3,
+		.max_args = 4,
 		.cmd_cb = agh_ubus_cmd_call_cb
 	},
+	{
+		.op_name = AGH_CMD_UBUS_CANCEL,
+		.min_args = 1,
+		.max_args = 1,
+		.cmd_cb = agh_ubus_cmd_cancel_cb
+	},
+	{
+		.op_name = AGH_CMD_UBUS_STATS,
+		.min_args = 0,
+		.max_args = 0,
+		.cmd_cb = agh_ubus_cmd_stats_cb
+	},
 	{
 		.op_name = AGH_CMD_UBUS_LISTEN,
 		.min_args = 0,
-		.max_args = 2,
+		.max_args = 4,
 		.cmd_cb = agh_ubus_cmd_listen_cb
 	},
 	{
 		.op_name = AGH_CMD_UBUS_LOGSTREAM,
 		.min_args = 1,
-		.max_args = 1,
+		/* subcommand, and its arguments */
+		.max_args = 9,
 		.cmd_cb = agh_ubus_cmd_logstream_cb
 	},
 
@@ -447,7 +914,8 @@ static const struct agh_cmd_operation agh_ubus_handler_ops[] = {
 	{
 		.op_name = AGH_CMD_UBUS,
 		.min_args = 1,
-		.max_args = 4,
+		/* the longest one being "logstream +" with all its options */
+		.max_args = 10,
 		.cmd_cb = agh_ubus_cmd_cb
 	},
 
@@ -11,6 +11,8 @@
 /* AGH_CMD_UBUS subcommands. */
 #define AGH_CMD_UBUS_LIST "list"
 #define AGH_CMD_UBUS_CALL "call"
+#define AGH_CMD_UBUS_CANCEL "cancel"
+#define AGH_CMD_UBUS_STATS "stats"
 #define AGH_CMD_UBUS_LISTEN "events"
 #define AGH_CMD_UBUS_LOGSTREAM "logstream"
 /* End of AGH_CMD_UBUS subcommands. */
@@ -18,6 +20,12 @@
 /* AGH_CMD_UBUS_LISTEN subcommands */
 #define AGH_CMD_UBUS_LISTEN_ADD "add"
 #define AGH_CMD_UBUS_LISTEN_STOP "reset"
+#define AGH_CMD_UBUS_LISTEN_REMOVE "remove"
+#define AGH_CMD_UBUS_LISTEN_ENABLE "enable"
+#define AGH_CMD_UBUS_LISTEN_DISABLE "disable"
+#define AGH_CMD_UBUS_LISTEN_LIMIT "limit"
+#define AGH_CMD_UBUS_LISTEN_FILTER "filter"
+#define AGH_CMD_UBUS_LISTEN_WINDOW "window"
 /* end of AGH_CMD_UBUS_LISTEN subcommands */
 
 /* AGH_CMD_UBUS_LOGSTREAM subcommands. */
@@ -11,6 +11,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <time.h>
+#include <string.h>
 #include <glib.h>
 #include <syslog.h>
 #include <libubox/blobmsg_json.h>
@@ -103,40 +104,165 @@ const char* agh_ubus_logstream_getcodetext(int value, CODE *codetable) {
 	return "<unknown>";
 }
 
-/* Lots of code in here comes from log_notify, found in logread.c (ubox package); LGPL as well. */
-gint agh_ubus_logstream_parse_log(struct blob_attr *msg, gchar **destptr) {
-	struct blob_attr *tb[__LOG_MAX];
+/*
+ * The reverse of agh_ubus_logstream_getcodetext: looks up a facility or priority by name.
+ *
+ * Returns: the LOG_FAC value of the facility, or the priority, when found; -1 otherwise.
+*/
+gint agh_ubus_logstream_getcodevalue(const gchar *name, gboolean facility) {
+	CODE *i;
 
-	/* Why + 128 ? */
-	char buf[AGH_UBUS_LOGSTREAM_LOG_LINE_SIZE + 128];
-	char buf_ts[32];
-	char *c;
-	uint32_t p;
-	time_t t;
-	gchar *msg_str;
+	for (i = facility ? facilitynames : prioritynames; i->c_name; i++) {
+		if (g_strcmp0(i->c_name, name))
+			continue;
 
-	uint32_t t_ms = 0;
-	int ret = 0;
+		if (facility)
+			return LOG_FAC(i->c_val);
 
-	if (*destptr)
-		return 1;
+		if (i->c_val > LOG_PRIMASK)
+			break;
+
+		return i->c_val;
+	}
+
+	return -1;
+}
+
+/*
+ * Facility and priority names, indexed directly by LOG_FAC and LOG_PRI values; filled in from the syslog code tables on first use.
+*/
+static const gchar *agh_ubus_logstream_facility_names[(LOG_FACMASK >> 3) + 1];
+static const gchar *agh_ubus_logstream_priority_names[LOG_PRIMASK + 1];
+
+static void agh_ubus_logstream_names_init(void) {
+	guint i;
+
+	if (agh_ubus_logstream_priority_names[0])
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS(agh_ubus_logstream_facility_names); i++)
+		agh_ubus_logstream_facility_names[i] = agh_ubus_logstream_getcodetext(i << 3, facilitynames);
+
+	for (i = 0; i < G_N_ELEMENTS(agh_ubus_logstream_priority_names); i++)
+		agh_ubus_logstream_priority_names[i] = agh_ubus_logstream_getcodetext(i, prioritynames);
+
+	return;
+}
+
+/*
+ * Renders the "<ctime> [<seconds>." timestamp prefix of log lines. Messages come in bursts, so the last rendered prefix is kept
+ * and reused while the second does not change.
+ *
+ * Returns: the prefix length; the prefix itself is pointed to by *prefix, and is valid until the next call.
+*/
+static gsize agh_ubus_logstream_timestamp(time_t t, const gchar **prefix) {
+	static time_t cached_t = (time_t)-1;
+	static gchar cached_prefix[64];
+	static gsize cached_len;
+	gchar ctime_buf[32];
+	gsize len;
+
+	if (t != cached_t) {
+		if (!ctime_r(&t, ctime_buf))
+			g_strlcpy(ctime_buf, "<unknown>", sizeof(ctime_buf));
+
+		len = strlen(ctime_buf);
+		if (len && (ctime_buf[len - 1] == '\n'))
+			ctime_buf[len - 1] = '\0';
+
+		cached_len = g_snprintf(cached_prefix, sizeof(cached_prefix), "%s [%lu.", ctime_buf, (unsigned long)t);
+		if (cached_len >= sizeof(cached_prefix))
+			cached_len = sizeof(cached_prefix) - 1;
+
+		cached_t = t;
+	}
+
+	*prefix = cached_prefix;
+	return cached_len;
+}
+
+/*
+ * Parses the fields of a log message coming from logd. Pointers stored in *log point inside msg.
+ *
+ * Returns: 0 on success, 1 on a malformed message.
+*/
+gint agh_ubus_logstream_parse_log(struct blob_attr *msg, struct agh_ubus_logstream_log *log) {
+	struct blob_attr *tb[__LOG_MAX];
 
 	blobmsg_parse(log_policy, ARRAY_SIZE(log_policy), tb, blob_data(msg), blob_len(msg));
 	if (!tb[LOG_ID] || !tb[LOG_PRIO] || !tb[LOG_SOURCE] || !tb[LOG_TIME] || !tb[LOG_MSG])
 		return 1;
 
-	msg_str = blobmsg_get_string(tb[LOG_MSG]);
-
-	t = blobmsg_get_u64(tb[LOG_TIME]) / 1000;
-	t_ms = blobmsg_get_u64(tb[LOG_TIME]) % 1000;
-	snprintf(buf_ts, sizeof(buf_ts), "[%lu.%03u] ", (unsigned long)t, t_ms);
-
-	c = ctime(&t);
+	log->msg = blobmsg_get_string(tb[LOG_MSG]);
+	log->priority = blobmsg_get_u32(tb[LOG_PRIO]);
+	log->source = blobmsg_get_u32(tb[LOG_SOURCE]);
+	log->time = blobmsg_get_u64(tb[LOG_TIME]);
 
-	p = blobmsg_get_u32(tb[LOG_PRIO]);
-	c[strlen(c) - 1] = '\0';
-	snprintf(buf, sizeof(buf), "%s %s%s.%s%s %s\n", c, buf_ts, agh_ubus_logstream_getcodetext(LOG_FAC(p) << 3, facilitynames), agh_ubus_logstream_getcodetext(LOG_PRI(p), prioritynames), (blobmsg_get_u32(tb[LOG_SOURCE])) ? ("") : (" kernel:"), msg_str);
-	*destptr = g_strdup_printf("\n%s", buf);
+	return 0;
+}
 
-	return ret;
+/*
+ * Lots of code in here comes from log_notify, found in logread.c (ubox package); LGPL as well.
+ *
+ * The line is written once, into a buffer of the right size.
+ * Its format is the one used by logread: "\n<ctime> [<seconds>.<milliseconds>] <facility>.<priority>[ kernel:] <message>\n".
+ *
+ * Returns: the formatted line, to be freed by the caller.
+*/
+gchar *agh_ubus_logstream_format_log(const struct agh_ubus_logstream_log *log) {
+	const gchar *ts_prefix;
+	const gchar *facility_name;
+	const gchar *priority_name;
+	gsize ts_len;
+	gsize facility_len;
+	gsize priority_len;
+	gsize kernel_len;
+	gsize msg_len;
+	gchar *line;
+	gchar *c;
+	guint ms;
+
+	agh_ubus_logstream_names_init();
+
+	msg_len = strlen(log->msg);
+
+	/* logread truncates lines this long */
+	if (msg_len > AGH_UBUS_LOGSTREAM_LOG_LINE_SIZE)
+		msg_len = AGH_UBUS_LOGSTREAM_LOG_LINE_SIZE;
+
+	ms = log->time % 1000;
+	ts_len = agh_ubus_logstream_timestamp((time_t)(log->time / 1000), &ts_prefix);
+
+	facility_name = agh_ubus_logstream_facility_names[LOG_FAC(log->priority)];
+	priority_name = agh_ubus_logstream_priority_names[LOG_PRI(log->priority)];
+	facility_len = strlen(facility_name);
+	priority_len = strlen(priority_name);
+	kernel_len = log->source ? 0 : strlen(" kernel:");
+
+	/* "\n" + prefix + "mmm] " + facility + "." + priority + kernel + " " + message + "\n" + NUL */
+	line = g_malloc(1 + ts_len + 5 + facility_len + 1 + priority_len + kernel_len + 1 + msg_len + 2);
+	c = line;
+
+	*c++ = '\n';
+	memcpy(c, ts_prefix, ts_len);
+	c += ts_len;
+	*c++ = '0' + (ms / 100);
+	*c++ = '0' + ((ms / 10) % 10);
+	*c++ = '0' + (ms % 10);
+	*c++ = ']';
+	*c++ = ' ';
+	memcpy(c, facility_name, facility_len);
+	c += facility_len;
+	*c++ = '.';
+	memcpy(c, priority_name, priority_len);
+	c += priority_len;
+	memcpy(c, " kernel:", kernel_len);
+	c += kernel_len;
+	*c++ = ' ';
+	memcpy(c, log->msg, msg_len);
+	c += msg_len;
+	*c++ = '\n';
+	*c = '\0';
+
+	return line;
 }
@@ -20,8 +20,18 @@ enum {
 	__LOG_MAX
 };
 
+/* A log message as sent by logd; source is 0 for kernel messages. */
+struct agh_ubus_logstream_log {
+	const gchar *msg;
+	guint32 priority;
+	guint32 source;
+	guint64 time;
+};
+
 const gchar *agh_ubus_helper_format_type(gpointer priv, struct blob_attr *attr);
 void agh_ubus_handler_list_receive_results(struct ubus_context *ctx, struct ubus_object_data *obj, gpointer data);
-gint agh_ubus_logstream_parse_log(struct blob_attr *msg, gchar **destptr);
+gint agh_ubus_logstream_getcodevalue(const gchar *name, gboolean facility);
+gint agh_ubus_logstream_parse_log(struct blob_attr *msg, struct agh_ubus_logstream_log *log);
+gchar *agh_ubus_logstream_format_log(const struct agh_ubus_logstream_log *log);
 
 #endif
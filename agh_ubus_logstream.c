@@ -4,6 +4,9 @@
 #include "agh_ubus_helpers.h"
 #include "agh_commands.h"
 #include "agh_logging.h"
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
 
 /* Log messages from AGH_LOG_DOMAIN_UBUS_LOGSTREAM domain. */
 #define AGH_LOG_DOMAIN_UBUS_LOGSTREAM "LOGSTREAM"
@@ -12,11 +15,8 @@
 #define agh_log_ubus_logstream_dbg(message, ...) agh_log_dbg(AGH_LOG_DOMAIN_UBUS_LOGSTREAM, message, ##__VA_ARGS__)
 #define agh_log_ubus_logstream_crit(message, ...) agh_log_crit(AGH_LOG_DOMAIN_UBUS_LOGSTREAM, message, ##__VA_ARGS__)
 
-/* logstream states: */
-#define AGH_UBUS_LOGSTREAM_STATE_INIT 0
-#define AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT 1
-#define AGH_UBUS_LOGSTREAM_STATE_CONNECTED 2
-#define AGH_UBUS_LOGSTREAM_STATE_RECONNECT 3
+static void agh_ubus_logstream_schedule(struct agh_ubus_logstream_ctx *lctx, guint delay);
+static void agh_ubus_logstream_schedule_retry(struct agh_ubus_logstream_ctx *lctx);
 
 /*
  * This function should be invoked when we have the fd we can use to communicate with logd.
@@ -30,6 +30,24 @@ static void agh_ubus_logstream_fd_cb(struct ubus_request *req, int fd) {
 	return;
 }
 
+/*
+ * Invoked when logd answered our request, with or without a file descriptor. The request can not be freed from here, since
+ * libubus is still using it: the state machine is run as soon as possible instead, and takes care of that.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_complete_cb(struct ubus_request *req, int ret) {
+	struct agh_ubus_logstream_ctx *lctx = req->priv;
+
+	lctx->req_completed = TRUE;
+
+	if (ret)
+		agh_log_ubus_logstream_dbg("log read request failed (%s)", ubus_strerror(ret));
+
+	agh_ubus_logstream_schedule(lctx, 0);
+	return;
+}
+
 /*
  * Deinitializes logstream channel, and in particular the GIOChannel and the GSource used to "watch" it.
  *
@@ -63,109 +81,483 @@ static gint agh_ubus_logstream_channel_deinit(struct agh_ubus_logstream_ctx *lct
 
 	lctx->fd = -1;
 
-	if (lctx->cmsg) {
-		g_string_free(lctx->cmsg, TRUE);
-		lctx->cmsg = NULL;
+	/* A partial message is of no use on a new channel. */
+	lctx->rbuf_len = 0;
+
+	return 0;
+}
+
+/*
+ * Emits the current batch event, if any.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_batch_flush(struct agh_ubus_logstream_ctx *lctx) {
+	struct agh_cmd *log_event;
+
+	if (lctx->batch_src) {
+		g_source_destroy(lctx->batch_src);
+		lctx->batch_src = NULL;
+		lctx->batch_tag = 0;
+	}
+
+	if (!lctx->batch_event)
+		return;
+
+	log_event = lctx->batch_event;
+	lctx->batch_event = NULL;
+	lctx->batch_count = 0;
+
+	if (!agh_ubus_aghcomm || agh_ubus_aghcomm->teardown_in_progress) {
+		agh_log_ubus_logstream_crit("discarding logstream event due to missing agh_ubus_aghcomm (or teardown in progress)");
+		agh_cmd_free(log_event);
+		return;
+	}
+
+	agh_cmd_emit_event(agh_ubus_aghcomm, log_event);
+
+	return;
+}
+
+static gboolean agh_ubus_logstream_batch_timeout(gpointer data) {
+	struct agh_ubus_logstream_ctx *lctx = data;
+
+	lctx->batch_src = NULL;
+	lctx->batch_tag = 0;
+
+	agh_ubus_logstream_batch_flush(lctx);
+
+	return FALSE;
+}
+
+/*
+ * Adds a formatted line to the current batch event, allocating a new one when needed; see struct agh_ubus_logstream_batch for
+ * when it is emitted. The line is owned by the event from now on, or freed on failure.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 4: event allocation failure
+ *  - 5: no AGH COMM, or teardown in progress
+*/
+static gint agh_ubus_logstream_batch_add(struct agh_ubus_logstream_ctx *lctx, gchar *line, guint32 priority) {
+	gint event_error_value;
+
+	event_error_value = 0;
+
+	if (!agh_ubus_aghcomm || agh_ubus_aghcomm->teardown_in_progress) {
+		agh_log_ubus_logstream_crit("discarding logstream event due to missing agh_ubus_aghcomm (or teardown in progress)");
+		g_free(line);
+		return 5;
+	}
+
+	if (!lctx->batch_event) {
+		lctx->batch_event = agh_cmd_event_alloc(&event_error_value);
+		if (!lctx->batch_event) {
+			agh_log_ubus_logstream_crit("discarding logstream event due to agh_cmd_event_alloc failure (code=%" G_GINT16_FORMAT")", event_error_value);
+			g_free(line);
+			return 4;
+		}
+
+		agh_cmd_answer_set_data(lctx->batch_event, TRUE);
+		agh_cmd_answer_set_status(lctx->batch_event, AGH_CMD_ANSWER_STATUS_OK);
+		agh_cmd_answer_addtext(lctx->batch_event, "\""AGH_UBUS_LOGSTREAM_LOG_EVENTs_NAME"\"", TRUE);
+	}
+
+	/* Lines already start and end with a newline, and data events text parts are concatenated as they are. */
+	agh_cmd_answer_addtext(lctx->batch_event, line, FALSE);
+	lctx->batch_count++;
+
+	if ((lctx->batch_count >= lctx->batch.lines) || ((gint)LOG_PRI(priority) <= lctx->batch.flush_priority)) {
+		agh_ubus_logstream_batch_flush(lctx);
+		return 0;
+	}
+
+	if (!lctx->batch_src) {
+		lctx->batch_src = g_timeout_source_new(lctx->batch.interval);
+		g_source_set_callback(lctx->batch_src, agh_ubus_logstream_batch_timeout, lctx, NULL);
+		lctx->batch_tag = g_source_attach(lctx->batch_src, lctx->gmctx);
+		g_source_unref(lctx->batch_src);
+		if (!lctx->batch_tag) {
+			agh_log_ubus_logstream_crit("failed to attach batch timeout source to GMainContext");
+			lctx->batch_src = NULL;
+			agh_ubus_logstream_batch_flush(lctx);
+		}
 	}
 
 	return 0;
 }
 
 /*
- * I simulated problems and tested error paths. Do you see any problem here?
+ * Adds a message generated by logstream itself to the current batch event.
  *
- * This function is executed each time there is IO to process on the GIOChannel. It assembles system log messages, and emits events for them.
- * This function runs multiple times per log message, hence a 0 return value does not indicate "success" in the usual sense of the term.
+ * Returns: see agh_ubus_logstream_batch_add.
+*/
+static gint agh_ubus_logstream_batch_add_notice(struct agh_ubus_logstream_ctx *lctx, const gchar *text, guint32 priority, guint32 source) {
+	struct agh_ubus_logstream_log log;
+
+	log.msg = text;
+	log.priority = priority;
+	log.source = source;
+	log.time = g_get_real_time() / 1000;
+
+	return agh_ubus_logstream_batch_add(lctx, agh_ubus_logstream_format_log(&log), log.priority);
+}
+
+/*
+ * Reports how many times the last message was repeated, if it was.
  *
- * Returns: an integer with values as follows:
- *  - 0: maybe we are still processing a message, maybe not, but we are OK
- *  - 1: failure while allocating a message part
- *  - 2: GIOChannel was in a status different than G_IO_STATUS_NORMAL, and this is a problem :)
+ * Returns: an integer with value 0 on success, or the failure from agh_ubus_logstream_batch_add.
+*/
+static gint agh_ubus_logstream_notice_repeats(struct agh_ubus_logstream_ctx *lctx) {
+	gchar *text;
+	gint retval;
+
+	if (!lctx->repeats)
+		return 0;
+
+	text = g_strdup_printf("last message repeated %u times", lctx->repeats);
+	lctx->repeats = 0;
+	retval = agh_ubus_logstream_batch_add_notice(lctx, text, lctx->last_priority, lctx->last_source);
+	g_free(text);
+
+	return retval;
+}
+
+/*
+ * Reports folded and suppressed messages, if any.
+ *
+ * Returns: an integer with value 0 on success, or the failure from agh_ubus_logstream_batch_add.
+*/
+static gint agh_ubus_logstream_notice(struct agh_ubus_logstream_ctx *lctx) {
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+	struct agh_ubus_logstream_bucket *bucket;
+	GString *notice;
+	gint retval;
+
+	retval = agh_ubus_logstream_notice_repeats(lctx);
+
+	if (!lctx->buckets)
+		return retval;
+
+	notice = NULL;
+
+	g_hash_table_iter_init(&iter, lctx->buckets);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		bucket = value;
+
+		if (!bucket->suppressed)
+			continue;
+
+		if (!notice)
+			notice = g_string_new("logstream: suppressed messages:");
+		else
+			g_string_append_c(notice, ',');
+
+		g_string_append_printf(notice, " %s=%" G_GUINT64_FORMAT"", (const gchar *)key, bucket->suppressed);
+		bucket->suppressed = 0;
+	}
+
+	if (notice) {
+		if (!retval)
+			retval = agh_ubus_logstream_batch_add_notice(lctx, notice->str, LOG_DAEMON | LOG_NOTICE, 1);
+
+		g_string_free(notice, TRUE);
+	}
+
+	return retval;
+}
+
+static gboolean agh_ubus_logstream_notice_timeout(gpointer data) {
+	struct agh_ubus_logstream_ctx *lctx = data;
+
+	lctx->notice_src = NULL;
+	lctx->notice_tag = 0;
+
+	agh_ubus_logstream_notice(lctx);
+
+	return FALSE;
+}
+
+/*
+ * Makes sure a notice about folded or suppressed messages is going to be reported.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_notice_schedule(struct agh_ubus_logstream_ctx *lctx) {
+
+	if (lctx->notice_src)
+		return;
+
+	lctx->notice_src = g_timeout_source_new(AGH_UBUS_LOGSTREAM_NOTICE_INTERVAL);
+	g_source_set_callback(lctx->notice_src, agh_ubus_logstream_notice_timeout, lctx, NULL);
+	lctx->notice_tag = g_source_attach(lctx->notice_src, lctx->gmctx);
+	g_source_unref(lctx->notice_src);
+	if (!lctx->notice_tag) {
+		agh_log_ubus_logstream_crit("failed to attach notice timeout source to GMainContext");
+		lctx->notice_src = NULL;
+	}
+
+	return;
+}
+
+/*
+ * Checks a parsed log message against a logstream filter; see struct agh_ubus_logstream_filter.
+ *
+ * Returns: TRUE when the message should be reported, FALSE otherwise.
+*/
+static gboolean agh_ubus_logstream_filter_match(const struct agh_ubus_logstream_filter *filter, const struct agh_ubus_logstream_log *log) {
+
+	if ((filter->max_priority >= 0) && (LOG_PRI(log->priority) > (guint32)filter->max_priority))
+		return FALSE;
+
+	if (filter->facilities && ((LOG_FAC(log->priority) >= 32) || !(filter->facilities & (1U << LOG_FAC(log->priority)))))
+		return FALSE;
+
+	if (filter->source && ((filter->source == 1) == (log->source != 0)))
+		return FALSE;
+
+	if (filter->match && !strstr(log->msg, filter->match))
+		return FALSE;
+
+	if (filter->regex && !g_regex_match(filter->regex, log->msg, 0, NULL))
+		return FALSE;
+
+	return TRUE;
+}
+
+/*
+ * Folds identical consecutive messages.
+ *
+ * Returns: TRUE when the message repeats the previous one, and should not be reported.
+*/
+static gboolean agh_ubus_logstream_fold(struct agh_ubus_logstream_ctx *lctx, const struct agh_ubus_logstream_log *log) {
+
+	if (lctx->last_msg && (lctx->last_priority == log->priority) && (lctx->last_source == log->source) && !strcmp(lctx->last_msg, log->msg)) {
+		lctx->repeats++;
+		lctx->folded++;
+		agh_ubus_logstream_notice_schedule(lctx);
+		return TRUE;
+	}
+
+	/* A different message: report how many times the previous one was repeated, before it. */
+	agh_ubus_logstream_notice_repeats(lctx);
+
+	g_free(lctx->last_msg);
+	lctx->last_msg = g_strdup(log->msg);
+	lctx->last_priority = log->priority;
+	lctx->last_source = log->source;
+
+	return FALSE;
+}
+
+/*
+ * Takes a token from the bucket of the message source. Sources are told apart by the program name the message starts with; the
+ * number of buckets is limited, and sources coming in when they are all in use share a single one. Should a bucket not be
+ * allocated, the message is let through.
+ *
+ * Returns: TRUE when the message should be suppressed.
+*/
+static gboolean agh_ubus_logstream_limit(struct agh_ubus_logstream_ctx *lctx, const struct agh_ubus_logstream_log *log) {
+	struct agh_ubus_logstream_bucket *bucket;
+	gchar key[AGH_UBUS_LOGSTREAM_MAX_SOURCE_LEN + 1];
+	gsize key_len;
+	gint64 now;
+
+	if (!log->source)
+		g_strlcpy(key, AGH_UBUS_LOGSTREAM_KERNEL_SOURCE, sizeof(key));
+	else {
+		key_len = strcspn(log->msg, "[: ");
+		if (!key_len || (key_len > AGH_UBUS_LOGSTREAM_MAX_SOURCE_LEN))
+			g_strlcpy(key, AGH_UBUS_LOGSTREAM_OTHER_SOURCE, sizeof(key));
+		else {
+			memcpy(key, log->msg, key_len);
+			key[key_len] = '\0';
+		}
+	}
+
+	if (!lctx->buckets)
+		lctx->buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	bucket = g_hash_table_lookup(lctx->buckets, key);
+	if (!bucket && (g_hash_table_size(lctx->buckets) >= AGH_UBUS_LOGSTREAM_MAX_SOURCES)) {
+		g_strlcpy(key, AGH_UBUS_LOGSTREAM_OTHER_SOURCE, sizeof(key));
+		bucket = g_hash_table_lookup(lctx->buckets, key);
+	}
+
+	now = g_get_monotonic_time();
+
+	if (!bucket) {
+		bucket = g_try_malloc0(sizeof(*bucket));
+		if (!bucket) {
+			agh_log_ubus_logstream_crit("can not allocate bucket, message not rate limited");
+			return FALSE;
+		}
+
+		bucket->tokens = AGH_UBUS_LOGSTREAM_BUCKET_BURST;
+		bucket->last_refill = now;
+		g_hash_table_insert(lctx->buckets, g_strdup(key), bucket);
+	}
+
+	bucket->tokens += (gdouble)(now - bucket->last_refill) * AGH_UBUS_LOGSTREAM_BUCKET_RATE / G_USEC_PER_SEC;
+	if (bucket->tokens > AGH_UBUS_LOGSTREAM_BUCKET_BURST)
+		bucket->tokens = AGH_UBUS_LOGSTREAM_BUCKET_BURST;
+
+	bucket->last_refill = now;
+
+	if (bucket->tokens < 1) {
+		bucket->suppressed++;
+		lctx->suppressed++;
+		agh_ubus_logstream_notice_schedule(lctx);
+		return TRUE;
+	}
+
+	bucket->tokens--;
+
+	return FALSE;
+}
+
+/*
+ * Parses a complete log message and adds it to the current batch event, unless it is filtered out, folded or suppressed.
+ * All of these checks look at the raw message fields: only messages to be reported are formatted.
+ *
+ * Returns: an integer with value 0 on success (filtered out, folded and suppressed messages included), or
  *  - 3: message parse failed, failure in agh_ubus_logstream_parse_log
- *  - 4: event emission failure
+ *  - 4, 5: see agh_ubus_logstream_batch_add
+*/
+static gint agh_ubus_logstream_process_message(struct agh_ubus_logstream_ctx *lctx, struct blob_attr *msg) {
+	struct agh_ubus_logstream_log log;
+
+	if (agh_ubus_logstream_parse_log(msg, &log)) {
+		agh_log_ubus_logstream_crit("message parsing failed; message is lost");
+		return 3;
+	}
+
+	if (lctx->filter && !agh_ubus_logstream_filter_match(lctx->filter, &log)) {
+		lctx->filtered++;
+		return 0;
+	}
+
+	if (agh_ubus_logstream_fold(lctx, &log))
+		return 0;
+
+	if (agh_ubus_logstream_limit(lctx, &log)) {
+		/* Repetitions of a suppressed message are suppressed as well, not folded. */
+		g_free(lctx->last_msg);
+		lctx->last_msg = NULL;
+		return 0;
+	}
+
+	return agh_ubus_logstream_batch_add(lctx, agh_ubus_logstream_format_log(&log), log.priority);
+}
+
+/*
+ * This function is executed each time there is IO to process on the GIOChannel.
+ * It reads as much data as fits in our read buffer with a single read, then processes in place every complete message found
+ * there. A trailing partial message is moved to the beginning of the buffer, and completed by subsequent reads.
+ * logd sends every message as a blob_attr header followed by its payload, without trailing padding: should a message end at an
+ * unaligned offset, what follows is moved to the start of the buffer.
  *
- * This function may lead to an unclean program termination.
- * Furthermore, even in the face of errors, the function may be invoked multiple times. (and this comment needs to be more precise)
+ * Returns: an integer with values as follows:
+ *  - 0: OK, or no data available for now
+ *  - 1: message too big, or malformed
+ *  - 2: GIOChannel was in a status different than G_IO_STATUS_NORMAL or G_IO_STATUS_AGAIN, and this is a problem :)
+ *  - 3, 4, 5: see agh_ubus_logstream_process_message
+ *  - 6: read buffer memory allocation failure
 */
 static gint agh_ubus_logstream_incoming_message(struct agh_ubus_logstream_ctx *lctx) {
-	struct blob_attr *message_part;
+	struct blob_attr *msg;
 	GIOStatus status;
 	gsize data_read;
-	gchar *parsed_text_log_message;
-	struct agh_cmd *log_event;
-	gint event_error_value;
+	gsize offset;
+	gsize msg_len;
+	gint retval;
+	guint8 *rbuf;
 
 	data_read = 0;
-	parsed_text_log_message = NULL;  /* this is needed, or agh_ubus_logstream_parse_log will fail */
-	event_error_value = 0;
-
-	if (!lctx->cmsg)
-		lctx->cmsg = g_string_new(NULL);
-
-	while(lctx->cmsg) {
-		message_part = g_try_malloc0(sizeof(*message_part));
-		if (!message_part) {
-			agh_log_ubus_logstream_crit("unable to allocate log message part");
-			g_string_free(lctx->cmsg, TRUE);
-			lctx->cmsg = NULL;
-			return 1;
-		}
+	offset = 0;
+	retval = 0;
 
-		status = g_io_channel_read_chars(lctx->logstream_channel, (gchar *)message_part, sizeof(*message_part), &data_read, &lctx->gerr);
-		if (status != G_IO_STATUS_NORMAL) {
-			agh_log_ubus_logstream_crit("error while reading log channel data; ", lctx->gerr ? lctx->gerr->message : "unknown error");
-			g_error_free(lctx->gerr);
-			lctx->gerr = NULL;
-			g_string_free(lctx->cmsg, TRUE);
-			lctx->cmsg = NULL;
-			g_free(message_part);
-			return 2;
+	if (!lctx->rbuf) {
+		lctx->rbuf = g_try_malloc(AGH_UBUS_LOGSTREAM_READ_BUFFER_SIZE);
+		if (!lctx->rbuf) {
+			agh_log_ubus_logstream_crit("can not allocate read buffer");
+			return 6;
 		}
 
-		g_string_append_len(lctx->cmsg, (gchar*)message_part, sizeof(*message_part));
-		g_free(message_part);
+		lctx->rbuf_size = AGH_UBUS_LOGSTREAM_READ_BUFFER_SIZE;
+		lctx->rbuf_len = 0;
+	}
 
-		/*
-		 * We need a complete blob_attr structure to be able then to "safely" read the blob length via blob_len, in a successive iteration.
-		*/
-		if (lctx->cmsg->len < sizeof(struct blob_attr))
+	status = g_io_channel_read_chars(lctx->logstream_channel, (gchar *)lctx->rbuf + lctx->rbuf_len, lctx->rbuf_size - lctx->rbuf_len, &data_read, &lctx->gerr);
+	switch(status) {
+		case G_IO_STATUS_NORMAL:
 			break;
+		case G_IO_STATUS_AGAIN:
+			return 0;
+		default:
+			agh_log_ubus_logstream_crit("error while reading log channel data; %s", lctx->gerr ? lctx->gerr->message : "unknown error");
+			g_clear_error(&lctx->gerr);
+			lctx->rbuf_len = 0;
+			return 2;
+	}
 
-		if (lctx->cmsg->len < blob_len((struct blob_attr *)lctx->cmsg->str) + sizeof(struct blob_attr))
-			break;
+	lctx->rbuf_len += data_read;
+
+	/* logd is talking to us: should the channel fail from now on, we will reconnect right away. */
+	if (data_read)
+		lctx->retry_delay = 0;
 
-		/* We should have a complete message now. */
-		message_part = (struct blob_attr *)g_string_free(lctx->cmsg, FALSE);
-		lctx->cmsg = NULL;
+	while (lctx->rbuf_len - offset >= sizeof(struct blob_attr)) {
+		msg = (struct blob_attr *)(lctx->rbuf + offset);
+		msg_len = blob_raw_len(msg);
 
-		/* Don't get confused by the variable name, we are parsing the complete message now. */
-		if (agh_ubus_logstream_parse_log(message_part, &parsed_text_log_message)) {
-			agh_log_ubus_logstream_crit("message parsing failed; message is lost");
-			g_free(message_part);
-			return 3;
+		if ((msg_len < sizeof(struct blob_attr)) || (msg_len > AGH_UBUS_LOGSTREAM_MAX_MESSAGE_SIZE)) {
+			agh_log_ubus_logstream_crit("malformed log message (length=%" G_GSIZE_FORMAT")", msg_len);
+			lctx->rbuf_len = 0;
+			return 1;
 		}
 
-		g_free(message_part);
+		if (lctx->rbuf_len - offset < msg_len)
+			break;
 
-		if (!agh_ubus_aghcomm || agh_ubus_aghcomm->teardown_in_progress) {
-			agh_log_ubus_logstream_crit("discarding logstream event due to missing agh_ubus_aghcomm (or teardown in progress)");
-			g_free(parsed_text_log_message);
-			return 5;
+		retval = agh_ubus_logstream_process_message(lctx, msg);
+		if (retval) {
+			lctx->rbuf_len = 0;
+			return retval;
 		}
 
-		log_event = agh_cmd_event_alloc(&event_error_value);
-		if (!log_event) {
-			agh_log_ubus_logstream_crit("discarding logstream event due to agh_cmd_event_alloc failure (code=%" G_GINT16_FORMAT")", event_error_value);
-			g_free(parsed_text_log_message);
-			return 4;
+		offset += msg_len;
+
+		/* Keep blob_attr accesses aligned. */
+		if (offset % sizeof(guint32)) {
+			memmove(lctx->rbuf, lctx->rbuf + offset, lctx->rbuf_len - offset);
+			lctx->rbuf_len -= offset;
+			offset = 0;
 		}
+	}
 
-		agh_cmd_answer_set_data(log_event, TRUE);
-		agh_cmd_answer_set_status(log_event, AGH_CMD_ANSWER_STATUS_OK);
-		agh_cmd_answer_addtext(log_event, "\""AGH_UBUS_LOGSTREAM_LOG_EVENTs_NAME"\"", TRUE);
-		agh_cmd_answer_addtext(log_event, parsed_text_log_message, FALSE);
-		agh_cmd_emit_event(agh_ubus_aghcomm, log_event);
+	/* Carry the partial tail over. */
+	if (offset) {
+		memmove(lctx->rbuf, lctx->rbuf + offset, lctx->rbuf_len - offset);
+		lctx->rbuf_len -= offset;
+	}
+
+	/* Make room for a message bigger than our buffer. */
+	if (lctx->rbuf_len >= sizeof(struct blob_attr)) {
+		msg_len = blob_raw_len((struct blob_attr *)lctx->rbuf);
+
+		if (msg_len > lctx->rbuf_size) {
+			rbuf = g_try_realloc(lctx->rbuf, msg_len);
+			if (!rbuf) {
+				agh_log_ubus_logstream_crit("can not grow read buffer to %" G_GSIZE_FORMAT" bytes, dropping message", msg_len);
+				lctx->rbuf_len = 0;
+				return 6;
+			}
 
+			lctx->rbuf = rbuf;
+			lctx->rbuf_size = msg_len;
+		}
 	}
 
 	return 0;
@@ -173,8 +565,9 @@ static gint agh_ubus_logstream_incoming_message(struct agh_ubus_logstream_ctx *l
 
 /*
  * This is the channel IO watch function ("logwatcher"). As a GSource-derived type of function, it respects related GLib semantics.
- * Whenever agh_ubus_logstream_incoming_message fails, this function does emit a log message and "restarts" the GIOChannel, by setting lctx->logstream_state to AGH_UBUS_LOGSTREAM_STATE_RECONNECT
- *  (see agh_ubus_logstream_statemachine).
+ * Whenever agh_ubus_logstream_incoming_message fails, or the channel is closed, this function does emit a log message and
+ * "restarts" the GIOChannel, by setting lctx->logstream_state to AGH_UBUS_LOGSTREAM_STATE_RECONNECT, and scheduling a run of
+ * agh_ubus_logstream_statemachine. This GSource is removed in that case, so we do not spin on a dead channel.
 */
 static gboolean agh_ubus_logstream_channel_io(GIOChannel *channel, GIOCondition condition, gpointer data) {
 	struct agh_ubus_logstream_ctx *lctx = data;
@@ -182,24 +575,26 @@ static gboolean agh_ubus_logstream_channel_io(GIOChannel *channel, GIOCondition
 
 	retval = 0;
 
-	switch(condition) {
-		case G_IO_IN:
-		case G_IO_PRI:
-			if ( (retval = agh_ubus_logstream_incoming_message(lctx)) ) {
-				agh_log_ubus_logstream_crit("failure from agh_ubus_logstream_incoming_message (code=%" G_GINT16_FORMAT")", retval);
-				lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_RECONNECT;
-			}
-			break;
-		case G_IO_ERR:
-		case G_IO_HUP:
-			lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_RECONNECT;
-			break;
-		default:
-			agh_log_ubus_logstream_crit("unknown GIOChannel condition");
-			return FALSE;
+	if (condition & (G_IO_IN | G_IO_PRI)) {
+		retval = agh_ubus_logstream_incoming_message(lctx);
+		if (!retval)
+			return TRUE;
+
+		agh_log_ubus_logstream_crit("failure from agh_ubus_logstream_incoming_message (code=%" G_GINT16_FORMAT")", retval);
+	}
+	else if (condition & (G_IO_ERR | G_IO_HUP))
+		agh_log_ubus_logstream_dbg("log channel closed");
+	else {
+		agh_log_ubus_logstream_crit("unknown GIOChannel condition");
+		return TRUE;
 	}
 
-	return TRUE;
+	lctx->logwatcher = NULL;
+	lctx->logwatcher_id = 0;
+	lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_RECONNECT;
+	agh_ubus_logstream_schedule_retry(lctx);
+
+	return FALSE;
 }
 
 /*
@@ -246,6 +641,15 @@ static gint agh_ubus_logstream_channel_init(struct agh_ubus_logstream_ctx *lctx,
 		goto wayout;
 	}
 
+	/* We do our own buffering (see agh_ubus_logstream_incoming_message), and never want to block waiting for data. */
+	g_io_channel_set_buffered(lctx->logstream_channel, FALSE);
+
+	status = g_io_channel_set_flags(lctx->logstream_channel, G_IO_FLAG_NONBLOCK, &lctx->gerr);
+	if (status != G_IO_STATUS_NORMAL) {
+		agh_log_ubus_logstream_crit("can not set log channel as non-blocking; %s", lctx->gerr ? lctx->gerr->message : "unknown error");
+		g_clear_error(&lctx->gerr);
+	}
+
 	g_io_channel_set_close_on_unref(lctx->logstream_channel, TRUE);
 
 	/*
@@ -272,160 +676,272 @@ wayout:
 }
 
 /*
- * The is the logstream state machine: implemented as a GSOurce, it checks at any time whether we are connected to logd or not.
- * Should we get disconnected for any reason, this GSource will try to reconnect. I am pretty certain we can do this more efficiently.
+ * Frees our log read request, and the related blob buffer.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_request_free(struct agh_ubus_logstream_ctx *lctx) {
+
+	if (lctx->b) {
+		blob_buf_free(lctx->b);
+		g_free(lctx->b);
+		lctx->b = NULL;
+	}
+
+	g_free(lctx->current_req);
+	lctx->current_req = NULL;
+	lctx->req_completed = FALSE;
+
+	return;
+}
+
+/*
+ * Sends logd a request for a file descriptor to read log messages from.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: allocation failure
+ *  - 2: no log object in ubus, or request failure; this is considered a temporary failure
+*/
+static gint agh_ubus_logstream_request(struct agh_ubus_ctx *uctx) {
+	struct agh_ubus_logstream_ctx *lctx = uctx->logstream_ctx;
+	guint32 id;
+
+	id = 0;
+
+	agh_log_ubus_logstream_dbg("asking for FD");
+
+	lctx->b = g_try_malloc0(sizeof(struct blob_buf));
+	if (!lctx->b) {
+		agh_log_ubus_logstream_dbg("failed to allocate struct blob_buf");
+		return 1;
+	}
+
+	if (blob_buf_init(lctx->b, 0) || blobmsg_add_u8(lctx->b, "stream", 1) || blobmsg_add_u8(lctx->b, "oneshot", 0) || blobmsg_add_u32(lctx->b, "lines", 0)) {
+		agh_log_ubus_logstream_dbg("failure while building request");
+		agh_ubus_logstream_request_free(lctx);
+		return 1;
+	}
+
+	if (ubus_lookup_id(uctx->ctx, "log", &id)) {
+		agh_log_ubus_logstream_dbg("no log object in ubus");
+		agh_ubus_logstream_request_free(lctx);
+		return 2;
+	}
+
+	lctx->current_req = g_try_malloc0(sizeof(struct ubus_request));
+	if (!lctx->current_req) {
+		agh_ubus_logstream_request_free(lctx);
+		return 1;
+	}
+
+	if (ubus_invoke_async(uctx->ctx, id, "read", lctx->b->head, lctx->current_req)) {
+		agh_log_ubus_logstream_dbg("failure while sending request");
+		agh_ubus_logstream_request_free(lctx);
+		return 2;
+	}
+
+	lctx->current_req->fd_cb = agh_ubus_logstream_fd_cb;
+	lctx->current_req->complete_cb = agh_ubus_logstream_complete_cb;
+	lctx->current_req->priv = lctx;
+	lctx->req_completed = FALSE;
+
+	ubus_complete_request_async(uctx->ctx, lctx->current_req);
+
+	return 0;
+}
+
+/*
+ * This is the logstream state machine. It runs only when something happens: when logstream is enabled, when logd answers our
+ * request (see agh_ubus_logstream_complete_cb), when the log channel fails (see agh_ubus_logstream_channel_io), when we are
+ * connected to ubus again (see agh_ubus_logstream_restart), and after a failure, once the retry delay elapsed.
+ * Transitions are followed until a state where we need to wait for something is reached.
  * Note how in this function we set to NULL every pointer on lctx (which is an agh_ubus_logstream_ctx struct) after freeing the related memory.
  * Infact, calling g_free (or free) on a NULL ptr is fine, while calling it on already freed memory is not.
  *
  * States:
- * AGH_UBUS_LOGSTREAM_STATE_INIT (0): when in this state, we try to get a file descriptor to receive messages from ubox's logd.
- * Thus, we send a request to logd itself via ubus, retrying indefinitely until we get a response, or we are removed/destroyed.
- * If we're not connected to ubus, then our current request, and associated blob buffer, are deallocated, and we'll rebuild them next time we're connected to ubus again
- *  (there's no valid reason for that at the moment, I think it just seemed a goo idea at the time; read the code as this comment does not explain the concept adequately).
- * Only a single request will be made, regardless how many times we're run. We expect a state transition to happen via the agh_ubus_logstream_fd_cb function.
+ * AGH_UBUS_LOGSTREAM_STATE_INIT (0): when in this state, we ask ubox's logd for a file descriptor to receive messages from, via
+ * ubus. If we're not connected to ubus, we wait for agh_ubus_logstream_restart to be invoked. Temporary failures (i.e. no logd
+ * yet) are retried with an exponential backoff. Only a single request is made at any time: we expect a state transition to
+ * happen via the agh_ubus_logstream_fd_cb function; if logd answers without a file descriptor, the request is made again later.
  *
- * AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT (1): we got a file descriptor, so we init the logstream channel on it.
+ * AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT (1): we got a file descriptor, so we init the logstream channel on it, once logd completed
+ * our request.
  *
- * AGH_UBUS_LOGSTREAM_STATE_CONNECTED (2): we're happy.
+ * AGH_UBUS_LOGSTREAM_STATE_CONNECTED (2): we're happy, and there is nothing to do.
  *
  * AGH_UBUS_LOGSTREAM_STATE_RECONNECT (3): we deinitialize the logstream channel, and return to AGH_UBUS_LOGSTREAM_STATE_INIT.
+ *
+ * Returns: <nothing>.
 */
-static gboolean agh_ubus_logstream_statemachine(gpointer data) {
-	struct agh_ubus_ctx *uctx = data;
+static void agh_ubus_logstream_step(struct agh_ubus_ctx *uctx) {
 	struct agh_ubus_logstream_ctx *lctx = uctx->logstream_ctx;
 
-	guint32 id;
+	while (TRUE) {
+		switch(lctx->logstream_state) {
+			case AGH_UBUS_LOGSTREAM_STATE_INIT:
 
-	id = 0;
+				if (agh_ubus_connection_state != AGH_UBUS_STATE_CONNECTED)
+					return;
 
-	switch(lctx->logstream_state) {
-		case AGH_UBUS_LOGSTREAM_STATE_INIT:
+				if (lctx->current_req) {
+					if (!lctx->req_completed)
+						return;
 
-			if (agh_ubus_connection_state != AGH_UBUS_STATE_CONNECTED) {
-				if (lctx->b) {
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
+					/* logd answered, but we got no file descriptor */
+					agh_ubus_logstream_request_free(lctx);
+					agh_ubus_logstream_schedule_retry(lctx);
+					return;
 				}
 
-				if (lctx->current_req) {
-					g_free(lctx->current_req);
-					lctx->current_req = NULL;
+				switch(agh_ubus_logstream_request(uctx)) {
+					case 0:
+						break;
+					case 2:
+						agh_ubus_logstream_schedule_retry(lctx);
+						break;
+					default:
+						agh_log_ubus_logstream_crit("failure while asking logd for a file descriptor, log streaming stopped");
+						break;
 				}
 
-				break;
-			}
+				return;
+			case AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT:
 
-			if (!lctx->current_req) {
-				agh_log_ubus_logstream_dbg("asking for FD");
+				/* libubus is still using our request */
+				if (lctx->current_req && !lctx->req_completed)
+					return;
 
-				lctx->b = g_try_malloc0(sizeof(struct blob_buf));
-				if (!lctx->b) {
-					agh_log_ubus_logstream_dbg("failed to allocate struct blob_buf");
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
-				}
+				agh_ubus_logstream_request_free(lctx);
 
-				if (blob_buf_init(lctx->b, 0)) {
-					agh_log_ubus_logstream_dbg("blob buf init failed");
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
+				/*
+				 * If the file descriptor is plain invalid, you may not face major issues, except for some rightly emitted GLib warnings. :)
+				 * Still, I don't know what could happen if you get a wrong FD.
+				*/
+				if (lctx->fd<0) {
+					agh_log_ubus_logstream_crit("bad FD?");
+					lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_INIT;
+					agh_ubus_logstream_schedule_retry(lctx);
+					return;
 				}
 
-				if (blobmsg_add_u8(lctx->b, "stream", 1)) {
-					agh_log_ubus_logstream_dbg("failure while adding stream attribute");
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
+				agh_log_ubus_logstream_dbg("FD = %" G_GINT16_FORMAT"",lctx->fd);
+				if (agh_ubus_logstream_channel_init(lctx, uctx->gmctx)) {
+					agh_log_ubus_logstream_crit("failure while invoking agh_ubus_logstream_channel_init");
+					lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_RECONNECT;
+					agh_ubus_logstream_schedule_retry(lctx);
+					return;
 				}
 
-				if (blobmsg_add_u8(lctx->b, "oneshot", 0)) {
-					agh_log_ubus_logstream_dbg("failure while adding oneshot attribute");
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
+				lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_CONNECTED;
+				return;
+			case AGH_UBUS_LOGSTREAM_STATE_CONNECTED:
+				return;
+			case AGH_UBUS_LOGSTREAM_STATE_RECONNECT:
+				agh_ubus_logstream_channel_deinit(lctx);
+
+				/* we may have got a file descriptor, without being able to build a channel on it */
+				if (lctx->fd >= 0) {
+					close(lctx->fd);
+					lctx->fd = -1;
 				}
 
-				if (blobmsg_add_u32(lctx->b, "lines", 0)) {
-					agh_log_ubus_logstream_dbg("failure while addint lines attribute");
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
-				}
+				lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_INIT;
+				break;
+			default:
+				agh_log_ubus_logstream_crit("unknown state");
+				return;
+		}
+	}
 
-				if (ubus_lookup_id(uctx->ctx, "log", &id)) {
-					agh_log_ubus_logstream_dbg("no log object in ubus");
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					break;  /* this is considered more like a temporary failure */
-				}
+	return;
+}
 
-				lctx->current_req = g_try_malloc0(sizeof(struct ubus_request));
-				if (!lctx->current_req) {
-					blob_buf_free(lctx->b);
-					g_free(lctx->b);
-					lctx->b = NULL;
-					lctx->logstream_reconnect = NULL;
-					return FALSE;
-				}
+static gboolean agh_ubus_logstream_statemachine(gpointer data) {
+	struct agh_ubus_ctx *uctx = data;
 
-				ubus_invoke_async(uctx->ctx, id, "read", lctx->b->head, lctx->current_req);
-				lctx->current_req->fd_cb = agh_ubus_logstream_fd_cb;
-				lctx->current_req->priv = lctx;
+	uctx->logstream_ctx->logstream_reconnect = NULL;
+	uctx->logstream_ctx->logstream_reconnect_tag = 0;
 
-				ubus_complete_request_async(uctx->ctx, lctx->current_req);
-			}
+	agh_ubus_logstream_step(uctx);
 
-			break;
-		case AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT:
-			blob_buf_free(lctx->b);
-			g_free(lctx->b);
-			lctx->b = NULL;
-			g_free(lctx->current_req);
-			lctx->current_req = NULL;
-
-			/*
-			 * If the file descriptor is plain invalid, you may not face major issues, except for some rightly emitted GLib warnings. :)
-			 * Still, I don't know what could happen if you get a wrong FD.
-			*/
-			if (lctx->fd<0) {
-				agh_log_ubus_logstream_crit("bad FD?");
-				lctx->logstream_reconnect = NULL;
-				return FALSE;
-			}
-			agh_log_ubus_logstream_dbg("FD = %" G_GINT16_FORMAT"",lctx->fd);
-			if (!agh_ubus_logstream_channel_init(lctx, uctx->gmctx))
-				lctx->logstream_state++;
-			else {
-				agh_log_ubus_logstream_crit("failure while invoking agh_ubus_logstream_channel_init");
-				lctx->logstream_reconnect = NULL;
-				return FALSE;
-			}
+	return FALSE;
+}
 
-			break;
-		case AGH_UBUS_LOGSTREAM_STATE_CONNECTED:
-			break;
-		case AGH_UBUS_LOGSTREAM_STATE_RECONNECT:
-			agh_ubus_logstream_channel_deinit(lctx);
-			lctx->logstream_state = AGH_UBUS_LOGSTREAM_STATE_INIT;
-			break;
-		default:
-			agh_log_ubus_logstream_crit("unknown state");
-			lctx->logstream_reconnect = NULL;
-			return FALSE;
+/*
+ * Schedules a run of the state machine after delay milliseconds, unless one is already scheduled.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_schedule(struct agh_ubus_logstream_ctx *lctx, guint delay) {
+
+	if (lctx->logstream_reconnect)
+		return;
+
+	lctx->logstream_reconnect = g_timeout_source_new(delay);
+	g_source_set_callback(lctx->logstream_reconnect, agh_ubus_logstream_statemachine, lctx->uctx, NULL);
+	lctx->logstream_reconnect_tag = g_source_attach(lctx->logstream_reconnect, lctx->gmctx);
+	g_source_unref(lctx->logstream_reconnect);
+	if (!lctx->logstream_reconnect_tag) {
+		agh_log_ubus_logstream_crit("failed to attach logstream timeout source to GMainContext");
+		lctx->logstream_reconnect = NULL;
 	}
 
-	return TRUE;
+	return;
+}
+
+/*
+ * Schedules a run of the state machine after a failure: the first retry is immediate, then the delay doubles every time, from
+ * AGH_UBUS_LOGSTREAM_RETRY_MIN_INTERVAL up to AGH_UBUS_LOGSTREAM_RETRY_MAX_INTERVAL. It is reset once logd sends us something.
+ *
+ * Returns: <nothing>.
+*/
+static void agh_ubus_logstream_schedule_retry(struct agh_ubus_logstream_ctx *lctx) {
+
+	agh_ubus_logstream_schedule(lctx, lctx->retry_delay);
+
+	if (!lctx->retry_delay)
+		lctx->retry_delay = AGH_UBUS_LOGSTREAM_RETRY_MIN_INTERVAL;
+	else
+		lctx->retry_delay = MIN(lctx->retry_delay * 2, AGH_UBUS_LOGSTREAM_RETRY_MAX_INTERVAL);
+
+	return;
+}
+
+/*
+ * Invoked once an ubus connection has been (re-)established: if log streaming was interrupted, it is restarted right away.
+ * Note: a log channel we already got keeps working while ubus is away, so it is left untouched.
+ *
+ * Returns: nothing.
+*/
+void agh_ubus_logstream_restart(struct agh_ubus_ctx *uctx) {
+	struct agh_ubus_logstream_ctx *lctx;
+
+	if (!uctx || !uctx->logstream_ctx)
+		return;
+
+	lctx = uctx->logstream_ctx;
+
+	if (lctx->logstream_state == AGH_UBUS_LOGSTREAM_STATE_CONNECTED)
+		return;
+
+	/* A request made on a previous connection is not going to be answered; a file descriptor we got from it is still fine. */
+	if (lctx->current_req && !lctx->req_completed) {
+		ubus_abort_request(uctx->ctx, lctx->current_req);
+		agh_ubus_logstream_request_free(lctx);
+	}
+
+	agh_log_ubus_logstream_dbg("restarting log streaming");
+
+	if (lctx->logstream_reconnect) {
+		g_source_destroy(lctx->logstream_reconnect);
+		lctx->logstream_reconnect = NULL;
+		lctx->logstream_reconnect_tag = 0;
+	}
+
+	lctx->retry_delay = 0;
+	agh_ubus_logstream_step(uctx);
+
+	return;
 }
 
 /*
@@ -466,15 +982,14 @@ gint agh_ubus_logstream_init(struct agh_ubus_ctx *uctx) {
 	}
 
 	lctx = uctx->logstream_ctx;
-
-	lctx->logstream_reconnect = g_timeout_source_new(AGH_UBUS_LOGSTREAM_CHECK_INTERVAL);
-	g_source_set_callback(lctx->logstream_reconnect, agh_ubus_logstream_statemachine, uctx, NULL);
-	lctx->logstream_reconnect_tag = g_source_attach(lctx->logstream_reconnect, uctx->gmctx);
-	g_source_unref(lctx->logstream_reconnect);
+	lctx->uctx = uctx;
+	lctx->gmctx = uctx->gmctx;
 	lctx->fd = -1;
-	if (!lctx->logstream_reconnect_tag) {
-		agh_log_ubus_logstream_crit("failed to attach logstream timeout source to GMainContext");
-		lctx->logstream_reconnect = NULL;
+	agh_ubus_logstream_batch_init(&lctx->batch);
+
+	/* The first run happens as soon as possible. */
+	agh_ubus_logstream_schedule(lctx, 0);
+	if (!lctx->logstream_reconnect) {
 		retval = 4;
 		goto wayout;
 	}
@@ -511,21 +1026,296 @@ gint agh_ubus_logstream_deinit(struct agh_ubus_ctx *uctx) {
 		lctx->logstream_reconnect_tag = 0;
 	}
 
-	if (lctx->current_req) {
-		g_free(lctx->current_req);
-		lctx->current_req = NULL;
+	/* libubus should not know about our request anymore. */
+	if (lctx->current_req && !lctx->req_completed && uctx->ctx && (agh_ubus_connection_state == AGH_UBUS_STATE_CONNECTED))
+		ubus_abort_request(uctx->ctx, lctx->current_req);
+
+	agh_ubus_logstream_request_free(lctx);
+
+	agh_ubus_logstream_channel_deinit(lctx);
+
+	if (lctx->fd >= 0) {
+		close(lctx->fd);
+		lctx->fd = -1;
 	}
 
-	if (lctx->b) {
-		blob_buf_free(lctx->b);
-		g_free(lctx->b);
-		lctx->b = NULL;
+	/* Pending lines and notices are reported, when possible. */
+	if (lctx->notice_src) {
+		g_source_destroy(lctx->notice_src);
+		lctx->notice_src = NULL;
+		lctx->notice_tag = 0;
 	}
 
-	agh_ubus_logstream_channel_deinit(lctx);
+	agh_ubus_logstream_notice(lctx);
+	agh_ubus_logstream_batch_flush(lctx);
+
+	g_free(lctx->last_msg);
+	lctx->last_msg = NULL;
+
+	if (lctx->buckets) {
+		g_hash_table_destroy(lctx->buckets);
+		lctx->buckets = NULL;
+	}
+
+	g_free(lctx->rbuf);
+	lctx->rbuf = NULL;
+
+	agh_ubus_logstream_filter_free(lctx->filter);
+	lctx->filter = NULL;
 
 	g_free(uctx->logstream_ctx);
 	uctx->logstream_ctx = NULL;
 
 	return 0;
 }
+
+/*
+ * Allocates an empty logstream filter, letting every message through.
+ *
+ * Returns: the new filter, or NULL on memory allocation failure.
+*/
+struct agh_ubus_logstream_filter *agh_ubus_logstream_filter_new(void) {
+	struct agh_ubus_logstream_filter *filter;
+
+	filter = g_try_malloc0(sizeof(*filter));
+	if (!filter) {
+		agh_log_ubus_logstream_crit("can not allocate filter");
+		return filter;
+	}
+
+	filter->max_priority = -1;
+
+	return filter;
+}
+
+void agh_ubus_logstream_filter_free(struct agh_ubus_logstream_filter *filter) {
+
+	if (!filter)
+		return;
+
+	g_free(filter->match);
+
+	if (filter->regex)
+		g_regex_unref(filter->regex);
+
+	g_free(filter);
+
+	return;
+}
+
+/*
+ * Adds a condition to a logstream filter. Conditions look like "name=value"; see the AGH_UBUS_LOGSTREAM_FILTER_* defines.
+ * Facilities are given as a comma separated list; a priority includes all the more severe ones. Regular expressions are compiled
+ * here, once.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: malformed condition, or unknown condition name
+ *  - 2: unknown priority, facility or source
+ *  - 3: invalid regular expression
+*/
+gint agh_ubus_logstream_filter_add(struct agh_ubus_logstream_filter *filter, const gchar *spec) {
+	gchar **parts;
+	gchar **facilities;
+	GError *gerr;
+	gint value;
+	guint i;
+	gint retval;
+
+	parts = NULL;
+	facilities = NULL;
+	gerr = NULL;
+	retval = 0;
+
+	if (!filter || !spec) {
+		retval = 1;
+		goto out;
+	}
+
+	parts = g_strsplit(spec, AGH_UBUS_LOGSTREAM_FILTER_SEPARATOR, 2);
+	if (!parts[0] || !parts[1] || !*parts[1]) {
+		retval = 1;
+		goto out;
+	}
+
+	if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_FILTER_PRIORITY)) {
+		value = agh_ubus_logstream_getcodevalue(parts[1], FALSE);
+		if (value < 0) {
+			retval = 2;
+			goto out;
+		}
+
+		filter->max_priority = value;
+	}
+	else if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_FILTER_FACILITY)) {
+		facilities = g_strsplit(parts[1], AGH_UBUS_LOGSTREAM_FILTER_LIST_SEPARATOR, 0);
+		filter->facilities = 0;
+
+		for (i = 0; facilities[i]; i++) {
+			value = agh_ubus_logstream_getcodevalue(facilities[i], TRUE);
+			if ((value < 0) || (value >= 32)) {
+				retval = 2;
+				goto out;
+			}
+
+			filter->facilities |= 1U << value;
+		}
+	}
+	else if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_FILTER_SOURCE)) {
+		if (!g_strcmp0(parts[1], AGH_UBUS_LOGSTREAM_FILTER_SOURCE_KERNEL))
+			filter->source = 1;
+		else if (!g_strcmp0(parts[1], AGH_UBUS_LOGSTREAM_FILTER_SOURCE_USER))
+			filter->source = 2;
+		else
+			retval = 2;
+	}
+	else if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_FILTER_MATCH)) {
+		g_free(filter->match);
+		filter->match = g_strdup(parts[1]);
+	}
+	else if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_FILTER_REGEX)) {
+		if (filter->regex) {
+			g_regex_unref(filter->regex);
+			filter->regex = NULL;
+		}
+
+		filter->regex = g_regex_new(parts[1], G_REGEX_OPTIMIZE, 0, &gerr);
+		if (!filter->regex) {
+			agh_log_ubus_logstream_crit("invalid regular expression: %s", gerr ? gerr->message : "unknown error");
+			g_clear_error(&gerr);
+			retval = 3;
+		}
+	}
+	else
+		retval = 1;
+
+out:
+	g_strfreev(facilities);
+	g_strfreev(parts);
+	return retval;
+}
+
+/*
+ * Replaces the logstream filter; a NULL filter lets every message through. The filter is owned by logstream from now on, and
+ * freed when not needed anymore, even on failure.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 4: no agh ubus context was present
+ *  - 5: no logstream context
+*/
+gint agh_ubus_logstream_set_filter(struct agh_ubus_ctx *uctx, struct agh_ubus_logstream_filter *filter) {
+	struct agh_ubus_logstream_ctx *lctx;
+
+	if (!uctx) {
+		agh_ubus_logstream_filter_free(filter);
+		return 4;
+	}
+
+	if (!uctx->logstream_ctx) {
+		agh_ubus_logstream_filter_free(filter);
+		return 5;
+	}
+
+	lctx = uctx->logstream_ctx;
+
+	agh_ubus_logstream_filter_free(lctx->filter);
+	lctx->filter = filter;
+	lctx->filtered = 0;
+
+	return 0;
+}
+
+void agh_ubus_logstream_batch_init(struct agh_ubus_logstream_batch *batch) {
+	batch->lines = AGH_UBUS_LOGSTREAM_DEFAULT_BATCH_LINES;
+	batch->interval = AGH_UBUS_LOGSTREAM_DEFAULT_BATCH_INTERVAL;
+	batch->flush_priority = -1;
+	return;
+}
+
+/*
+ * Applies a batching option, given as "name=value" (see the AGH_UBUS_LOGSTREAM_BATCH_* defines), to batching settings.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - -1: this is not a batching option (it may be a filter condition)
+ *  - 2: invalid value
+*/
+gint agh_ubus_logstream_batch_option(struct agh_ubus_logstream_batch *batch, const gchar *spec) {
+	gchar **parts;
+	gchar *endptr;
+	guint64 value;
+	gint priority;
+	gint retval;
+
+	retval = 0;
+
+	if (!batch || !spec)
+		return -1;
+
+	parts = g_strsplit(spec, AGH_UBUS_LOGSTREAM_FILTER_SEPARATOR, 2);
+	if (!parts[0] || !parts[1]) {
+		retval = -1;
+		goto out;
+	}
+
+	if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_BATCH_FLUSH)) {
+		priority = agh_ubus_logstream_getcodevalue(parts[1], FALSE);
+		if (priority < 0)
+			retval = 2;
+		else
+			batch->flush_priority = priority;
+
+		goto out;
+	}
+
+	if (g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_BATCH_LINES) && g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_BATCH_INTERVAL)) {
+		retval = -1;
+		goto out;
+	}
+
+	endptr = NULL;
+	value = g_ascii_strtoull(parts[1], &endptr, 10);
+	if (!*parts[1] || *endptr || !value) {
+		retval = 2;
+		goto out;
+	}
+
+	if (!g_strcmp0(parts[0], AGH_UBUS_LOGSTREAM_BATCH_LINES)) {
+		if (value > AGH_UBUS_LOGSTREAM_MAX_BATCH_LINES)
+			retval = 2;
+		else
+			batch->lines = value;
+	}
+	else {
+		if (value > AGH_UBUS_LOGSTREAM_MAX_BATCH_INTERVAL)
+			retval = 2;
+		else
+			batch->interval = value;
+	}
+
+out:
+	g_strfreev(parts);
+	return retval;
+}
+
+/*
+ * Replaces logstream batching settings. Lines collected so far are reported first.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 4: no agh ubus context was present
+ *  - 5: no logstream context
+*/
+gint agh_ubus_logstream_set_batch(struct agh_ubus_ctx *uctx, const struct agh_ubus_logstream_batch *batch) {
+	struct agh_ubus_logstream_ctx *lctx;
+
+	if (!uctx || !batch)
+		return 4;
+
+	if (!uctx->logstream_ctx)
+		return 5;
+
+	lctx = uctx->logstream_ctx;
+
+	agh_ubus_logstream_batch_flush(lctx);
+	lctx->batch = *batch;
+
+	return 0;
+}
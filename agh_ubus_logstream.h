@@ -5,11 +5,94 @@
 #include "agh_ubus.h"
 #include <glib.h>
 
-#define AGH_UBUS_LOGSTREAM_CHECK_INTERVAL 400
+/* Retry delays after a failure, in milliseconds; the first retry is immediate. */
+#define AGH_UBUS_LOGSTREAM_RETRY_MIN_INTERVAL 100
+#define AGH_UBUS_LOGSTREAM_RETRY_MAX_INTERVAL 10000
+
+/* logstream states: */
+#define AGH_UBUS_LOGSTREAM_STATE_INIT 0
+#define AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT 1
+#define AGH_UBUS_LOGSTREAM_STATE_CONNECTED 2
+#define AGH_UBUS_LOGSTREAM_STATE_RECONNECT 3
+
+/*
+ * Log channel read buffer size, in bytes: every read fills it as much as possible, and all complete messages it contains are
+ * processed in place. It grows if a single message does not fit, up to the maximum message size.
+*/
+#define AGH_UBUS_LOGSTREAM_READ_BUFFER_SIZE 16384
+#define AGH_UBUS_LOGSTREAM_MAX_MESSAGE_SIZE 262144
+
+/*
+ * logstream filters, given as arguments when enabling logstream, i.e. "priority=warning". A message is reported only when it
+ * matches all of them.
+*/
+#define AGH_UBUS_LOGSTREAM_FILTER_SEPARATOR "="
+#define AGH_UBUS_LOGSTREAM_FILTER_LIST_SEPARATOR ","
+#define AGH_UBUS_LOGSTREAM_FILTER_PRIORITY "priority"
+#define AGH_UBUS_LOGSTREAM_FILTER_FACILITY "facility"
+#define AGH_UBUS_LOGSTREAM_FILTER_SOURCE "source"
+#define AGH_UBUS_LOGSTREAM_FILTER_MATCH "match"
+#define AGH_UBUS_LOGSTREAM_FILTER_REGEX "regex"
+#define AGH_UBUS_LOGSTREAM_FILTER_SOURCE_KERNEL "kernel"
+#define AGH_UBUS_LOGSTREAM_FILTER_SOURCE_USER "user"
+
+/*
+ * Log messages batching, set up like filters: a batch is reported when it reaches "lines" messages, "interval" milliseconds
+ * after its first message, or as soon as a message with the "flush" priority (or a more severe one) gets in.
+*/
+#define AGH_UBUS_LOGSTREAM_BATCH_LINES "lines"
+#define AGH_UBUS_LOGSTREAM_BATCH_INTERVAL "interval"
+#define AGH_UBUS_LOGSTREAM_BATCH_FLUSH "flush"
+#define AGH_UBUS_LOGSTREAM_DEFAULT_BATCH_LINES 1
+#define AGH_UBUS_LOGSTREAM_DEFAULT_BATCH_INTERVAL 1000
+#define AGH_UBUS_LOGSTREAM_MAX_BATCH_LINES 200
+#define AGH_UBUS_LOGSTREAM_MAX_BATCH_INTERVAL 60000
+
+/*
+ * Log storm suppression. Identical consecutive messages are folded, and reported as a single "last message repeated N times"
+ * one. Every source (the program name a message starts with, or "kernel") has a token bucket: the bucket is refilled at RATE
+ * messages per second, holding up to BURST of them, and messages coming in when it is empty are suppressed. Folded and
+ * suppressed messages are summarized by a notice, at most every NOTICE_INTERVAL milliseconds.
+*/
+#define AGH_UBUS_LOGSTREAM_BUCKET_RATE 10
+#define AGH_UBUS_LOGSTREAM_BUCKET_BURST 50
+#define AGH_UBUS_LOGSTREAM_MAX_SOURCES 64
+#define AGH_UBUS_LOGSTREAM_MAX_SOURCE_LEN 32
+#define AGH_UBUS_LOGSTREAM_OTHER_SOURCE "other"
+#define AGH_UBUS_LOGSTREAM_KERNEL_SOURCE "kernel"
+#define AGH_UBUS_LOGSTREAM_NOTICE_INTERVAL 10000
 
 /* logstream log messages event name */
 #define AGH_UBUS_LOGSTREAM_LOG_EVENTs_NAME "SYSTEM_LOG_MESSAGE"
 
+struct agh_ubus_logstream_filter {
+	/* the least severe priority to be reported, or -1 */
+	gint max_priority;
+
+	/* facilities to be reported, as a bitmask of LOG_FAC values; 0 means any */
+	guint32 facilities;
+
+	/* 0: any source, 1: kernel only, 2: userspace only */
+	guint source;
+
+	gchar *match;
+	GRegex *regex;
+};
+
+struct agh_ubus_logstream_batch {
+	guint lines;
+	guint interval;
+
+	/* -1 when no priority triggers a flush */
+	gint flush_priority;
+};
+
+struct agh_ubus_logstream_bucket {
+	gdouble tokens;
+	gint64 last_refill;
+	guint64 suppressed;
+};
+
 struct agh_ubus_logstream_ctx {
 	guint logstream_channel_tag;
 	GIOChannel *logstream_channel;
@@ -17,15 +100,53 @@ struct agh_ubus_logstream_ctx {
 	guint logstream_reconnect_tag;
 	guint logstream_state;
 	struct ubus_request *current_req;
+	gboolean req_completed;
+	guint retry_delay;
 	gint fd;
 	struct blob_buf *b;
 	GError *gerr;
 	guint logwatcher_id;
 	GSource *logwatcher;
-	GString *cmsg;
+	struct agh_ubus_ctx *uctx;
+	GMainContext *gmctx;
+
+	/* read buffer: rbuf_len bytes are held, the last of which may be a partial message */
+	guint8 *rbuf;
+	gsize rbuf_size;
+	gsize rbuf_len;
+
+	struct agh_ubus_logstream_filter *filter;
+	guint64 filtered;
+
+	/* batching settings, and the event being filled in */
+	struct agh_ubus_logstream_batch batch;
+	struct agh_cmd *batch_event;
+	guint batch_count;
+	GSource *batch_src;
+	guint batch_tag;
+
+	/* storm suppression: last message (for folding), per-source buckets, and counters */
+	gchar *last_msg;
+	guint32 last_priority;
+	guint32 last_source;
+	guint repeats;
+	GHashTable *buckets;
+	GSource *notice_src;
+	guint notice_tag;
+	guint64 folded;
+	guint64 suppressed;
 };
 
 gint agh_ubus_logstream_init(struct agh_ubus_ctx *uctx);
 gint agh_ubus_logstream_deinit(struct agh_ubus_ctx *uctx);
+void agh_ubus_logstream_restart(struct agh_ubus_ctx *uctx);
+
+struct agh_ubus_logstream_filter *agh_ubus_logstream_filter_new(void);
+void agh_ubus_logstream_filter_free(struct agh_ubus_logstream_filter *filter);
+gint agh_ubus_logstream_filter_add(struct agh_ubus_logstream_filter *filter, const gchar *spec);
+gint agh_ubus_logstream_set_filter(struct agh_ubus_ctx *uctx, struct agh_ubus_logstream_filter *filter);
+void agh_ubus_logstream_batch_init(struct agh_ubus_logstream_batch *batch);
+gint agh_ubus_logstream_batch_option(struct agh_ubus_logstream_batch *batch, const gchar *spec);
+gint agh_ubus_logstream_set_batch(struct agh_ubus_ctx *uctx, const struct agh_ubus_logstream_batch *batch);
 
 #endif
@@ -0,0 +1,262 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * The agh.status ubus object: lets local tools (e.g.: collectd or LuCI) poll AGH runtime state.
+ * Everything is answered from in-memory state: no D-Bus round trips are involved, so polling it often should be cheap.
+*/
+
+#include <libubox/blobmsg.h>
+#include "agh_ubus_status.h"
+#include "agh_ubus.h"
+#include "agh_ubus_logstream.h"
+#include "agh_xmpp.h"
+#include "agh_xmpp_spool.h"
+#include "agh_modem.h"
+#include "agh_mm_helpers.h"
+#include "agh_logging.h"
+
+/* Log messages from AGH_LOG_DOMAIN_UBUS_STATUS domain. */
+#define AGH_LOG_DOMAIN_UBUS_STATUS "UBUS_STATUS"
+
+/* Logging macros. */
+#define agh_log_ubus_status_dbg(message, ...) agh_log_dbg(AGH_LOG_DOMAIN_UBUS_STATUS, message, ##__VA_ARGS__)
+#define agh_log_ubus_status_crit(message, ...) agh_log_crit(AGH_LOG_DOMAIN_UBUS_STATUS, message, ##__VA_ARGS__)
+
+static struct agh_state *agh_ubus_status_mstate;
+static struct blob_buf agh_ubus_status_b;
+
+static const gchar *agh_ubus_status_connection_state_string(gint state) {
+
+	switch(state) {
+		case AGH_UBUS_STATE_INIT:
+			return "init";
+		case AGH_UBUS_STATE_CONNECTED:
+			return "connected";
+		case AGH_UBUS_STATE_RECONNECTING:
+			return "reconnecting";
+		case AGH_UBUS_STATE_STOP:
+			return "stop";
+	}
+
+	return "unknown";
+}
+
+static const gchar *agh_ubus_status_logstream_state_string(struct agh_ubus_ctx *uctx) {
+
+	if (!uctx->logstream_ctx)
+		return "disabled";
+
+	switch(uctx->logstream_ctx->logstream_state) {
+		case AGH_UBUS_LOGSTREAM_STATE_INIT:
+			return "init";
+		case AGH_UBUS_LOGSTREAM_STATE_CHANNEL_INIT:
+			return "channel_init";
+		case AGH_UBUS_LOGSTREAM_STATE_CONNECTED:
+			return "connected";
+		case AGH_UBUS_LOGSTREAM_STATE_RECONNECT:
+			return "reconnect";
+	}
+
+	return "unknown";
+}
+
+static void agh_ubus_status_add_xmpp(struct blob_buf *b, struct xmpp_state *xstate) {
+	void *t;
+
+	t = blobmsg_open_table(b, "xmpp");
+
+	blobmsg_add_u8(b, "configured", xstate != NULL);
+
+	if (xstate) {
+		blobmsg_add_u8(b, "connected", xstate->connected);
+		blobmsg_add_u32(b, "outgoing_queue", xstate->outxmpp_messages ? g_queue_get_length(xstate->outxmpp_messages) : 0);
+		blobmsg_add_u32(b, "transfers", xstate->transfers ? g_queue_get_length(xstate->transfers) : 0);
+		blobmsg_add_u32(b, "backoff_failures", xstate->backoff_failures);
+		blobmsg_add_u8(b, "ping_degraded", xstate->ping_degraded);
+
+		if (xstate->spool) {
+			blobmsg_add_u32(b, "spool_replay_queue", xstate->spool->replay ? g_queue_get_length(xstate->spool->replay) : 0);
+			blobmsg_add_u32(b, "spool_batch_size", xstate->spool->batch ? xstate->spool->batch->len : 0);
+		}
+	}
+
+	blobmsg_close_table(b, t);
+
+	return;
+}
+
+static void agh_ubus_status_add_ubus(struct blob_buf *b, struct agh_ubus_ctx *uctx) {
+	void *t;
+
+	t = blobmsg_open_table(b, "ubus");
+
+	blobmsg_add_string(b, "state", agh_ubus_status_connection_state_string(agh_ubus_connection_state));
+	blobmsg_add_string(b, "logstream", agh_ubus_status_logstream_state_string(uctx));
+	blobmsg_add_u64(b, "id_cache_hits", uctx->id_cache_hits);
+	blobmsg_add_u64(b, "id_cache_misses", uctx->id_cache_misses);
+	blobmsg_add_u32(b, "id_cache_entries", uctx->id_cache ? g_hash_table_size(uctx->id_cache) : 0);
+	blobmsg_add_u32(b, "calls_in_progress", uctx->calls ? g_queue_get_length(uctx->calls) : 0);
+	blobmsg_add_u32(b, "event_masks", uctx->event_masks ? g_hash_table_size(uctx->event_masks) : 0);
+	blobmsg_add_u64(b, "reconnections", uctx->reconnections);
+	blobmsg_add_u64(b, "last_recovery_time_ms", uctx->last_recovery_time / 1000);
+
+	blobmsg_close_table(b, t);
+
+	return;
+}
+
+static void agh_ubus_status_add_bearers(struct blob_buf *b, struct agh_mm_state *mmstate, MMModem *modem) {
+	gchar **bearer_paths;
+	gchar **bpath;
+	struct agh_mm_bearer *sb;
+	void *a;
+	void *t;
+
+	a = blobmsg_open_array(b, "bearers");
+
+	/* Bearers list comes from the cached Bearers property. */
+	bearer_paths = mm_modem_dup_bearer_paths(modem);
+
+	for (bpath = bearer_paths; bpath && *bpath; bpath++) {
+		t = blobmsg_open_table(b, NULL);
+
+		blobmsg_add_string(b, "path", *bpath);
+
+		sb = mmstate->bearers ? g_hash_table_lookup(mmstate->bearers, *bpath) : NULL;
+		if (sb) {
+			blobmsg_add_u8(b, "connected", sb->connected);
+			blobmsg_add_u32(b, "connect_failures", sb->failures);
+		}
+
+		blobmsg_close_table(b, t);
+	}
+
+	g_strfreev(bearer_paths);
+
+	blobmsg_close_array(b, a);
+
+	return;
+}
+
+static void agh_ubus_status_add_bringup(struct blob_buf *b, struct agh_mm_modem *mm) {
+	gint i;
+	void *t;
+
+	t = blobmsg_open_table(b, "bringup_ms");
+
+	for (i = 0; i < AGH_MM_BRINGUP_STAGES; i++)
+		if (mm->bringup[i] >= 0)
+			blobmsg_add_u64(b, agh_mm_bringup_stage_name(i), mm->bringup[i]);
+
+	blobmsg_close_table(b, t);
+
+	return;
+}
+
+static void agh_ubus_status_add_modems(struct blob_buf *b, struct agh_mm_state *mmstate) {
+	GHashTableIter iter;
+	gpointer value;
+	struct agh_mm_modem *mm;
+	gchar *modem_index;
+	void *a;
+	void *t;
+	void *m;
+
+	t = blobmsg_open_table(b, "mm");
+
+	blobmsg_add_u8(b, "running", mmstate && mmstate->manager);
+
+	/* Modems come from the registry; their properties are cached by mm-glib. */
+	blobmsg_add_u32(b, "modem_count", (mmstate && mmstate->modems) ? g_hash_table_size(mmstate->modems) : 0);
+
+	a = blobmsg_open_array(b, "modems");
+
+	if (mmstate && mmstate->modems) {
+		g_hash_table_iter_init(&iter, mmstate->modems);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			mm = value;
+
+			m = blobmsg_open_table(b, NULL);
+
+			modem_index = agh_mm_modem_to_index(mm_modem_get_path(mm->modem));
+			blobmsg_add_string(b, "index", modem_index ? modem_index : "");
+			g_free(modem_index);
+
+			blobmsg_add_string(b, "state", mm_modem_state_get_string(mm_modem_get_state(mm->modem)));
+			blobmsg_add_u32(b, "pending_bearer_ops", mm->pending_bearer_ops);
+			agh_ubus_status_add_bringup(b, mm);
+			agh_ubus_status_add_bearers(b, mmstate, mm->modem);
+
+			blobmsg_close_table(b, m);
+		}
+	}
+
+	blobmsg_close_array(b, a);
+
+	blobmsg_close_table(b, t);
+
+	return;
+}
+
+/*
+ * Answers the get method, describing AGH runtime state.
+*/
+static int agh_ubus_status_get(struct ubus_context *ctx, struct ubus_object *obj, struct ubus_request_data *req, const char *method, struct blob_attr *msg) {
+	struct agh_state *mstate = agh_ubus_status_mstate;
+
+	if (!mstate || !mstate->uctx)
+		return UBUS_STATUS_NO_DATA;
+
+	blob_buf_init(&agh_ubus_status_b, 0);
+
+	agh_ubus_status_add_xmpp(&agh_ubus_status_b, mstate->xstate);
+	agh_ubus_status_add_ubus(&agh_ubus_status_b, mstate->uctx);
+	agh_ubus_status_add_modems(&agh_ubus_status_b, mstate->mmstate);
+
+	return ubus_send_reply(ctx, req, agh_ubus_status_b.head);
+}
+
+static const struct ubus_method agh_ubus_status_methods[] = {
+	UBUS_METHOD_NOARG(AGH_UBUS_STATUS_METHOD_GET, agh_ubus_status_get),
+};
+
+static struct ubus_object_type agh_ubus_status_object_type = UBUS_OBJECT_TYPE(AGH_UBUS_STATUS_OBJECT_NAME, agh_ubus_status_methods);
+
+static struct ubus_object agh_ubus_status_object = {
+	.name = AGH_UBUS_STATUS_OBJECT_NAME,
+	.type = &agh_ubus_status_object_type,
+	.methods = agh_ubus_status_methods,
+	.n_methods = ARRAY_SIZE(agh_ubus_status_methods),
+};
+
+/*
+ * Publishes the agh.status object; it will be added to ubus as soon as a connection is available.
+ *
+ * Returns: an integer with value 0 on success, -1 when no AGH state or ubus context are available, or a value coming from
+ * agh_ubus_object_add.
+*/
+gint agh_ubus_status_init(struct agh_state *mstate) {
+	gint retval;
+
+	if (!mstate || !mstate->uctx) {
+		agh_log_ubus_status_crit("no AGH state or ubus context");
+		return -1;
+	}
+
+	agh_ubus_status_mstate = mstate;
+
+	retval = agh_ubus_object_add(mstate->uctx, &agh_ubus_status_object);
+	if (retval)
+		agh_log_ubus_status_crit("failure while publishing %s (code=%" G_GINT16_FORMAT")", AGH_UBUS_STATUS_OBJECT_NAME, retval);
+
+	return retval;
+}
+
+/*
+ * To be invoked after agh_ubus_teardown: the object is not going to be invoked anymore.
+*/
+void agh_ubus_status_deinit(void) {
+	agh_ubus_status_mstate = NULL;
+	blob_buf_free(&agh_ubus_status_b);
+	return;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef __agh_ubus_status_h__
+#define __agh_ubus_status_h__
+#include "agh.h"
+
+/* Name of the object we publish on ubus, and of its only method. */
+#define AGH_UBUS_STATUS_OBJECT_NAME "agh.status"
+#define AGH_UBUS_STATUS_METHOD_GET "get"
+
+gint agh_ubus_status_init(struct agh_state *mstate);
+void agh_ubus_status_deinit(void);
+
+#endif
@@ -3,6 +3,7 @@
 #include <glib.h>
 #include <uci.h>
 #include <errno.h>
+#include <string.h>
 #include "agh_xmpp.h"
 #include "agh.h"
 #include "agh_logging.h"
@@ -11,6 +12,7 @@
 #include "agh_messages.h"
 #include "agh_xmpp_caps.h"
 #include "agh_commands.h"
+#include "agh_xmpp_spool.h"
 
 /* Log messages from AGH_LOG_DOMAIN_XMPP domain. */
 #define AGH_LOG_DOMAIN_XMPP	"XMPP"
@@ -74,6 +76,90 @@ static GQueue *agh_xmpp_getoption_list(struct xmpp_state *xstate, gchar *name) {
 	return res;
 }
 
+/*
+ * Sends a stanza, accounting for it when Stream Management is in use. Stream Management elements themselves should not be sent via this function.
+*/
+static void agh_xmpp_send_stanza(struct xmpp_state *xstate, xmpp_stanza_t *stanza) {
+
+	xmpp_send(xstate->xmpp_conn, stanza);
+
+	if (xstate->sm_state != AGH_XMPP_SM_STATE_INACTIVE)
+		xstate->sm_outbound++;
+
+	return;
+}
+
+/*
+ * Like agh_xmpp_send_stanza, but for stanzas we already have in serialized form.
+*/
+static void agh_xmpp_send_raw_stanza(struct xmpp_state *xstate, const gchar *text) {
+
+	xmpp_send_raw(xstate->xmpp_conn, text, strlen(text));
+
+	if (xstate->sm_state != AGH_XMPP_SM_STATE_INACTIVE)
+		xstate->sm_outbound++;
+
+	return;
+}
+
+static void agh_xmpp_sm_item_free(gpointer data) {
+	struct agh_xmpp_sm_item *item = data;
+
+	if (!item)
+		return;
+
+	g_free(item->to);
+	g_free(item->text);
+	g_free(item);
+
+	return;
+}
+
+/*
+ * Keeps a copy of a just sent message, until the server acknowledges it.
+*/
+static void agh_xmpp_sm_track(struct xmpp_state *xstate, const gchar *to, const gchar *text) {
+	struct agh_xmpp_sm_item *item;
+
+	if (xstate->sm_state == AGH_XMPP_SM_STATE_INACTIVE || !xstate->sm_unacked)
+		return;
+
+	item = g_try_malloc0(sizeof(*item));
+	if (!item) {
+		agh_log_xmpp_crit("can not allocate SM item, message will not be retransmitted if lost");
+		return;
+	}
+
+	item->seq = xstate->sm_outbound;
+	item->to = g_strdup(to);
+	item->text = g_strdup(text);
+
+	g_queue_push_tail(xstate->sm_unacked, item);
+
+	if (g_queue_get_length(xstate->sm_unacked) > AGH_XMPP_SM_MAX_UNACKED_MESSAGES) {
+		agh_log_xmpp_crit("too many unacknowledged messages, dropping the oldest one");
+		agh_xmpp_sm_item_free(g_queue_pop_head(xstate->sm_unacked));
+	}
+
+	return;
+}
+
+/*
+ * Drops messages acknowledged by the server. Sequence numbers wrap around at 2^32, as per XEP-0198.
+*/
+static void agh_xmpp_sm_ack(struct xmpp_state *xstate, guint32 h) {
+	struct agh_xmpp_sm_item *item;
+
+	while ( (item = g_queue_peek_head(xstate->sm_unacked)) ) {
+		if ((gint32)(h - item->seq) < 0)
+			break;
+
+		agh_xmpp_sm_item_free(g_queue_pop_head(xstate->sm_unacked));
+	}
+
+	return;
+}
+
 /* this function is a libstrophe handler */
 static int version_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
 	xmpp_stanza_t *reply, *query, *name, *version, *text;
@@ -159,7 +245,7 @@ static int version_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanz
 
 	xmpp_stanza_add_child(reply, query);
 	xmpp_stanza_release(query);
-	xmpp_send(conn, reply);
+	agh_xmpp_send_stanza(xstate, reply);
 	xmpp_stanza_release(reply);
 
 out:
@@ -288,24 +374,87 @@ out_badxstate:
 	return retval;
 }
 
+/*
+ * (Re)builds our capabilities entity, its verification hash, and the serialized disco#info query content. This is done at startup,
+ * and should be done again only when features change: results are reused on every connection and disco#info query.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 62: no XMPP state
+ *  - 63: failure while computing verification hash
+ *  - 64: failure while building disco#info data
+ *  - agh_xmpp_prepare_entity return values on failure
+*/
+static gint agh_xmpp_caps_refresh(struct xmpp_state *xstate) {
+	gint retval;
+
+	retval = 0;
+
+	if (!xstate) {
+		agh_log_xmpp_crit("no XMPP state");
+		retval = 62;
+		goto out;
+	}
+
+	if (xstate->e) {
+		agh_xmpp_caps_entity_dealloc(xstate->e);
+		xstate->e = NULL;
+	}
+
+	g_free(xstate->caps_ver);
+	xstate->caps_ver = NULL;
+	g_free(xstate->caps_query);
+	xstate->caps_query = NULL;
+
+	retval = agh_xmpp_prepare_entity(xstate);
+	if (retval)
+		goto out;
+
+	xstate->caps_ver = agh_xmpp_caps_get_hash(xstate->e);
+	if (!xstate->caps_ver) {
+		agh_log_xmpp_crit("unable to compute capabilities hash");
+		retval = 63;
+		goto out;
+	}
+
+	xstate->caps_query = agh_xmpp_caps_build_query_children(xstate->e);
+	if (!xstate->caps_query) {
+		agh_log_xmpp_crit("unable to build disco#info data");
+		retval = 64;
+		goto out;
+	}
+
+out:
+	return retval;
+}
+
 /* libstrophe handler */
 static int discoinfo_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
 	struct agh_state *mstate = userdata;
 	struct xmpp_state *xstate = mstate->xstate;
-	xmpp_ctx_t *ctx = xstate->xmpp_ctx;
 
 	const gchar *from;
+	const gchar *id;
+	const gchar *bound_jid;
 	const gchar *srcnode;
 	xmpp_stanza_t *incoming_query;
-	xmpp_stanza_t *response;
-	xmpp_stanza_t *capsdata;
-	gint retv;
+	gchar *from_escaped;
+	gchar *id_escaped;
+	gchar *bound_jid_escaped;
+	gchar *srcnode_escaped;
+	gchar *response;
+
+	srcnode_escaped = NULL;
 
 	if (xstate->xmpp_idle_state != 1) {
 		agh_log_xmpp_crit("exiting due to xstate->xmpp_idle_state != 1");
 		return 1;
 	}
 
+	if (!xstate->caps_query) {
+		agh_log_xmpp_crit("no disco#info data to answer with");
+		return 1;
+	}
+
 	incoming_query = xmpp_stanza_get_child_by_name(stanza, AGH_XMPP_STANZA_NAME_QUERY);
 	if (!incoming_query) {
 		agh_log_xmpp_crit(AGH_XMPP_STANZA_NAME_QUERY" child stanza not found");
@@ -319,40 +468,36 @@ static int discoinfo_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const sta
 		return 1;
 	}
 
-	response = xmpp_iq_new(ctx, AGH_XMPP_STANZA_TYPE_RESULT, xmpp_stanza_get_id(stanza));
-	if (!response) {
-		agh_log_xmpp_crit("failure while allocating an "AGH_XMPP_STANZA_TYPE_RESULT" stanza");
+	id = xmpp_stanza_get_id(stanza);
+	bound_jid = xmpp_conn_get_bound_jid(conn);
+
+	if (!id || !bound_jid) {
+		agh_log_xmpp_crit("missing stanza id or bound JID");
 		return 1;
 	}
 
-	xmpp_stanza_set_to(response, from);
-
 	srcnode = xmpp_stanza_get_attribute(incoming_query, AGH_XMPP_STANZA_ATTR_NODE);
 
-	retv = agh_xmpp_prepare_entity(xstate);
-	if (retv) {
-		xmpp_stanza_release(response);
-		return 1;
-	}
-
-	capsdata = agh_xmpp_caps_get_capsdata(xstate);
-	agh_xmpp_caps_entity_dealloc(xstate->e);
-	xstate->e = NULL;
-	if (!capsdata) {
-		xmpp_stanza_release(response);
-		return 1;
-	}
+	/* Our disco#info data is already serialized: only request-dependent parts need escaping. */
+	from_escaped = g_markup_escape_text(from, -1);
+	id_escaped = g_markup_escape_text(id, -1);
+	bound_jid_escaped = g_markup_escape_text(bound_jid, -1);
 
 	if (srcnode)
-		xmpp_stanza_set_attribute(capsdata, AGH_XMPP_STANZA_ATTR_NODE, srcnode);
+		srcnode_escaped = g_markup_escape_text(srcnode, -1);
 
-	xmpp_stanza_add_child(response, capsdata);
-	xmpp_stanza_release(capsdata);
+	response = g_strdup_printf("<iq type='"AGH_XMPP_STANZA_TYPE_RESULT"' id='%s' to='%s' from='%s'><"AGH_XMPP_STANZA_NAME_QUERY" xmlns='"XMPP_NS_DISCO_INFO"'%s%s%s>%s</"AGH_XMPP_STANZA_NAME_QUERY"></iq>",
+		id_escaped, from_escaped, bound_jid_escaped,
+		srcnode_escaped ? " "AGH_XMPP_STANZA_ATTR_NODE"='" : "", srcnode_escaped ? srcnode_escaped : "", srcnode_escaped ? "'" : "",
+		xstate->caps_query);
 
-	xmpp_stanza_set_from(response, xmpp_conn_get_bound_jid(conn));
+	agh_xmpp_send_raw_stanza(xstate, response);
 
-	xmpp_send(conn, response);
-	xmpp_stanza_release(response);
+	g_free(response);
+	g_free(srcnode_escaped);
+	g_free(bound_jid_escaped);
+	g_free(id_escaped);
+	g_free(from_escaped);
 
 	return 1;
 }
@@ -453,6 +598,121 @@ static struct agh_message *agh_xmpp_new_message(const gchar *from, const gchar *
 	return m;
 }
 
+static gint agh_xmpp_ping_sample_cmp(gconstpointer a, gconstpointer b, gpointer user_data) {
+	const gint64 *x = a;
+	const gint64 *y = b;
+
+	return (*x > *y) - (*x < *y);
+}
+
+/*
+ * Computes min, average and 95th percentile of the RTTs (in ms) in the rolling window, and counts lost pings.
+*/
+void agh_xmpp_ping_summarize(struct xmpp_state *xstate, struct agh_xmpp_ping_summary *sum) {
+	gint64 rtts[AGH_XMPP_PING_STATS_WINDOW];
+	guint n;
+	guint i;
+	gint64 total;
+
+	memset(sum, 0, sizeof(*sum));
+	n = 0;
+	total = 0;
+
+	for (i = 0; i < xstate->ping_samples_count; i++) {
+		if (xstate->ping_samples[i] == AGH_XMPP_PING_SAMPLE_LOST) {
+			sum->lost++;
+			continue;
+		}
+
+		rtts[n++] = xstate->ping_samples[i];
+		total += xstate->ping_samples[i];
+	}
+
+	sum->samples = xstate->ping_samples_count;
+
+	if (!n)
+		return;
+
+	g_qsort_with_data(rtts, n, sizeof(*rtts), agh_xmpp_ping_sample_cmp, NULL);
+
+	sum->min = rtts[0];
+	sum->avg = total / n;
+	sum->p95 = rtts[(n * 95 + 99) / 100 - 1];
+
+	return;
+}
+
+/*
+ * Emits an event when link quality crosses configured thresholds, in any direction.
+*/
+static void agh_xmpp_ping_check_quality(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_xmpp_ping_summary sum;
+	struct agh_cmd *ev;
+	gboolean degraded;
+	gint error_value;
+
+	error_value = 0;
+
+	if ((!xstate->ping_rtt_threshold && !xstate->ping_loss_threshold) || (xstate->ping_samples_count < AGH_XMPP_PING_STATS_MIN_SAMPLES))
+		return;
+
+	agh_xmpp_ping_summarize(xstate, &sum);
+
+	degraded = FALSE;
+
+	if (xstate->ping_rtt_threshold && (sum.samples > sum.lost) && (sum.p95 > xstate->ping_rtt_threshold))
+		degraded = TRUE;
+
+	if (xstate->ping_loss_threshold && (sum.lost * 100 >= sum.samples * xstate->ping_loss_threshold))
+		degraded = TRUE;
+
+	if (degraded == xstate->ping_degraded)
+		return;
+
+	xstate->ping_degraded = degraded;
+
+	if (!mstate->comm || mstate->comm->teardown_in_progress)
+		return;
+
+	ev = agh_cmd_event_alloc(&error_value);
+	if (!ev) {
+		agh_log_xmpp_crit("failure allocating event (code=%" G_GINT16_FORMAT")", error_value);
+		return;
+	}
+
+	agh_cmd_answer_set_status(ev, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(ev, "\""AGH_XMPP_LINK_QUALITY_EVENT_NAME"\"", TRUE);
+	agh_cmd_answer_addtext(ev, degraded ? "DEGRADED" : "OK", TRUE);
+	agh_cmd_answer_addtext(ev, g_strdup_printf("min=%" G_GINT64_FORMAT", avg=%" G_GINT64_FORMAT", p95=%" G_GINT64_FORMAT", lost=%" G_GUINT16_FORMAT"/%" G_GUINT16_FORMAT"", sum.min, sum.avg, sum.p95, sum.lost, sum.samples), FALSE);
+
+	agh_cmd_emit_event(mstate->comm, ev);
+
+	return;
+}
+
+/*
+ * Adds an RTT sample (in ms), or a loss one, to the rolling window.
+*/
+static void agh_xmpp_ping_add_sample(struct agh_state *mstate, gint64 rtt) {
+	struct xmpp_state *xstate = mstate->xstate;
+
+	xstate->ping_samples[xstate->ping_samples_pos] = rtt;
+	xstate->ping_samples_pos = (xstate->ping_samples_pos + 1) % AGH_XMPP_PING_STATS_WINDOW;
+
+	if (xstate->ping_samples_count < AGH_XMPP_PING_STATS_WINDOW)
+		xstate->ping_samples_count++;
+
+	g_free(xstate->ping_id);
+	xstate->ping_id = NULL;
+
+	agh_xmpp_ping_check_quality(mstate);
+
+	return;
+}
+
+static int ping_handler(xmpp_conn_t *const conn, void *const userdata);
+
 /* libstrophe handler */
 static int ping_timeout_handler(xmpp_conn_t *const conn, void *const userdata) {
 	struct agh_state *mstate = userdata;
@@ -463,9 +723,21 @@ static int ping_timeout_handler(xmpp_conn_t *const conn, void *const userdata) {
 		return 1;
 	}
 
-	agh_log_xmpp_crit("oops! Time to try reconnecting");
+	if (xstate->ping_id) {
+		agh_xmpp_ping_add_sample(mstate, AGH_XMPP_PING_SAMPLE_LOST);
+		xstate->ping_lost_consecutive++;
+	}
+
+	if (xstate->ping_lost_consecutive >= xstate->ping_max_lost) {
+		agh_log_xmpp_crit("oops! %" G_GUINT16_FORMAT" pings lost in a row, time to try reconnecting", xstate->ping_lost_consecutive);
+		xmpp_disconnect(xstate->xmpp_conn);
+		return 0;
+	}
 
-	xmpp_disconnect(xstate->xmpp_conn);
+	/* Try again sooner than ping_interval, the link may just be slow. */
+	agh_log_xmpp_dbg("ping lost (%" G_GUINT16_FORMAT" in a row), retrying", xstate->ping_lost_consecutive);
+	xmpp_timed_handler_add(xstate->xmpp_conn, ping_handler, xstate->ping_timeout * 1000, mstate);
+	xstate->ping_is_timeout = FALSE;
 
 	return 0;
 }
@@ -497,8 +769,15 @@ static int ping_handler(xmpp_conn_t *const conn, void *const userdata) {
 		return 1;
 	}
 
+	/* The previous ping was never answered, e.g. because the connection went down meanwhile. */
+	if (xstate->ping_id)
+		agh_xmpp_ping_add_sample(mstate, AGH_XMPP_PING_SAMPLE_LOST);
+
+	xstate->ping_id = g_strdup(xmpp_stanza_get_id(iq_ping));
+	xstate->ping_sent_time = g_get_monotonic_time();
+
 	xmpp_timed_handler_add(xstate->xmpp_conn, ping_timeout_handler, xstate->ping_timeout * 1000, mstate);
-	xmpp_send(xstate->xmpp_conn, iq_ping);
+	agh_xmpp_send_stanza(xstate, iq_ping);
 	xmpp_stanza_release(iq_ping);
 	xmpp_free(xstate->xmpp_ctx, domain);
 	xstate->ping_is_timeout = TRUE;
@@ -516,6 +795,11 @@ static int iq_result_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const sta
 		return 1;
 	}
 
+	if (xstate->ping_id && !g_strcmp0(xstate->ping_id, xmpp_stanza_get_id(stanza))) {
+		agh_xmpp_ping_add_sample(mstate, (g_get_monotonic_time() - xstate->ping_sent_time) / 1000);
+		xstate->ping_lost_consecutive = 0;
+	}
+
 	if (xstate->ping_interval && xstate->ping_is_timeout) {
 		xmpp_timed_handler_delete(xstate->xmpp_conn, ping_timeout_handler);
 		xmpp_timed_handler_add(xstate->xmpp_conn, ping_handler, xstate->ping_interval * 1000, mstate);
@@ -672,7 +956,7 @@ static int message_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanz
 		xmpp_stanza_release(receipt_response);
 		xmpp_stanza_set_from(receipt_message, xmpp_conn_get_bound_jid(conn));
 
-		xmpp_send(conn, receipt_message);
+		agh_xmpp_send_stanza(xstate, receipt_message);
 		xmpp_stanza_release(receipt_message);
 		xstate->msg_id++;
 		g_free(receipt_response_id);
@@ -697,61 +981,6 @@ static int message_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanz
 	return 1;
 }
 
-/* libstrophe handler */
-static void xmpp_connection_handler(xmpp_conn_t * const conn, const xmpp_conn_event_t status, const int error, xmpp_stream_error_t * const stream_error, void * const userdata) {
-	struct xmpp_state *xstate;
-	xmpp_stanza_t *pres;
-	xmpp_ctx_t *ctx;
-	struct agh_state *mstate;
-	gint retv;
-
-	mstate = userdata;
-	xstate = mstate->xstate;
-
-	ctx = xstate->xmpp_ctx;
-
-	switch(status) {
-	case XMPP_CONN_CONNECT:
-		pres = xmpp_presence_new(ctx);
-
-		if (!pres) {
-			agh_log_xmpp_crit("unable to allocate presence stanza");
-			break;
-		}
-
-		retv = agh_xmpp_prepare_entity(xstate);
-		if (retv) {
-			xmpp_stanza_release(pres);
-			break;
-		}
-
-		retv = agh_xmpp_caps_add_hash(ctx, xstate->e, pres);
-		agh_xmpp_caps_entity_dealloc(xstate->e);
-		xstate->e = NULL;
-		if (retv) {
-			agh_log_xmpp_crit("agh_xmpp_caps_add_hash failed (code=%" G_GINT16_FORMAT")", retv);
-			xmpp_stanza_release(pres);
-			break;
-		}
-		agh_log_xmpp_dbg("sending presence");
-		xmpp_send(xstate->xmpp_conn, pres);
-		xmpp_stanza_release(pres);
-		xstate->failing = 0;
-		break;
-	case XMPP_CONN_DISCONNECT:
-		xstate->xmpp_idle_state++;
-		break;
-	case XMPP_CONN_FAIL:
-		agh_log_xmpp_crit("connection failed");
-		xstate->xmpp_idle_state++;
-		break;
-	default:
-		agh_log_xmpp_crit("unknown state");
-	}
-
-	return;
-}
-
 static gint agh_xmpp_send_message(struct agh_state *mstate, const gchar *to, const gchar *text) {
 	struct xmpp_state *xstate = mstate->xstate;
 	xmpp_ctx_t *ctx = xstate->xmpp_ctx;
@@ -782,8 +1011,9 @@ static gint agh_xmpp_send_message(struct agh_state *mstate, const gchar *to, con
 	local_text = g_strdup(text);
 	xmpp_message_set_body(reply, local_text);
 	xmpp_stanza_set_from(reply, from);
-	xmpp_send(xstate->xmpp_conn, reply);
+	agh_xmpp_send_stanza(xstate, reply);
 	xmpp_stanza_release(reply);
+	agh_xmpp_sm_track(xstate, to, local_text);
 	g_free(local_text);
 	g_free(id);
 	xstate->msg_id++;
@@ -791,89 +1021,734 @@ static gint agh_xmpp_send_message(struct agh_state *mstate, const gchar *to, con
 	return 0;
 }
 
-static gint agh_xmpp_send_out_messages(struct agh_state *mstate) {
+/* libstrophe handler */
+static int agh_xmpp_sm_inbound_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
+	struct agh_state *mstate = userdata;
 	struct xmpp_state *xstate = mstate->xstate;
-	struct agh_text_payload *tcsp;
-	struct agh_message *artificial_message;
-	gchar *agh_message_source_name;
-	gchar *agh_message_source_from;
-	guint i;
-	guint controllers_queue_len;
-	gchar *current_controller;
-	gint retval;
-
-	agh_message_source_from = NULL;
-	agh_message_source_name = NULL;
-	retval = 0;
-
-	if (!xstate->outxmpp_messages)
-		return 0;
-
-	if (!g_queue_get_length(xstate->outxmpp_messages))
-		return 0;
-
-	/* Get a message */
-	artificial_message = g_queue_pop_head(xstate->outxmpp_messages);
-	if (!artificial_message) {
-		agh_log_xmpp_crit("picked artificial_message is NULL");
-		return 1;
-	}
-
-	/* We expect only MSG_SENDTEXT messages, or in any case, messages with a agh_text_payload. */
-	tcsp = artificial_message->csp;
+	const gchar *name;
 
-	if (!tcsp) {
-		agh_log_xmpp_crit("NULL message payload");
-		agh_msg_dealloc(artificial_message);
+	if (xstate->sm_state != AGH_XMPP_SM_STATE_ENABLED)
 		return 1;
-	}
-
-	if (tcsp->source_id) {
-		retval = agh_message_source(tcsp->source_id, &agh_message_source_name, &agh_message_source_from);
-		if (retval) {
-			agh_log_xmpp_crit("failure while parsing message sources (code=%" G_GINT16_FORMAT")", retval);
-			agh_msg_dealloc(artificial_message);
-			return retval;
-		}
-
-		if (agh_message_source_from) {
-			if (!g_strcmp0(agh_message_source_name, "XMPP")) {
-				retval = agh_xmpp_send_message(mstate, agh_message_source_from, tcsp->text);
-				if (retval)
-					agh_log_xmpp_crit("failure while sending message (code=%" G_GINT16_FORMAT")", retval);
-			}
 
-			g_free(agh_message_source_from);
-			g_free(agh_message_source_name);
-		}
-	}
-	else {
-		controllers_queue_len = g_queue_get_length(xstate->controllers);
-		for (i=0;i<controllers_queue_len;i++) {
-			current_controller = g_queue_peek_nth(xstate->controllers, i);
-			retval = agh_xmpp_send_message(mstate, current_controller, tcsp->text);
-			if (retval) {
-				agh_log_xmpp_dbg("failure while sending message to all controllers (code=%" G_GINT16_FORMAT")", retval);
-				break;
-			}
-		}
-	}
+	name = xmpp_stanza_get_name(stanza);
 
-	agh_msg_dealloc(artificial_message);
+	if (!g_strcmp0(name, "message") || !g_strcmp0(name, "iq") || !g_strcmp0(name, "presence"))
+		xstate->sm_inbound++;
 
-	return 0;
+	return 1;
 }
 
 /* libstrophe handler */
-static int pong_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
+static int agh_xmpp_sm_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
 	struct agh_state *mstate = userdata;
 	struct xmpp_state *xstate = mstate->xstate;
+	const gchar *name;
+	const gchar *h_str;
+	gchar *eptr;
+	guint64 h;
 
-	xmpp_stanza_t *iq_ping;
-
-	iq_ping = NULL;
-
-	agh_log_xmpp_dbg("%s entered",__FUNCTION__);
+	eptr = NULL;
+
+	if (xstate->xmpp_idle_state != 1) {
+		agh_log_xmpp_dbg("exiting due to xstate->xmpp_idle_state != 1");
+		return 1;
+	}
+
+	name = xmpp_stanza_get_name(stanza);
+
+	if (!g_strcmp0(name, AGH_XMPP_STANZA_NAME_SM_ENABLED)) {
+		agh_log_xmpp_dbg("stream management enabled");
+		xstate->sm_state = AGH_XMPP_SM_STATE_ENABLED;
+		xstate->sm_inbound = 0;
+		return 1;
+	}
+
+	if (!g_strcmp0(name, AGH_XMPP_STANZA_NAME_SM_FAILED)) {
+		agh_log_xmpp_crit("server refused to enable stream management");
+		xstate->sm_state = AGH_XMPP_SM_STATE_INACTIVE;
+		g_queue_foreach(xstate->sm_unacked, (GFunc)agh_xmpp_sm_item_free, NULL);
+		g_queue_clear(xstate->sm_unacked);
+		return 1;
+	}
+
+	if (xstate->sm_state != AGH_XMPP_SM_STATE_ENABLED)
+		return 1;
+
+	if (!g_strcmp0(name, AGH_XMPP_STANZA_NAME_SM_REQUEST)) {
+		xmpp_send_raw_string(conn, "<"AGH_XMPP_STANZA_NAME_SM_ANSWER" xmlns='"AGH_XMPP_STANZA_NS_SM"' "AGH_XMPP_STANZA_ATTR_SM_H"='%" G_GUINT32_FORMAT"'/>", xstate->sm_inbound);
+		return 1;
+	}
+
+	if (!g_strcmp0(name, AGH_XMPP_STANZA_NAME_SM_ANSWER)) {
+		h_str = xmpp_stanza_get_attribute(stanza, AGH_XMPP_STANZA_ATTR_SM_H);
+		if (!h_str) {
+			agh_log_xmpp_crit("ack with no h attribute");
+			return 1;
+		}
+
+		h = g_ascii_strtoull(h_str, &eptr, 10);
+		if ((h > G_MAXUINT32) || !(!eptr || *eptr == '\0')) {
+			agh_log_xmpp_crit("ack with invalid h attribute");
+			return 1;
+		}
+
+		agh_xmpp_sm_ack(xstate, h);
+	}
+
+	return 1;
+}
+
+/* libstrophe handler */
+static int agh_xmpp_sm_request_handler(xmpp_conn_t * const conn, void * const userdata) {
+	struct agh_state *mstate = userdata;
+	struct xmpp_state *xstate = mstate->xstate;
+
+	if (xstate->xmpp_idle_state != 1)
+		return 1;
+
+	/* Ask for an ack only when there is something to be acknowledged, sparing some traffic. */
+	if ((xstate->sm_state == AGH_XMPP_SM_STATE_ENABLED) && !g_queue_is_empty(xstate->sm_unacked))
+		xmpp_send_raw_string(conn, "<"AGH_XMPP_STANZA_NAME_SM_REQUEST" xmlns='"AGH_XMPP_STANZA_NS_SM"'/>");
+
+	return 1;
+}
+
+/*
+ * Sends again messages not acknowledged by the server during the previous session. Those will be tracked again if Stream Management is active for the current session.
+*/
+static void agh_xmpp_sm_retransmit(struct agh_state *mstate, GQueue *pending) {
+	struct agh_xmpp_sm_item *item;
+	guint count;
+
+	count = 0;
+
+	while ( (item = g_queue_pop_head(pending)) ) {
+		if (!agh_xmpp_send_message(mstate, item->to, item->text))
+			count++;
+
+		agh_xmpp_sm_item_free(item);
+	}
+
+	if (count)
+		agh_log_xmpp_dbg("%" G_GUINT16_FORMAT" unacknowledged messages were sent again", count);
+
+	return;
+}
+
+/*
+ * Moves events (messages not originated by a command) from the outgoing queue to the spool, so they will not be lost while
+ * we are disconnected.
+*/
+static void agh_xmpp_spool_messages(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_message *artificial_message;
+	struct agh_text_payload *tcsp;
+	GList *l;
+	GList *next;
+
+	if (!xstate->spool || !xstate->spool->max_size || !xstate->outxmpp_messages)
+		return;
+
+	for (l = xstate->outxmpp_messages->head; l; l = next) {
+		next = g_list_next(l);
+		artificial_message = l->data;
+		tcsp = artificial_message->csp;
+
+		if (!tcsp || tcsp->source_id || !tcsp->text)
+			continue;
+
+		agh_xmpp_spool_add(xstate->spool, tcsp->text);
+		g_queue_delete_link(xstate->outxmpp_messages, l);
+		agh_msg_dealloc(artificial_message);
+	}
+
+	return;
+}
+
+/*
+ * Prepares spooled events to be sent, and lets controllers know when some of them had to be discarded.
+*/
+static void agh_xmpp_spool_resume(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_cmd *ev;
+	guint64 discarded;
+	gint error_value;
+
+	error_value = 0;
+
+	if (!xstate->spool)
+		return;
+
+	xstate->spool_stalled = FALSE;
+	xstate->spool_diverted = FALSE;
+	agh_xmpp_spool_load(xstate->spool);
+
+	discarded = agh_xmpp_spool_take_discarded(xstate->spool);
+	if (!discarded)
+		return;
+
+	agh_log_xmpp_crit("%" G_GUINT64_FORMAT" spooled events were discarded", discarded);
+
+	if (!mstate->comm || mstate->comm->teardown_in_progress)
+		return;
+
+	ev = agh_cmd_event_alloc(&error_value);
+	if (!ev) {
+		agh_log_xmpp_crit("failure allocating event (code=%" G_GINT16_FORMAT")", error_value);
+		return;
+	}
+
+	agh_cmd_answer_set_status(ev, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(ev, "\""AGH_XMPP_SPOOL_EVENT_NAME"\"", TRUE);
+	agh_cmd_answer_addtext(ev, "DISCARDED", TRUE);
+	agh_cmd_answer_addtext(ev, g_strdup_printf("count=%" G_GUINT64_FORMAT"", discarded), FALSE);
+
+	agh_cmd_emit_event(mstate->comm, ev);
+
+	return;
+}
+
+/*
+ * Schedules the next connection attempt after a failure. The delay doubles on each consecutive failure, from backoff_min up
+ * to backoff_max seconds; we wait for a random amount of time between half and the whole of it, so many devices losing
+ * connectivity at once will not hit the server in lockstep.
+*/
+static void agh_xmpp_backoff_fail(struct xmpp_state *xstate) {
+	gint64 delay;
+	gint64 wait;
+
+	xstate->backoff_failures++;
+
+	if (!xstate->backoff_delay)
+		delay = (gint64)xstate->backoff_min * 1000;
+	else
+		delay = xstate->backoff_delay * 2;
+
+	if (delay > (gint64)xstate->backoff_max * 1000)
+		delay = (gint64)xstate->backoff_max * 1000;
+
+	xstate->backoff_delay = delay;
+
+	wait = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	xstate->backoff_deadline = g_get_monotonic_time() + wait * 1000;
+
+	agh_log_xmpp_dbg("failure %" G_GUINT16_FORMAT", next attempt in %" G_GINT64_FORMAT" ms", xstate->backoff_failures, wait);
+
+	return;
+}
+
+static void agh_xmpp_backoff_reset(struct xmpp_state *xstate) {
+
+	xstate->backoff_failures = 0;
+	xstate->backoff_delay = 0;
+	xstate->backoff_deadline = 0;
+
+	return;
+}
+
+/*
+ * Chunks sent during the previous session, but not acknowledged, may have been lost: send them again.
+*/
+static void agh_xmpp_transfers_rewind(struct xmpp_state *xstate) {
+	struct agh_xmpp_transfer *t;
+	GList *l;
+
+	if (!xstate->transfers)
+		return;
+
+	for (l = xstate->transfers->head; l; l = g_list_next(l)) {
+		t = l->data;
+
+		if (t->next != t->acked)
+			agh_log_xmpp_dbg("transfer %" G_GUINT16_FORMAT": resending from chunk %" G_GUINT16_FORMAT"", t->id, t->acked);
+
+		t->next = t->acked;
+		t->last_activity = g_get_monotonic_time();
+	}
+
+	return;
+}
+
+/* libstrophe handler */
+static void xmpp_connection_handler(xmpp_conn_t * const conn, const xmpp_conn_event_t status, const int error, xmpp_stream_error_t * const stream_error, void * const userdata) {
+	struct xmpp_state *xstate;
+	xmpp_stanza_t *pres;
+	xmpp_ctx_t *ctx;
+	struct agh_state *mstate;
+	gint retv;
+	GQueue *pending;
+
+	mstate = userdata;
+	xstate = mstate->xstate;
+
+	ctx = xstate->xmpp_ctx;
+
+	switch(status) {
+	case XMPP_CONN_CONNECT:
+		xstate->connected = TRUE;
+		agh_xmpp_backoff_reset(xstate);
+		agh_xmpp_spool_resume(mstate);
+		agh_xmpp_transfers_rewind(xstate);
+		xstate->ping_lost_consecutive = 0;
+
+		pres = xmpp_presence_new(ctx);
+
+		if (!pres) {
+			agh_log_xmpp_crit("unable to allocate presence stanza");
+			break;
+		}
+
+		/* Messages left unacknowledged by the previous session. */
+		pending = xstate->sm_unacked;
+		xstate->sm_unacked = g_queue_new();
+
+		if (xstate->sm_wanted) {
+			xstate->sm_inbound = 0;
+			xstate->sm_outbound = 0;
+			xmpp_send_raw_string(conn, "<enable xmlns='"AGH_XMPP_STANZA_NS_SM"'/>");
+			xstate->sm_state = AGH_XMPP_SM_STATE_REQUESTED;
+			xmpp_timed_handler_add(conn, agh_xmpp_sm_request_handler, xstate->sm_request_interval * 1000, mstate);
+		}
+
+		/* Capabilities may have failed to be computed earlier on: give them another chance. */
+		if (!xstate->caps_ver || !xstate->caps_query) {
+			retv = agh_xmpp_caps_refresh(xstate);
+			if (retv)
+				agh_log_xmpp_crit("agh_xmpp_caps_refresh failed (code=%" G_GINT16_FORMAT"), capabilities will not be advertised", retv);
+		}
+
+		/* Advertising a hash we could not answer disco#info queries for would not help. */
+		if (xstate->caps_ver && xstate->caps_query) {
+			retv = agh_xmpp_caps_add_hash(ctx, xstate->caps_ver, pres);
+			if (retv)
+				agh_log_xmpp_crit("agh_xmpp_caps_add_hash failed (code=%" G_GINT16_FORMAT"), capabilities will not be advertised", retv);
+		}
+
+		agh_log_xmpp_dbg("sending presence");
+		agh_xmpp_send_stanza(xstate, pres);
+		xmpp_stanza_release(pres);
+		agh_xmpp_sm_retransmit(mstate, pending);
+		g_queue_free(pending);
+		break;
+	case XMPP_CONN_DISCONNECT:
+		xstate->connected = FALSE;
+		xstate->sm_state = AGH_XMPP_SM_STATE_INACTIVE;
+		xstate->xmpp_idle_state++;
+		break;
+	case XMPP_CONN_FAIL:
+		agh_log_xmpp_crit("connection failed");
+		xstate->connected = FALSE;
+		xstate->sm_state = AGH_XMPP_SM_STATE_INACTIVE;
+		xstate->xmpp_idle_state++;
+		break;
+	default:
+		agh_log_xmpp_crit("unknown state");
+	}
+
+	return;
+}
+
+static void agh_xmpp_transfer_free(gpointer data) {
+	struct agh_xmpp_transfer *t = data;
+
+	if (!t)
+		return;
+
+	g_free(t->to);
+	g_free(t->text);
+	g_free(t->offsets);
+	g_free(t);
+
+	return;
+}
+
+/*
+ * Computes chunk boundaries of a transfer, so every chunk is at most chunk_size bytes long. Cuts falling in the middle of an UTF-8
+ * character are moved back to its beginning, or chunks would not be valid UTF-8, hence valid XML.
+ *
+ * Returns: an integer with value 0 on success, or 1 on allocation failure.
+*/
+static gint agh_xmpp_transfer_split(struct agh_xmpp_transfer *t, gsize chunk_size) {
+	const gchar *cut;
+	gboolean utf8;
+	gsize start;
+	gsize end;
+
+	utf8 = g_utf8_validate(t->text, t->len, NULL);
+	if (!utf8)
+		agh_log_xmpp_crit("transfer %" G_GUINT16_FORMAT": text is not valid UTF-8", t->id);
+
+	/* Every chunk but the last one is at most 3 bytes shorter than chunk_size. */
+	t->offsets = g_try_new(gsize, t->len / (chunk_size - 3) + 2);
+	if (!t->offsets)
+		return 1;
+
+	t->chunks = 0;
+	start = 0;
+
+	while (start < t->len) {
+		end = start + chunk_size;
+
+		if (end >= t->len)
+			end = t->len;
+		else if (utf8) {
+			cut = g_utf8_find_prev_char(t->text + start, t->text + end + 1);
+			if (cut && (cut > t->text + start))
+				end = cut - t->text;
+		}
+
+		t->offsets[t->chunks++] = start;
+		start = end;
+	}
+
+	t->offsets[t->chunks] = t->len;
+
+	return 0;
+}
+
+/*
+ * Queues a text to be sent in chunks. Takes a copy of the passed text.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: allocation failure
+*/
+static gint agh_xmpp_transfer_new(struct xmpp_state *xstate, const gchar *to, const gchar *text) {
+	struct agh_xmpp_transfer *t;
+
+	t = g_try_malloc0(sizeof(*t));
+	if (!t) {
+		agh_log_xmpp_crit("unable to allocate transfer");
+		return 1;
+	}
+
+	if (xstate->transfer_id == G_MAXUINT)
+		xstate->transfer_id = 0;
+
+	t->id = xstate->transfer_id++;
+	t->to = g_strdup(to);
+	t->text = g_strdup(text);
+	t->len = strlen(text);
+	t->last_activity = g_get_monotonic_time();
+
+	if (agh_xmpp_transfer_split(t, xstate->chunk_size)) {
+		agh_log_xmpp_crit("unable to allocate transfer chunk offsets");
+		agh_xmpp_transfer_free(t);
+		return 1;
+	}
+
+	g_queue_push_tail(xstate->transfers, t);
+
+	if (g_queue_get_length(xstate->transfers) > AGH_XMPP_MAX_TRANSFERS) {
+		agh_log_xmpp_crit("too many transfers, dropping the oldest one");
+		agh_xmpp_transfer_free(g_queue_pop_head(xstate->transfers));
+	}
+
+	agh_log_xmpp_dbg("transfer %" G_GUINT16_FORMAT" to %s: %" G_GSIZE_FORMAT" bytes in %" G_GUINT16_FORMAT" chunks", t->id, to, t->len, t->chunks);
+
+	return 0;
+}
+
+static struct agh_xmpp_transfer *agh_xmpp_transfer_find(struct xmpp_state *xstate, guint id) {
+	GList *l;
+	struct agh_xmpp_transfer *t;
+
+	if (!xstate->transfers)
+		return NULL;
+
+	for (l = xstate->transfers->head; l; l = g_list_next(l)) {
+		t = l->data;
+
+		if (t->id == id)
+			return t;
+	}
+
+	return NULL;
+}
+
+/*
+ * Marks all chunks of a transfer, up to and including the given one, as received by the controller; this may allow further
+ * chunks to be sent. The transfer is released once all of its chunks are acknowledged.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: no such transfer
+ *  - 2: acknowledging a chunk we did not send yet
+*/
+gint agh_xmpp_transfer_ack(struct xmpp_state *xstate, guint id, guint chunk) {
+	struct agh_xmpp_transfer *t;
+
+	t = agh_xmpp_transfer_find(xstate, id);
+	if (!t)
+		return 1;
+
+	if (chunk >= t->sent)
+		return 2;
+
+	if (chunk + 1 > t->acked)
+		t->acked = chunk + 1;
+
+	/* A late acknowledgement for chunks sent before reconnecting: no need to send them again. */
+	if (t->next < t->acked)
+		t->next = t->acked;
+
+	t->last_activity = g_get_monotonic_time();
+
+	if (t->acked == t->chunks) {
+		agh_log_xmpp_dbg("transfer %" G_GUINT16_FORMAT" completed", t->id);
+		g_queue_remove(xstate->transfers, t);
+		agh_xmpp_transfer_free(t);
+	}
+
+	return 0;
+}
+
+/*
+ * Drops a transfer, no matter how many chunks have been sent.
+ *
+ * Returns: an integer with value 0 on success, or 1 when no such transfer exists.
+*/
+gint agh_xmpp_transfer_cancel(struct xmpp_state *xstate, guint id) {
+	struct agh_xmpp_transfer *t;
+
+	t = agh_xmpp_transfer_find(xstate, id);
+	if (!t)
+		return 1;
+
+	g_queue_remove(xstate->transfers, t);
+	agh_xmpp_transfer_free(t);
+
+	return 0;
+}
+
+/*
+ * Sends at most one chunk, picking transfers in a round-robin fashion, and only when the transfer window allows for it.
+ * Transfers not acknowledged for too long are dropped.
+*/
+static void agh_xmpp_transfers_send(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_xmpp_transfer *t;
+	guint num_transfers;
+	guint i;
+	gchar *chunk_text;
+
+	num_transfers = g_queue_get_length(xstate->transfers);
+
+	for (i = 0; i < num_transfers; i++) {
+		t = g_queue_pop_head(xstate->transfers);
+
+		if (g_get_monotonic_time() - t->last_activity > (gint64)AGH_XMPP_TRANSFER_TIMEOUT * G_USEC_PER_SEC) {
+			agh_log_xmpp_crit("transfer %" G_GUINT16_FORMAT" timed out", t->id);
+			agh_xmpp_transfer_free(t);
+			continue;
+		}
+
+		g_queue_push_tail(xstate->transfers, t);
+
+		if ((t->next == t->chunks) || (t->next - t->acked >= (guint)xstate->chunk_window))
+			continue;
+
+		chunk_text = g_strdup_printf(AGH_CMD_CHUNK_KEYWORD" = ( %" G_GUINT16_FORMAT", %" G_GUINT16_FORMAT", %" G_GUINT16_FORMAT" )\n%.*s", t->id, t->next, t->chunks, (gint)(t->offsets[t->next + 1] - t->offsets[t->next]), t->text + t->offsets[t->next]);
+
+		if (!agh_xmpp_send_message(mstate, t->to, chunk_text)) {
+			t->next++;
+
+			if (t->next > t->sent)
+				t->sent = t->next;
+		}
+
+		g_free(chunk_text);
+		break;
+	}
+
+	return;
+}
+
+/*
+ * Sends a text, splitting it in chunks when it is too long.
+*/
+static gint agh_xmpp_send_or_split(struct agh_state *mstate, const gchar *to, const gchar *text) {
+	struct xmpp_state *xstate = mstate->xstate;
+
+	if (xstate->chunk_size && text && to && (strlen(text) > (gsize)xstate->chunk_size))
+		return agh_xmpp_transfer_new(xstate, to, text);
+
+	return agh_xmpp_send_message(mstate, to, text);
+}
+
+/*
+ * Sends a spooled event to the controllers it did not reach yet. Controllers it reached are remembered, so a partial failure
+ * does not lead to duplicates once the event is replayed again.
+ *
+ * Returns: an integer with value 0 when the event reached all controllers, or a value from agh_xmpp_send_or_split on failure.
+*/
+static gint agh_xmpp_spool_deliver(struct agh_state *mstate, const gchar *text) {
+	struct xmpp_state *xstate = mstate->xstate;
+	gchar *current_controller;
+	guint controllers_queue_len;
+	guint i;
+	gint retval;
+
+	retval = 0;
+
+	controllers_queue_len = g_queue_get_length(xstate->controllers);
+	for (i=0;i<controllers_queue_len;i++) {
+		current_controller = g_queue_peek_nth(xstate->controllers, i);
+
+		if (g_queue_find_custom(xstate->spool_delivered, current_controller, (GCompareFunc)g_strcmp0))
+			continue;
+
+		retval = agh_xmpp_send_or_split(mstate, current_controller, text);
+		if (retval) {
+			agh_log_xmpp_dbg("failure while sending spooled event to %s (code=%" G_GINT16_FORMAT")", current_controller, retval);
+			return retval;
+		}
+
+		g_queue_push_tail(xstate->spool_delivered, g_strdup(current_controller));
+	}
+
+	while (!g_queue_is_empty(xstate->spool_delivered))
+		g_free(g_queue_pop_head(xstate->spool_delivered));
+
+	return retval;
+}
+
+/*
+ * Replays spooled events, up to AGH_XMPP_SPOOL_REPLAY_BUDGET bytes per run, so live messages are not held back for long.
+ * While some of them are waiting, new events are spooled as well, and replayed after them; should sending fail, replay stops
+ * until we reconnect.
+*/
+static void agh_xmpp_spool_replay(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	gchar *spooled_text;
+	gint64 spooled_ts;
+	gsize budget;
+
+	if (!xstate->spool)
+		return;
+
+	if (xstate->spool_stalled || !g_queue_is_empty(xstate->spool->replay)) {
+		agh_xmpp_spool_messages(mstate);
+		xstate->spool_diverted = TRUE;
+	}
+
+	budget = 0;
+	spooled_ts = 0;
+
+	while (!xstate->spool_stalled && (budget < AGH_XMPP_SPOOL_REPLAY_BUDGET)) {
+		spooled_text = agh_xmpp_spool_next(xstate->spool, &spooled_ts);
+		if (!spooled_text)
+			break;
+
+		budget += strlen(spooled_text);
+
+		if (agh_xmpp_spool_deliver(mstate, spooled_text)) {
+			xstate->spool_stalled = TRUE;
+
+			if (agh_xmpp_spool_requeue(xstate->spool, spooled_text, spooled_ts)) {
+				while (!g_queue_is_empty(xstate->spool_delivered))
+					g_free(g_queue_pop_head(xstate->spool_delivered));
+			}
+
+			break;
+		}
+
+		g_free(spooled_text);
+	}
+
+	/* Events spooled while replaying are up next. */
+	if (!xstate->spool_stalled && xstate->spool_diverted && g_queue_is_empty(xstate->spool->replay)) {
+		xstate->spool_diverted = FALSE;
+		agh_xmpp_spool_load(xstate->spool);
+	}
+
+	return;
+}
+
+static gint agh_xmpp_send_out_messages(struct agh_state *mstate) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_text_payload *tcsp;
+	struct agh_message *artificial_message;
+	gchar *agh_message_source_name;
+	gchar *agh_message_source_from;
+	guint i;
+	guint controllers_queue_len;
+	gchar *current_controller;
+	gint retval;
+
+	agh_message_source_from = NULL;
+	agh_message_source_name = NULL;
+	retval = 0;
+
+	/* Spooled events go first, to preserve ordering. */
+	agh_xmpp_spool_replay(mstate);
+
+	if (!xstate->outxmpp_messages)
+		return 0;
+
+	if (!g_queue_get_length(xstate->outxmpp_messages))
+		return 0;
+
+	/* Get a message */
+	artificial_message = g_queue_pop_head(xstate->outxmpp_messages);
+	if (!artificial_message) {
+		agh_log_xmpp_crit("picked artificial_message is NULL");
+		return 1;
+	}
+
+	/* We expect only MSG_SENDTEXT messages, or in any case, messages with a agh_text_payload. */
+	tcsp = artificial_message->csp;
+
+	if (!tcsp) {
+		agh_log_xmpp_crit("NULL message payload");
+		agh_msg_dealloc(artificial_message);
+		return 1;
+	}
+
+	if (tcsp->source_id) {
+		retval = agh_message_source(tcsp->source_id, &agh_message_source_name, &agh_message_source_from);
+		if (retval) {
+			agh_log_xmpp_crit("failure while parsing message sources (code=%" G_GINT16_FORMAT")", retval);
+			agh_msg_dealloc(artificial_message);
+			return retval;
+		}
+
+		if (agh_message_source_from) {
+			if (!g_strcmp0(agh_message_source_name, "XMPP")) {
+				retval = agh_xmpp_send_or_split(mstate, agh_message_source_from, tcsp->text);
+				if (retval)
+					agh_log_xmpp_crit("failure while sending message (code=%" G_GINT16_FORMAT")", retval);
+			}
+
+			g_free(agh_message_source_from);
+			g_free(agh_message_source_name);
+		}
+	}
+	else {
+		controllers_queue_len = g_queue_get_length(xstate->controllers);
+		for (i=0;i<controllers_queue_len;i++) {
+			current_controller = g_queue_peek_nth(xstate->controllers, i);
+			retval = agh_xmpp_send_or_split(mstate, current_controller, tcsp->text);
+			if (retval) {
+				agh_log_xmpp_dbg("failure while sending message to all controllers (code=%" G_GINT16_FORMAT")", retval);
+				break;
+			}
+		}
+	}
+
+	agh_msg_dealloc(artificial_message);
+
+	return 0;
+}
+
+/* libstrophe handler */
+static int pong_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza, void * const userdata) {
+	struct agh_state *mstate = userdata;
+	struct xmpp_state *xstate = mstate->xstate;
+
+	xmpp_stanza_t *iq_ping;
+
+	iq_ping = NULL;
+
+	agh_log_xmpp_dbg("%s entered",__FUNCTION__);
 
 	if (xstate->xmpp_idle_state != 1) {
 		agh_log_xmpp_dbg("exiting due to xstate->xmpp_idle_state != 1");
@@ -884,7 +1759,7 @@ static int pong_handler(xmpp_conn_t * const conn, xmpp_stanza_t * const stanza,
 	if (!iq_ping) {
 		agh_log_xmpp_crit("unable to answer");
 	}
-	xmpp_send(xstate->xmpp_conn, iq_ping);
+	agh_xmpp_send_stanza(xstate, iq_ping);
 	xmpp_stanza_release(iq_ping);
 
 	if (xstate->ping_interval) {
@@ -947,6 +1822,8 @@ static gint agh_xmpp_conn_setup(struct agh_state *mstate, const gchar *node, con
 	xmpp_handler_add(xstate->xmpp_conn, message_handler, NULL, "message", NULL, mstate);
 	xmpp_handler_add(xstate->xmpp_conn, pong_handler, AGH_XMPP_STANZA_NS_PING, "iq", AGH_XMPP_STANZA_TYPE_GET, mstate);
 	xmpp_handler_add(xstate->xmpp_conn, iq_result_handler, NULL, "iq", AGH_XMPP_STANZA_TYPE_RESULT, mstate);
+	xmpp_handler_add(xstate->xmpp_conn, agh_xmpp_sm_handler, AGH_XMPP_STANZA_NS_SM, NULL, NULL, mstate);
+	xmpp_handler_add(xstate->xmpp_conn, agh_xmpp_sm_inbound_handler, NULL, NULL, NULL, mstate);
 
 	xmpp_conn_set_jid(xstate->xmpp_conn, jid);
 	xmpp_conn_set_pass(xstate->xmpp_conn, pass);
@@ -980,6 +1857,16 @@ static void agh_xmpp_config_init(struct agh_state *mstate) {
 	gint ping_timeout;
 	gint ping_interval;
 	GQueue *controllers;
+	gint sm_request_interval;
+	gint backoff_min;
+	gint backoff_max;
+	gint chunk_size;
+	gint chunk_window;
+	gint ping_rtt_threshold;
+	gint ping_loss_threshold;
+	gint ping_max_lost;
+	gint spool_max_size;
+	gint spool_max_age;
 
 	if (xstate->uci_ctx) {
 		uci_unload(xstate->uci_ctx, xstate->xpackage);
@@ -1098,6 +1985,139 @@ static void agh_xmpp_config_init(struct agh_state *mstate) {
 		xstate->ping_interval = ping_interval;
 	}
 
+	/* Stream Management is optional. */
+	xstate->sm_wanted = FALSE;
+	xstate->sm_request_interval = AGH_XMPP_SM_DEFAULT_REQUEST_INTERVAL;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_SM);
+	if (optval && !g_strcmp0(optval, "1"))
+		xstate->sm_wanted = TRUE;
+
+	xstate->ping_rtt_threshold = 0;
+	xstate->ping_loss_threshold = 0;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_PING_RTT_THRESHOLD);
+	if (optval) {
+		ping_rtt_threshold = strtol(optval, &eptr, 10);
+
+		if ((ping_rtt_threshold > 0) && (ping_rtt_threshold < INT_MAX) && (!eptr || *eptr == '\0'))
+			xstate->ping_rtt_threshold = ping_rtt_threshold;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_PING_RTT_THRESHOLD" value, ignoring it");
+	}
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_PING_LOSS_THRESHOLD);
+	if (optval) {
+		ping_loss_threshold = strtol(optval, &eptr, 10);
+
+		if ((ping_loss_threshold > 0) && (ping_loss_threshold <= 100) && (!eptr || *eptr == '\0'))
+			xstate->ping_loss_threshold = ping_loss_threshold;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_PING_LOSS_THRESHOLD" value, ignoring it");
+	}
+
+	xstate->ping_max_lost = AGH_XMPP_PING_DEFAULT_MAX_LOST;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_PING_MAX_LOST);
+	if (optval) {
+		ping_max_lost = strtol(optval, &eptr, 10);
+
+		if ((ping_max_lost > 0) && (ping_max_lost <= AGH_XMPP_PING_STATS_WINDOW) && (!eptr || *eptr == '\0'))
+			xstate->ping_max_lost = ping_max_lost;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_PING_MAX_LOST" value, ignoring it");
+	}
+
+	xstate->chunk_size = AGH_XMPP_CHUNK_DEFAULT_SIZE;
+	xstate->chunk_window = AGH_XMPP_CHUNK_DEFAULT_WINDOW;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_CHUNK_SIZE);
+	if (optval) {
+		chunk_size = strtol(optval, &eptr, 10);
+
+		/* 0 disables chunking */
+		if ((!chunk_size || ((chunk_size >= AGH_XMPP_CHUNK_MIN_SIZE) && (chunk_size < INT_MAX))) && (!eptr || *eptr == '\0'))
+			xstate->chunk_size = chunk_size;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_CHUNK_SIZE" value, using default");
+	}
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_CHUNK_WINDOW);
+	if (optval) {
+		chunk_window = strtol(optval, &eptr, 10);
+
+		if ((chunk_window > 0) && (chunk_window < INT_MAX) && (!eptr || *eptr == '\0'))
+			xstate->chunk_window = chunk_window;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_CHUNK_WINDOW" value, using default");
+	}
+
+	if (xstate->spool) {
+		optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_SPOOL_PATH);
+		g_free(xstate->spool->path);
+		xstate->spool->path = g_strdup(optval ? optval : AGH_XMPP_SPOOL_DEFAULT_PATH);
+
+		xstate->spool->max_size = AGH_XMPP_SPOOL_DEFAULT_MAX_SIZE;
+		xstate->spool->max_age = AGH_XMPP_SPOOL_DEFAULT_MAX_AGE;
+
+		optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_SPOOL_MAX_SIZE);
+		if (optval) {
+			spool_max_size = strtol(optval, &eptr, 10);
+
+			/* 0 disables spooling */
+			if ((spool_max_size >= 0) && (spool_max_size < INT_MAX) && (!eptr || *eptr == '\0'))
+				xstate->spool->max_size = spool_max_size;
+			else
+				agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_SPOOL_MAX_SIZE" value, using default");
+		}
+
+		optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_SPOOL_MAX_AGE);
+		if (optval) {
+			spool_max_age = strtol(optval, &eptr, 10);
+
+			if ((spool_max_age > 0) && (spool_max_age < INT_MAX) && (!eptr || *eptr == '\0'))
+				xstate->spool->max_age = spool_max_age;
+			else
+				agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_SPOOL_MAX_AGE" value, using default");
+		}
+	}
+
+	xstate->backoff_min = AGH_XMPP_BACKOFF_DEFAULT_MIN;
+	xstate->backoff_max = AGH_XMPP_BACKOFF_DEFAULT_MAX;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_BACKOFF_MIN);
+	if (optval) {
+		backoff_min = strtol(optval, &eptr, 10);
+
+		if ((backoff_min > 0) && (backoff_min <= AGH_XMPP_BACKOFF_LIMIT) && (!eptr || *eptr == '\0'))
+			xstate->backoff_min = backoff_min;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_BACKOFF_MIN" value, ignoring it");
+	}
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_BACKOFF_MAX);
+	if (optval) {
+		backoff_max = strtol(optval, &eptr, 10);
+
+		if ((backoff_max > 0) && (backoff_max <= AGH_XMPP_BACKOFF_LIMIT) && (!eptr || *eptr == '\0'))
+			xstate->backoff_max = backoff_max;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_BACKOFF_MAX" value, ignoring it");
+	}
+
+	if (xstate->backoff_max < xstate->backoff_min)
+		xstate->backoff_max = xstate->backoff_min;
+
+	optval = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_SM_REQUEST_INTERVAL);
+	if (optval) {
+		sm_request_interval = strtol(optval, &eptr, 10);
+
+		if ((sm_request_interval > 0) && (sm_request_interval < INT_MAX) && (!eptr || *eptr == '\0'))
+			xstate->sm_request_interval = sm_request_interval;
+		else
+			agh_log_xmpp_crit("invalid "AGH_XMPP_UCI_OPTION_SM_REQUEST_INTERVAL" value, using default");
+	}
+
 	agh_xmpp_conn_setup(mstate, jid_node, jid_domain, jid_resource, pass, ka_interval, ka_timeout);
 
 	if (!xstate->xmpp_conn) {
@@ -1121,6 +2141,52 @@ out_noctx:
 	return;
 }
 
+/*
+ * Makes the state machine try connecting on its next run, skipping any pending backoff delay. Meant to be used when
+ * connectivity is known to be back, e.g. when a bearer gets connected.
+ * A connection attempt in progress may have been started on a dead link, and hang until libstrophe gives up: it is torn down,
+ * and a new one started as soon as it is gone.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: no AGH state or XMPP state
+ *  - 2: we are already connected
+*/
+gint agh_xmpp_reconnect_now(struct agh_state *mstate) {
+	struct xmpp_state *xstate;
+	gint retval;
+
+	retval = 0;
+
+	if (!mstate || !mstate->xstate || mstate->exiting) {
+		retval = 1;
+		goto out;
+	}
+
+	xstate = mstate->xstate;
+
+	if (xstate->connected) {
+		retval = 2;
+		goto out;
+	}
+
+	if (xstate->xmpp_idle_state == 1) {
+		if (!xstate->backoff_skip) {
+			agh_log_xmpp_dbg("restarting connection attempt in progress");
+			xstate->backoff_skip = TRUE;
+			xmpp_disconnect(xstate->xmpp_conn);
+		}
+
+		goto out;
+	}
+
+	agh_log_xmpp_dbg("skipping backoff, will try connecting now");
+	agh_xmpp_backoff_reset(xstate);
+	xstate->xmpp_idle_state = 0;
+
+out:
+	return retval;
+}
+
 static gboolean xmpp_idle(gpointer data) {
 	struct agh_state *mstate = data;
 	struct xmpp_state *xstate = mstate->xstate;
@@ -1134,17 +2200,9 @@ static gboolean xmpp_idle(gpointer data) {
 	eptr = NULL;
 	altport = 0;
 
-	if (xstate->failed_flag) {
-		xstate->failing--;
-		if (!xstate->failing) {
-			agh_log_xmpp_dbg("resetting failed flag");
-			xstate->failed_flag = FALSE;
-		}
-	}
-
 	switch(xstate->xmpp_idle_state) {
 	case 0:
-		if (xstate->failed_flag)
+		if (g_get_monotonic_time() < xstate->backoff_deadline)
 			break;
 
 		altdomain = agh_xmpp_getoption(xstate, AGH_XMPP_UCI_OPTION_ALTDOMAIN);
@@ -1167,22 +2225,14 @@ static gboolean xmpp_idle(gpointer data) {
 
 		if (!xstate->uci_ctx) {
 			agh_log_xmpp_dbg("config parsing failure");
-			xstate->failing++;
-			if (xstate->failing >= 3) {
-				xstate->failing = 300;
-				xstate->failed_flag = TRUE;
-			}
+			agh_xmpp_backoff_fail(xstate);
 			break;
 		}
 
 		xmpp_client_connect_status = xmpp_connect_client(xstate->xmpp_conn, altdomain, altport, xmpp_connection_handler, mstate);
 		if (xmpp_client_connect_status) {
 			agh_log_xmpp_dbg("can not connect (code=%" G_GINT16_FORMAT")", xmpp_client_connect_status);
-			xstate->failing++;
-			if (xstate->failing >= 3) {
-				xstate->failing = 300;
-				xstate->failed_flag = TRUE;
-			}
+			agh_xmpp_backoff_fail(xstate);
 			break;
 		}
 
@@ -1191,15 +2241,23 @@ static gboolean xmpp_idle(gpointer data) {
 	case 1:
 		/* run strophe event loop, once */
 		xmpp_run_once(xstate->xmpp_ctx, AGH_XMPP_RUN_ONCE_INTERVAL);
-		agh_xmpp_send_out_messages(mstate);
+
+		if (xstate->connected) {
+			agh_xmpp_send_out_messages(mstate);
+			agh_xmpp_transfers_send(mstate);
+		}
+
 		break;
 	case 2:
 		if (!mstate->exiting) {
-			xstate->failing++;
-			if (xstate->failing >= 3) {
-				xstate->failing = 300;
-				xstate->failed_flag = TRUE;
+			/* The connection attempt was torn down by agh_xmpp_reconnect_now. */
+			if (xstate->backoff_skip) {
+				agh_xmpp_backoff_reset(xstate);
+				xstate->backoff_skip = FALSE;
 			}
+			else
+				agh_xmpp_backoff_fail(xstate);
+
 			xstate->xmpp_idle_state = 0;
 		}
 
@@ -1209,6 +2267,11 @@ static gboolean xmpp_idle(gpointer data) {
 		xstate->xmpp_idle_state = 0;
 	}
 
+	if (!xstate->connected)
+		agh_xmpp_spool_messages(mstate);
+
+	agh_xmpp_spool_tick(xstate->spool);
+
 	if (mstate->exiting) {
 		if (xstate->xmpp_conn) {
 			i = xstate->xmpp_idle_state;
@@ -1265,8 +2328,20 @@ gint agh_xmpp_init(struct agh_state *mstate) {
 	xstate = mstate->xstate;
 
 	xstate->outxmpp_messages = g_queue_new();
-	xstate->failing = 120;
-	xstate->failed_flag = TRUE;
+	xstate->sm_unacked = g_queue_new();
+	xstate->transfers = g_queue_new();
+	xstate->spool_delivered = g_queue_new();
+
+	xstate->spool = agh_xmpp_spool_new();
+	if (!xstate->spool)
+		agh_log_xmpp_crit("events will not be spooled while disconnected");
+
+	xstate->backoff_min = AGH_XMPP_BACKOFF_DEFAULT_MIN;
+	xstate->backoff_max = AGH_XMPP_BACKOFF_DEFAULT_MAX;
+	xstate->backoff_deadline = g_get_monotonic_time() + (gint64)AGH_XMPP_BACKOFF_STARTUP_DELAY * G_USEC_PER_SEC;
+
+	if (agh_xmpp_caps_refresh(xstate))
+		agh_log_xmpp_crit("capabilities will not be advertised");
 
 	agh_log_xmpp_crit("XMPP library init is taking place");
 	xmpp_initialize();
@@ -1317,17 +2392,44 @@ gint agh_xmpp_deinit(struct agh_state *mstate) {
 	}
 
 	xmpp_shutdown();
-	agh_xmpp_caps_entity_dealloc(xstate->e);
-	xstate->e = NULL;
+	if (xstate->e) {
+		agh_xmpp_caps_entity_dealloc(xstate->e);
+		xstate->e = NULL;
+	}
+
+	g_free(xstate->caps_ver);
+	xstate->caps_ver = NULL;
+	g_free(xstate->caps_query);
+	xstate->caps_query = NULL;
 
 	xstate->xmpp_evs_tag = 0;
 
+	/* Save events we did not get a chance to send. */
+	agh_xmpp_spool_messages(mstate);
+	agh_xmpp_spool_free(xstate->spool);
+	xstate->spool = NULL;
+
 	if (xstate->outxmpp_messages) {
 		g_queue_foreach(xstate->outxmpp_messages, discard_xmpp_messages, xstate);
 		g_queue_free(xstate->outxmpp_messages);
 		xstate->outxmpp_messages = NULL;
 	}
 
+	if (xstate->transfers) {
+		g_queue_free_full(xstate->transfers, agh_xmpp_transfer_free);
+		xstate->transfers = NULL;
+	}
+
+	if (xstate->spool_delivered) {
+		g_queue_free_full(xstate->spool_delivered, g_free);
+		xstate->spool_delivered = NULL;
+	}
+
+	if (xstate->sm_unacked) {
+		g_queue_free_full(xstate->sm_unacked, agh_xmpp_sm_item_free);
+		xstate->sm_unacked = NULL;
+	}
+
 	if (xstate->controllers) {
 		g_queue_free(xstate->controllers); /* it contains strings coming from UCI, we should not free them */
 		xstate->controllers = NULL;
@@ -1335,6 +2437,8 @@ gint agh_xmpp_deinit(struct agh_state *mstate) {
 
 	xstate->ping_timeout = 0;
 	xstate->ping_interval = 0;
+	g_free(xstate->ping_id);
+	xstate->ping_id = NULL;
 
 	if (xstate->uci_ctx) {
 		uci_unload(xstate->uci_ctx, xstate->xpackage);
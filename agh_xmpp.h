@@ -28,6 +28,12 @@
 #define AGH_XMPP_STANZA_NS_PING "urn:xmpp:ping"
 #define AGH_XMPP_STANZA_TYPE_GET "get"
 #define AGH_XMPP_STANZA_NAME_PING "ping"
+#define AGH_XMPP_STANZA_NS_SM "urn:xmpp:sm:3"
+#define AGH_XMPP_STANZA_NAME_SM_ENABLED "enabled"
+#define AGH_XMPP_STANZA_NAME_SM_FAILED "failed"
+#define AGH_XMPP_STANZA_NAME_SM_REQUEST "r"
+#define AGH_XMPP_STANZA_NAME_SM_ANSWER "a"
+#define AGH_XMPP_STANZA_ATTR_SM_H "h"
 /* End of XMPP stanza attributes. */
 
 /* Config. */
@@ -49,12 +55,65 @@
 /* Other options. */
 #define AGH_XMPP_UCI_OPTION_ALTDOMAIN "altdomain"
 #define AGH_XMPP_UCI_OPTION_ALTPORT "altport"
+#define AGH_XMPP_UCI_OPTION_SM "stream_management"
+#define AGH_XMPP_UCI_OPTION_SM_REQUEST_INTERVAL "sm_request_interval"
+#define AGH_XMPP_UCI_OPTION_BACKOFF_MIN "reconnect_backoff_min"
+#define AGH_XMPP_UCI_OPTION_BACKOFF_MAX "reconnect_backoff_max"
+#define AGH_XMPP_UCI_OPTION_CHUNK_SIZE "chunk_size"
+#define AGH_XMPP_UCI_OPTION_CHUNK_WINDOW "chunk_window"
+#define AGH_XMPP_UCI_OPTION_PING_RTT_THRESHOLD "ping_rtt_threshold"
+#define AGH_XMPP_UCI_OPTION_PING_LOSS_THRESHOLD "ping_loss_threshold"
+#define AGH_XMPP_UCI_OPTION_PING_MAX_LOST "ping_max_lost"
+#define AGH_XMPP_UCI_OPTION_SPOOL_PATH "spool_path"
+#define AGH_XMPP_UCI_OPTION_SPOOL_MAX_SIZE "spool_max_size"
+#define AGH_XMPP_UCI_OPTION_SPOOL_MAX_AGE "spool_max_age"
 
 /* Ping states. */
 #define AGH_XMPP_PING_STATE_INACTIVE 0
 #define AGH_XMPP_PING_STATE_WAITING 1
 #define AGH_XMPP_PING_STATE_SENT 2
 
+/* Ping statistics: number of samples in the rolling window, and how many are needed before judging link quality. */
+#define AGH_XMPP_PING_STATS_WINDOW 20
+#define AGH_XMPP_PING_STATS_MIN_SAMPLES 3
+
+/* Loss samples are stored with this RTT value. */
+#define AGH_XMPP_PING_SAMPLE_LOST -1
+
+/* Consecutive lost pings after which the connection is considered broken. */
+#define AGH_XMPP_PING_DEFAULT_MAX_LOST 3
+
+/* Link quality event name. */
+#define AGH_XMPP_LINK_QUALITY_EVENT_NAME "XMPP_LINK_QUALITY"
+
+/* Reconnection backoff defaults, in seconds. */
+#define AGH_XMPP_BACKOFF_DEFAULT_MIN 5
+#define AGH_XMPP_BACKOFF_DEFAULT_MAX 300
+#define AGH_XMPP_BACKOFF_LIMIT 86400
+
+/* Time to wait before the first connection attempt, in seconds; usually enough for a bearer to come up. */
+#define AGH_XMPP_BACKOFF_STARTUP_DELAY 60
+
+/* Chunked transfers: texts longer than chunk_size bytes are split, and at most chunk_window unacknowledged chunks are sent. */
+#define AGH_XMPP_CHUNK_DEFAULT_SIZE 4000
+#define AGH_XMPP_CHUNK_MIN_SIZE 256
+#define AGH_XMPP_CHUNK_DEFAULT_WINDOW 4
+#define AGH_XMPP_MAX_TRANSFERS 16
+
+/* Transfers not acknowledged for this many seconds are dropped. */
+#define AGH_XMPP_TRANSFER_TIMEOUT 300
+
+/* Stream Management (XEP-0198) states. */
+#define AGH_XMPP_SM_STATE_INACTIVE 0
+#define AGH_XMPP_SM_STATE_REQUESTED 1
+#define AGH_XMPP_SM_STATE_ENABLED 2
+
+/* Maximum number of sent, but not yet acknowledged, messages we keep around for retransmission. */
+#define AGH_XMPP_SM_MAX_UNACKED_MESSAGES 300
+
+/* Seconds between ack requests, when not specified in config. */
+#define AGH_XMPP_SM_DEFAULT_REQUEST_INTERVAL 30
+
 struct xmpp_state {
 	xmpp_ctx_t *xmpp_ctx;
 	xmpp_conn_t *xmpp_conn;
@@ -73,12 +132,83 @@ struct xmpp_state {
 
 	/* state */
 	gboolean ping_is_timeout;
+	gboolean connected;
 	guint xmpp_idle_state;
 	GQueue *outxmpp_messages;
 	guint64 msg_id;
 	struct agh_xmpp_caps_entity *e;
-	guint failing;
-	gboolean failed_flag;
+	gchar *caps_ver;
+	gchar *caps_query;
+
+	/* Reconnection backoff */
+	gint backoff_min;
+	gint backoff_max;
+	guint backoff_failures;
+	gint64 backoff_delay;
+	gint64 backoff_deadline;
+	gboolean backoff_skip;
+
+	/* Ping statistics */
+	gchar *ping_id;
+	gint64 ping_sent_time;
+	gint64 ping_samples[AGH_XMPP_PING_STATS_WINDOW];
+	guint ping_samples_count;
+	guint ping_samples_pos;
+	gint ping_rtt_threshold;
+	gint ping_loss_threshold;
+	gboolean ping_degraded;
+	gint ping_max_lost;
+	guint ping_lost_consecutive;
+
+	/* Chunked transfers */
+	gint chunk_size;
+	gint chunk_window;
+	GQueue *transfers;
+	guint transfer_id;
+
+	/* Events spooled while disconnected */
+	struct agh_xmpp_spool *spool;
+	gboolean spool_stalled;
+	gboolean spool_diverted;
+	/* controllers the spooled event being replayed already reached */
+	GQueue *spool_delivered;
+
+	/* Stream Management */
+	gboolean sm_wanted;
+	gint sm_request_interval;
+	guint sm_state;
+	guint32 sm_inbound;
+	guint32 sm_outbound;
+	GQueue *sm_unacked;
+};
+
+struct agh_xmpp_sm_item {
+	guint32 seq;
+	gchar *to;
+	gchar *text;
+};
+
+struct agh_xmpp_ping_summary {
+	guint samples;
+	guint lost;
+	gint64 min;
+	gint64 avg;
+	gint64 p95;
+};
+
+struct agh_xmpp_transfer {
+	guint id;
+	gchar *to;
+	gchar *text;
+	gsize len;
+	/* chunk i spans from offsets[i] to offsets[i + 1] */
+	gsize *offsets;
+	guint chunks;
+	guint next;
+	/* number of chunks sent at least once: next may be rewound after reconnecting */
+	guint sent;
+	guint acked;
+	gint64 last_activity;
 };
 
 struct xmpp_csp {
@@ -90,6 +220,10 @@ struct xmpp_csp {
 
 gint agh_xmpp_init(struct agh_state *mstate);
 gint agh_xmpp_deinit(struct agh_state *mstate);
+gint agh_xmpp_reconnect_now(struct agh_state *mstate);
+gint agh_xmpp_transfer_ack(struct xmpp_state *xstate, guint id, guint chunk);
+gint agh_xmpp_transfer_cancel(struct xmpp_state *xstate, guint id);
+void agh_xmpp_ping_summarize(struct xmpp_state *xstate, struct agh_xmpp_ping_summary *sum);
 
 void discard_xmpp_messages(gpointer data, gpointer userdata);
 
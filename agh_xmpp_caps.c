@@ -21,66 +21,32 @@
 
 /*
  * Uses libnettle to calculate SHA1 within the process of "publishing" XMPP Capabilities (I call them "caps").
+ * Hashing context and digest live on the stack: the only allocation is the one for the base64 encoded output.
  *
  * Returns: the SHA1 on success, NULL when an allocation failure occurs and is handled.
  * Infact, this function may still lead to an unclean program termination.
- *
- * Note: I am not convinced about the correctness of this function.
 */
-static gchar *agh_xmpp_caps_sha1(gchar *text) {
-	struct sha1_ctx *ctx;
-	uint8_t *input;
-	uint8_t *digest;
-	gchar *output;
-	gint text_len;
-
-	output = NULL;
+static gchar *agh_xmpp_caps_sha1(const gchar *text) {
+	struct sha1_ctx ctx;
+	uint8_t digest[SHA1_DIGEST_SIZE];
+	gsize text_len;
 
 	if (!text) {
 		agh_log_xmppcaps_crit("NULL text");
-		return output;
+		return NULL;
 	}
 
 	text_len = strlen(text);
 	if (!text_len) {
 		agh_log_xmppcaps_crit("text of 0 length");
-		return output;
-	}
-
-	ctx = g_try_malloc0(sizeof(*ctx));
-	if (!ctx) {
-		agh_log_xmppcaps_crit("failure while allocating sha1_ctx");
-		return output;
-	}
-
-	input = g_try_malloc0(text_len+1);
-	if (!input) {
-		agh_log_xmppcaps_crit("failure while allocating input");
-		g_free(ctx);
-		return output;
-	}
-
-	digest = g_try_malloc0(SHA1_DIGEST_SIZE);
-	if (!digest) {
-		agh_log_xmppcaps_crit("failure while allocating digest");
-		g_free(ctx);
-		g_free(input);
-		return output;
+		return NULL;
 	}
 
-	memcpy(input, text, text_len+1);
-
-	sha1_init(ctx);
-	sha1_update(ctx, text_len, input);
-	sha1_digest(ctx, SHA1_DIGEST_SIZE, digest);
-
-	output = g_base64_encode(digest, SHA1_DIGEST_SIZE);
-
-	g_free(digest);
-	g_free(input);
-	g_free(ctx);
+	sha1_init(&ctx);
+	sha1_update(&ctx, text_len, (const uint8_t *)text);
+	sha1_digest(&ctx, SHA1_DIGEST_SIZE, digest);
 
-	return output;
+	return g_base64_encode(digest, SHA1_DIGEST_SIZE);
 }
 
 struct agh_xmpp_caps_entity *agh_xmpp_caps_entity_alloc(void) {
@@ -280,33 +246,37 @@ gint agh_xmpp_caps_add_feature(struct agh_xmpp_caps_entity *e, gchar *ftext) {
 	return (g_queue_get_length(e->features)-1);
 }
 
-gint agh_xmpp_caps_add_hash(xmpp_ctx_t *ctx, struct agh_xmpp_caps_entity *e, xmpp_stanza_t *pres) {
-	xmpp_stanza_t *caps = NULL;
-	gchar *hash;
+/*
+ * Computes the verification string for an entity, as described in XEP-0115. Meant to be called once, and then again only when
+ * features or identities change.
+ *
+ * Returns: the base64 encoded SHA1 of the verification string, or NULL on failure.
+*/
+gchar *agh_xmpp_caps_get_hash(struct agh_xmpp_caps_entity *e) {
 	gchar *str;
-
-	if (!e || !pres) {
-		agh_log_xmppcaps_crit("agh_xmpp_caps_entity or XMPP stanza where NULL");
-		return 7;
-	}
+	gchar *hash;
 
 	str = agh_xmpp_caps_build_string(e);
-
 	if (!str)
-		return 8;
+		return NULL;
 
 	hash = agh_xmpp_caps_sha1(str);
+	g_free(str);
 
-	if (!hash) {
-		g_free(str);
-		return 9;
+	return hash;
+}
+
+gint agh_xmpp_caps_add_hash(xmpp_ctx_t *ctx, const gchar *ver, xmpp_stanza_t *pres) {
+	xmpp_stanza_t *caps = NULL;
+
+	if (!ver || !pres) {
+		agh_log_xmppcaps_crit("verification string or XMPP stanza where NULL");
+		return 7;
 	}
 
 	caps = xmpp_stanza_new(ctx);
 	if (!caps) {
 		agh_log_xmppcaps_crit("XMPP stanza allocation failure");
-		g_free(str);
-		g_free(hash);
 		return 10;
 	}
 
@@ -314,86 +284,67 @@ gint agh_xmpp_caps_add_hash(xmpp_ctx_t *ctx, struct agh_xmpp_caps_entity *e, xmp
 	xmpp_stanza_set_ns(caps, AGH_XMPP_STANZA_NS_CAPS);
 	xmpp_stanza_set_attribute(caps, AGH_XMPP_STANZA_ATTR_HASH, "sha-1");
 	xmpp_stanza_set_attribute(caps, AGH_XMPP_STANZA_ATTR_NODE, "http://meizo.net");
-	xmpp_stanza_set_attribute(caps, AGH_XMPP_STANZA_ATTR_VER, hash);
+	xmpp_stanza_set_attribute(caps, AGH_XMPP_STANZA_ATTR_VER, ver);
 	xmpp_stanza_add_child(pres, caps);
 	xmpp_stanza_release(caps);
-	g_free(hash);
-	g_free(str);
 	return 0;
 }
 
-xmpp_stanza_t *agh_xmpp_caps_get_capsdata(struct xmpp_state *xstate) {
-	xmpp_stanza_t *capsdata;
-	xmpp_stanza_t *identity;
-	xmpp_stanza_t *feature;
+static void agh_xmpp_caps_append_attribute(GString *o, const gchar *name, const gchar *value) {
+	gchar *escaped;
+
+	escaped = g_markup_escape_text(value, -1);
+	g_string_append_printf(o, " %s='%s'", name, escaped);
+	g_free(escaped);
+
+	return;
+}
+
+/*
+ * Serializes identities and features of an entity, as they should appear within a disco#info query result. The output does not
+ * depend on the XMPP connection, so it can be built once and reused across reconnections.
+ *
+ * Returns: a newly allocated string on success, or NULL on failure.
+*/
+gchar *agh_xmpp_caps_build_query_children(struct agh_xmpp_caps_entity *e) {
+	GString *o;
 	guint i;
 	guint num_elems;
 	struct agh_xmpp_caps_base_entity *b;
 	gchar *ftext;
 
-	capsdata = NULL;
-	identity = NULL;
-	feature = NULL;
-
-	if ((!xstate) || (!xstate->e) || (!xstate->e->base_entities)) {
-		agh_log_xmppcaps_crit("No AGH xMPP state, or needed pointers missing in state");
-		goto ffail;
-	}
-
-	capsdata = xmpp_stanza_new(xstate->xmpp_ctx);
-	if (!capsdata) {
-		agh_log_xmppcaps_crit("capsdata XMPP stanza allocation failure");
-		goto ffail;
+	if ((!e) || (!e->base_entities) || (!e->features)) {
+		agh_log_xmppcaps_crit("agh_xmpp_caps_entity struct, base entities or features GQueue where missing");
+		return NULL;
 	}
 
-	xmpp_stanza_set_name(capsdata, AGH_XMPP_STANZA_NAME_QUERY);
-
-	xmpp_stanza_set_ns(capsdata, XMPP_NS_DISCO_INFO);
+	o = g_string_new(NULL);
 
-	num_elems = g_queue_get_length(xstate->e->base_entities);
+	num_elems = g_queue_get_length(e->base_entities);
 
 	for (i=0;i<num_elems;i++) {
-		identity = xmpp_stanza_new(xstate->xmpp_ctx);
-		if (!identity) {
-			agh_log_xmppcaps_crit("fragment XMPP stanza allocation failure");
-			goto ffail;
-		}
-
-		xmpp_stanza_set_name(identity, "identity");
+		b = g_queue_peek_nth(e->base_entities, i);
 
-		b = g_queue_peek_nth(xstate->e->base_entities, i);
-
-		xmpp_stanza_set_attribute(identity, "category", b->cat);
-		xmpp_stanza_set_type(identity, b->type);
-		xmpp_stanza_set_attribute(identity, "name", b->name);
+		g_string_append(o, "<identity");
+		agh_xmpp_caps_append_attribute(o, "category", b->cat);
+		agh_xmpp_caps_append_attribute(o, "type", b->type);
+		agh_xmpp_caps_append_attribute(o, "name", b->name);
 
 		if (b->lang)
-			xmpp_stanza_set_attribute(identity, "lang", b->lang);
+			agh_xmpp_caps_append_attribute(o, "lang", b->lang);
 
-		xmpp_stanza_add_child(capsdata, identity);
-		xmpp_stanza_release(identity);
+		g_string_append(o, "/>");
 	}
 
-	num_elems = g_queue_get_length(xstate->e->features);
+	num_elems = g_queue_get_length(e->features);
 
 	for (i=0;i<num_elems;i++) {
-		feature = xmpp_stanza_new(xstate->xmpp_ctx);
-		if (!feature) {
-			agh_log_xmppcaps_crit("fragment XMPP stanza allocation failure (features)");
-			goto ffail;
-		}
-
-		xmpp_stanza_set_name(feature, AGH_XMPP_STANZA_NAME_FEATURE);
-		ftext = g_queue_peek_nth(xstate->e->features, i);
-		xmpp_stanza_set_attribute(feature, AGH_XMPP_STANZA_ATTR_VAR, ftext);
-		xmpp_stanza_add_child(capsdata, feature);
-		xmpp_stanza_release(feature);
+		ftext = g_queue_peek_nth(e->features, i);
+
+		g_string_append(o, "<"AGH_XMPP_STANZA_NAME_FEATURE);
+		agh_xmpp_caps_append_attribute(o, AGH_XMPP_STANZA_ATTR_VAR, ftext);
+		g_string_append(o, "/>");
 	}
 
-	return capsdata;
-ffail:
-	xmpp_stanza_release(capsdata);
-	xmpp_stanza_release(identity);
-	xmpp_stanza_release(feature);
-	return NULL;
+	return g_string_free(o, FALSE);
 }
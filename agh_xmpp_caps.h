@@ -29,7 +29,8 @@ gint agh_xmpp_caps_set_entity_data(struct agh_xmpp_caps_entity *e, gint id, gcha
 
 gint agh_xmpp_caps_add_feature(struct agh_xmpp_caps_entity *e, gchar *ftext);
 
-gint agh_xmpp_caps_add_hash(xmpp_ctx_t *ctx, struct agh_xmpp_caps_entity *e, xmpp_stanza_t *pres);
-xmpp_stanza_t *agh_xmpp_caps_get_capsdata(struct xmpp_state *xstate);
+gchar *agh_xmpp_caps_get_hash(struct agh_xmpp_caps_entity *e);
+gint agh_xmpp_caps_add_hash(xmpp_ctx_t *ctx, const gchar *ver, xmpp_stanza_t *pres);
+gchar *agh_xmpp_caps_build_query_children(struct agh_xmpp_caps_entity *e);
 
 #endif
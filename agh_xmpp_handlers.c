@@ -5,6 +5,14 @@
 #include "agh_xmpp_handlers.h"
 #include "agh_messages.h"
 #include "agh_commands.h"
+#include "agh_logging.h"
+
+/* Log messages from AGH_LOG_DOMAIN_XMPP_HANDLER domain. */
+#define AGH_LOG_DOMAIN_XMPP_HANDLER "XMPP_HANDLER"
+
+/* Logging macros. */
+#define agh_log_xmpp_handler_dbg(message, ...) agh_log_dbg(AGH_LOG_DOMAIN_XMPP_HANDLER, message, ##__VA_ARGS__)
+#define agh_log_xmpp_handler_crit(message, ...) agh_log_crit(AGH_LOG_DOMAIN_XMPP_HANDLER, message, ##__VA_ARGS__)
 
 static gchar *agh_xmpp_handler_escape(gchar *text) {
 	GString *s;
@@ -81,19 +89,221 @@ struct agh_message *xmpp_sendmsg_handle(struct agh_handler *h, struct agh_messag
 	return NULL;
 }
 
+/*
+ * Reports reconnection backoff state: consecutive failures, current delay and time left before the next attempt (in ms),
+ * and configured bounds (in seconds).
+ *
+ * Returns: always 0.
+*/
+static gint agh_xmpp_cmd_backoff_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	struct xmpp_state *xstate = mstate->xstate;
+	gint64 remaining;
+
+	remaining = 0;
+
+	if (!xstate->xmpp_idle_state && xstate->backoff_deadline)
+		remaining = (xstate->backoff_deadline - g_get_monotonic_time()) / 1000;
+
+	if (remaining < 0)
+		remaining = 0;
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(cmd, xstate->xmpp_idle_state == 1 ? "CONNECTED" : "NOT_CONNECTED", TRUE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("failures=%" G_GUINT16_FORMAT"", xstate->backoff_failures), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("delay=%" G_GINT64_FORMAT"", xstate->backoff_delay), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("next_attempt_in=%" G_GINT64_FORMAT"", remaining), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("min=%" G_GINT16_FORMAT"", xstate->backoff_min), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("max=%" G_GINT16_FORMAT"", xstate->backoff_max), FALSE);
+
+	return 0;
+}
+
+/*
+ * Reports XMPP ping statistics over the rolling window: RTTs are in ms.
+ *
+ * Returns: always 0.
+*/
+static gint agh_xmpp_cmd_ping_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_xmpp_ping_summary sum;
+
+	agh_xmpp_ping_summarize(xstate, &sum);
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+	agh_cmd_answer_addtext(cmd, xstate->ping_degraded ? "DEGRADED" : "OK", TRUE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("samples=%" G_GUINT16_FORMAT"", sum.samples), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("lost=%" G_GUINT16_FORMAT"", sum.lost), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("min=%" G_GINT64_FORMAT"", sum.min), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("avg=%" G_GINT64_FORMAT"", sum.avg), FALSE);
+	agh_cmd_answer_addtext(cmd, g_strdup_printf("p95=%" G_GINT64_FORMAT"", sum.p95), FALSE);
+
+	return 0;
+}
+
+/*
+ * Lists chunked transfers in progress: transfer ID, recipient, chunks sent, acknowledged and total.
+ *
+ * Returns: always 0.
+*/
+static gint agh_xmpp_cmd_transfers_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	struct xmpp_state *xstate = mstate->xstate;
+	struct agh_xmpp_transfer *t;
+	GList *l;
+
+	agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+
+	if (!xstate->transfers || g_queue_is_empty(xstate->transfers)) {
+		agh_cmd_answer_addtext(cmd, "NO_TRANSFERS", TRUE);
+		return 0;
+	}
+
+	for (l = xstate->transfers->head; l; l = g_list_next(l)) {
+		t = l->data;
+		agh_cmd_answer_addtext(cmd, g_strdup_printf("id=%" G_GUINT16_FORMAT", to=%s, sent=%" G_GUINT16_FORMAT", acked=%" G_GUINT16_FORMAT", chunks=%" G_GUINT16_FORMAT"", t->id, t->to, t->sent, t->acked, t->chunks), FALSE);
+	}
+
+	return 0;
+}
+
+/*
+ * Acknowledges chunks of a transfer, up to and including the specified one.
+ *
+ * Returns: an integer with value 0 on success, or 101 when arguments are missing.
+*/
+static gint agh_xmpp_cmd_ack_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg_id;
+	config_setting_t *arg_chunk;
+	gint retval;
+
+	retval = 0;
+
+	arg_id = agh_cmd_get_arg(cmd, 2, CONFIG_TYPE_INT);
+	arg_chunk = agh_cmd_get_arg(cmd, 3, CONFIG_TYPE_INT);
+
+	if (!arg_id || !arg_chunk || config_setting_get_int(arg_id) < 0 || config_setting_get_int(arg_chunk) < 0) {
+		agh_cmd_answer_addtext(cmd, "BAD_ARGS", TRUE);
+		retval = 101;
+		goto wayout;
+	}
+
+	switch(agh_xmpp_transfer_ack(mstate->xstate, config_setting_get_int(arg_id), config_setting_get_int(arg_chunk))) {
+		case 0:
+			agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+			agh_cmd_answer_addtext(cmd, "OK", TRUE);
+			break;
+		case 1:
+			agh_cmd_answer_addtext(cmd, "NO_SUCH_TRANSFER", TRUE);
+			break;
+		case 2:
+			agh_cmd_answer_addtext(cmd, "CHUNK_NOT_SENT", TRUE);
+			break;
+	}
+
+wayout:
+	return retval;
+}
+
+/*
+ * Cancels a transfer.
+ *
+ * Returns: an integer with value 0 on success, or 101 when arguments are missing.
+*/
+static gint agh_xmpp_cmd_cancel_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+	config_setting_t *arg_id;
+	gint retval;
+
+	retval = 0;
+
+	arg_id = agh_cmd_get_arg(cmd, 2, CONFIG_TYPE_INT);
+
+	if (!arg_id || config_setting_get_int(arg_id) < 0) {
+		agh_cmd_answer_addtext(cmd, "BAD_ARGS", TRUE);
+		retval = 101;
+		goto wayout;
+	}
+
+	if (agh_xmpp_transfer_cancel(mstate->xstate, config_setting_get_int(arg_id)))
+		agh_cmd_answer_addtext(cmd, "NO_SUCH_TRANSFER", TRUE);
+	else {
+		agh_cmd_answer_set_status(cmd, AGH_CMD_ANSWER_STATUS_OK);
+		agh_cmd_answer_addtext(cmd, "OK", TRUE);
+	}
+
+wayout:
+	return retval;
+}
+
+/* AGH_CMD_XMPP subcommands */
+static const struct agh_cmd_operation agh_xmpp_handler_subcommands[] = {
+	{
+		.op_name = AGH_CMD_XMPP_BACKOFF,
+		.min_args = 0,
+		.max_args = 0,
+		.cmd_cb = agh_xmpp_cmd_backoff_cb
+	},
+	{
+		.op_name = AGH_CMD_XMPP_PING,
+		.min_args = 0,
+		.max_args = 0,
+		.cmd_cb = agh_xmpp_cmd_ping_cb
+	},
+	{
+		.op_name = AGH_CMD_XMPP_TRANSFERS,
+		.min_args = 0,
+		.max_args = 0,
+		.cmd_cb = agh_xmpp_cmd_transfers_cb
+	},
+	{
+		.op_name = AGH_CMD_XMPP_ACK,
+		.min_args = 2,
+		.max_args = 2,
+		.cmd_cb = agh_xmpp_cmd_ack_cb
+	},
+	{
+		.op_name = AGH_CMD_XMPP_CANCEL,
+		.min_args = 1,
+		.max_args = 1,
+		.cmd_cb = agh_xmpp_cmd_cancel_cb
+	},
+
+	{ }
+};
+
+static gint agh_xmpp_cmd_cb(struct agh_state *mstate, struct agh_cmd *cmd) {
+
+	agh_cmd_op_match(mstate, agh_xmpp_handler_subcommands, cmd, 1);
+
+	return 0;
+}
+
+/* XMPP operations */
+static const struct agh_cmd_operation agh_xmpp_handler_ops[] = {
+	{
+		.op_name = AGH_CMD_XMPP,
+		.min_args = 1,
+		.max_args = 3,
+		.cmd_cb = agh_xmpp_cmd_cb
+	},
+
+	{ }
+};
+
 struct agh_message *xmpp_cmd_handle(struct agh_handler *h, struct agh_message *m) {
-	struct agh_cmd __attribute__((unused)) *cmd;
-	struct agh_state *mstate;
-	struct xmpp_state __attribute__((unused)) *xstate;
+	struct agh_state *mstate = h->handler_data;
+	struct agh_cmd *cmd;
+	struct agh_message *answer;
 
-	mstate = h->handler_data;
-	xstate = mstate->xstate;
+	cmd = NULL;
+	answer = NULL;
 
-	cmd = m->csp;
+	if ((m->msg_type != MSG_SENDCMD) || (!mstate->xstate))
+		goto wayout;
 
-	if (m->msg_type != MSG_SENDCMD)
-		return NULL;
+	cmd = m->csp;
+	agh_cmd_op_match(mstate, agh_xmpp_handler_ops, cmd, 0);
 
-	/* to be implemented; and remember to check if we are connected... */
-	return NULL;
+wayout:
+	if (cmd)
+		answer = agh_cmd_answer_msg(cmd, mstate->comm, NULL);
+	return answer;
 }
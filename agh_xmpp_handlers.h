@@ -3,6 +3,18 @@
 #ifndef __agh_xmpp_handlers_h__
 #define __agh_xmpp_handlers_h__
 
+/* Operations. */
+#define AGH_CMD_XMPP "xmpp"
+/* End of operations. */
+
+/* AGH_CMD_XMPP subcommands. */
+#define AGH_CMD_XMPP_BACKOFF "backoff"
+#define AGH_CMD_XMPP_PING "ping"
+#define AGH_CMD_XMPP_TRANSFERS "transfers"
+#define AGH_CMD_XMPP_ACK "ack"
+#define AGH_CMD_XMPP_CANCEL "cancel"
+/* End of AGH_CMD_XMPP subcommands. */
+
 struct agh_message *xmpp_sendmsg_handle(struct agh_handler *h, struct agh_message *m);
 struct agh_message *xmpp_cmd_handle(struct agh_handler *h, struct agh_message *m);
 
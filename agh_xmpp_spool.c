@@ -0,0 +1,487 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+
+/*
+ * A store-and-forward spool for outgoing texts, used while we are not connected to the XMPP server.
+ * Records are batched in memory, and appended to a file in a single write once enough of them accumulated, or enough time
+ * passed: this limits flash wear when the spool is placed on an overlay file system. When the file would exceed its maximum
+ * size, it is rewritten, keeping only the newest records that fit. Records are discarded also when too old.
+ *
+ * On-disk record format: "<wall clock time, in us> <text length>\n<text>\n".
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "agh_xmpp_spool.h"
+#include "agh_logging.h"
+
+/* Log messages from AGH_LOG_DOMAIN_XMPP_SPOOL domain. */
+#define AGH_LOG_DOMAIN_XMPP_SPOOL "XMPP_SPOOL"
+
+/* Logging macros. */
+#define agh_log_xmpp_spool_dbg(message, ...) agh_log_dbg(AGH_LOG_DOMAIN_XMPP_SPOOL, message, ##__VA_ARGS__)
+#define agh_log_xmpp_spool_crit(message, ...) agh_log_crit(AGH_LOG_DOMAIN_XMPP_SPOOL, message, ##__VA_ARGS__)
+
+struct agh_xmpp_spool_record {
+	gint64 ts;
+	gchar *text;
+};
+
+static void agh_xmpp_spool_record_free(gpointer data) {
+	struct agh_xmpp_spool_record *r = data;
+
+	if (!r)
+		return;
+
+	g_free(r->text);
+	g_free(r);
+
+	return;
+}
+
+static void agh_xmpp_spool_record_append(GString *o, gint64 ts, const gchar *text) {
+
+	g_string_append_printf(o, "%" G_GINT64_FORMAT" %" G_GSIZE_FORMAT"\n", ts, strlen(text));
+	g_string_append(o, text);
+	g_string_append_c(o, '\n');
+
+	return;
+}
+
+/*
+ * Parses serialized records, pushing them to the dest GQueue. Parsing stops at the first malformed record.
+ *
+ * Returns: the number of records found.
+*/
+static guint agh_xmpp_spool_parse(struct agh_xmpp_spool *spool, const gchar *data, gsize len, GQueue *dest) {
+	const gchar *cur;
+	const gchar *end;
+	gchar *eptr;
+	gint64 ts;
+	guint64 text_len;
+	struct agh_xmpp_spool_record *r;
+	guint count;
+
+	cur = data;
+	end = data + len;
+	count = 0;
+
+	while (cur < end) {
+		ts = g_ascii_strtoll(cur, &eptr, 10);
+		if ((eptr == cur) || (eptr >= end) || (*eptr != ' '))
+			break;
+
+		cur = eptr + 1;
+
+		text_len = g_ascii_strtoull(cur, &eptr, 10);
+		if ((eptr == cur) || (eptr >= end) || (*eptr != '\n'))
+			break;
+
+		cur = eptr + 1;
+
+		if ((text_len >= (guint64)(end - cur)) || (cur[text_len] != '\n'))
+			break;
+
+		r = g_try_malloc0(sizeof(*r));
+		if (!r) {
+			agh_log_xmpp_spool_crit("failure while allocating record");
+			break;
+		}
+
+		r->ts = ts;
+		r->text = g_strndup(cur, text_len);
+		g_queue_push_tail(dest, r);
+		count++;
+
+		cur += text_len + 1;
+	}
+
+	if (cur < end) {
+		agh_log_xmpp_spool_crit("malformed data found in spool, ignoring the rest of it");
+		spool->discarded++;
+	}
+
+	return count;
+}
+
+/*
+ * Reads spool file contents, if any.
+ *
+ * Returns: file contents, or NULL when the file could not be read (e.g.: it does not exist).
+*/
+static gchar *agh_xmpp_spool_read(struct agh_xmpp_spool *spool, gsize *len) {
+	gchar *contents;
+	GError *gerror;
+
+	contents = NULL;
+	gerror = NULL;
+	*len = 0;
+
+	if (!g_file_get_contents(spool->path, &contents, len, &gerror)) {
+		if (!g_error_matches(gerror, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+			agh_log_xmpp_spool_crit("unable to read spool (%s)", gerror->message);
+
+		g_error_free(gerror);
+		return NULL;
+	}
+
+	return contents;
+}
+
+/*
+ * Discards records that are too old, and then the oldest ones until the remaining ones fit in max_size bytes.
+*/
+static void agh_xmpp_spool_prune(struct agh_xmpp_spool *spool, GQueue *records) {
+	struct agh_xmpp_spool_record *r;
+	GList *l;
+	gint64 now;
+	gsize total;
+
+	now = g_get_real_time();
+	total = 0;
+
+	while ( (r = g_queue_peek_head(records)) ) {
+		if (now - r->ts <= spool->max_age * G_USEC_PER_SEC)
+			break;
+
+		agh_xmpp_spool_record_free(g_queue_pop_head(records));
+		spool->discarded++;
+	}
+
+	/* Account for the record header too, roughly. */
+	for (l = records->head; l; l = g_list_next(l)) {
+		r = l->data;
+		total += strlen(r->text) + 32;
+	}
+
+	while ((total > spool->max_size) && (r = g_queue_pop_head(records))) {
+		total -= strlen(r->text) + 32;
+		agh_xmpp_spool_record_free(r);
+		spool->discarded++;
+	}
+
+	return;
+}
+
+/*
+ * Replaces spool file contents with the passed records, in an atomic way.
+ *
+ * Returns: an integer with value 0 on success, or 1 on failure.
+*/
+static gint agh_xmpp_spool_rewrite(struct agh_xmpp_spool *spool, GQueue *records) {
+	GString *o;
+	GList *l;
+	struct agh_xmpp_spool_record *r;
+	GError *gerror;
+	gint retval;
+
+	gerror = NULL;
+	retval = 0;
+
+	if (g_queue_is_empty(records)) {
+		g_unlink(spool->path);
+		return retval;
+	}
+
+	o = g_string_new(NULL);
+
+	for (l = records->head; l; l = g_list_next(l)) {
+		r = l->data;
+		agh_xmpp_spool_record_append(o, r->ts, r->text);
+	}
+
+	if (!g_file_set_contents(spool->path, o->str, o->len, &gerror)) {
+		agh_log_xmpp_spool_crit("unable to write spool (%s)", gerror->message);
+		g_error_free(gerror);
+		retval = 1;
+	}
+
+	g_string_free(o, TRUE);
+
+	return retval;
+}
+
+/*
+ * Writes batched records out. They are simply appended when they fit, otherwise the file is rewritten.
+ *
+ * Returns: an integer with value 0 on success, or 1 on failure.
+*/
+static gint agh_xmpp_spool_flush(struct agh_xmpp_spool *spool) {
+	GStatBuf st;
+	FILE *f;
+	gsize file_len;
+	gchar *contents;
+	GQueue *records;
+	gint retval;
+
+	retval = 0;
+
+	if (!spool->batch->len)
+		return retval;
+
+	file_len = 0;
+	if (!g_stat(spool->path, &st))
+		file_len = st.st_size;
+
+	if (file_len + spool->batch->len <= spool->max_size) {
+		f = g_fopen(spool->path, "ab");
+		if (!f) {
+			agh_log_xmpp_spool_crit("unable to open spool for appending");
+			retval = 1;
+			goto out;
+		}
+
+		if (fwrite(spool->batch->str, 1, spool->batch->len, f) != spool->batch->len) {
+			agh_log_xmpp_spool_crit("short write while appending to spool");
+			retval = 1;
+		}
+
+		fclose(f);
+		goto out;
+	}
+
+	records = g_queue_new();
+
+	contents = agh_xmpp_spool_read(spool, &file_len);
+	if (contents) {
+		agh_xmpp_spool_parse(spool, contents, file_len, records);
+		g_free(contents);
+	}
+
+	agh_xmpp_spool_parse(spool, spool->batch->str, spool->batch->len, records);
+	agh_xmpp_spool_prune(spool, records);
+	retval = agh_xmpp_spool_rewrite(spool, records);
+
+	g_queue_free_full(records, agh_xmpp_spool_record_free);
+
+out:
+	g_string_truncate(spool->batch, 0);
+	spool->batch_since = 0;
+	return retval;
+}
+
+struct agh_xmpp_spool *agh_xmpp_spool_new(void) {
+	struct agh_xmpp_spool *spool;
+
+	spool = g_try_malloc0(sizeof(*spool));
+	if (!spool) {
+		agh_log_xmpp_spool_crit("failure while allocating spool");
+		return spool;
+	}
+
+	spool->path = g_strdup(AGH_XMPP_SPOOL_DEFAULT_PATH);
+	spool->max_size = AGH_XMPP_SPOOL_DEFAULT_MAX_SIZE;
+	spool->max_age = AGH_XMPP_SPOOL_DEFAULT_MAX_AGE;
+	spool->batch = g_string_new(NULL);
+	spool->replay = g_queue_new();
+
+	return spool;
+}
+
+/*
+ * Releases the spool, after making sure records waiting to be sent are persisted, preserving their order.
+*/
+void agh_xmpp_spool_free(struct agh_xmpp_spool *spool) {
+	GQueue *records;
+	gchar *contents;
+	gsize len;
+
+	if (!spool)
+		return;
+
+	if (!g_queue_is_empty(spool->replay)) {
+		records = spool->replay;
+		spool->replay = NULL;
+
+		contents = agh_xmpp_spool_read(spool, &len);
+		if (contents) {
+			agh_xmpp_spool_parse(spool, contents, len, records);
+			g_free(contents);
+		}
+
+		agh_xmpp_spool_parse(spool, spool->batch->str, spool->batch->len, records);
+		g_string_truncate(spool->batch, 0);
+
+		agh_xmpp_spool_prune(spool, records);
+		agh_xmpp_spool_rewrite(spool, records);
+		g_queue_free_full(records, agh_xmpp_spool_record_free);
+	}
+	else
+		agh_xmpp_spool_flush(spool);
+
+	if (spool->replay)
+		g_queue_free_full(spool->replay, agh_xmpp_spool_record_free);
+
+	g_string_free(spool->batch, TRUE);
+	g_free(spool->path);
+	g_free(spool);
+
+	return;
+}
+
+/*
+ * Adds a text to the spool. Data is not written out immediately.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: bad parameters
+ *  - 2: text does not fit in the spool at all, and has been discarded
+*/
+gint agh_xmpp_spool_add(struct agh_xmpp_spool *spool, const gchar *text) {
+	gint retval;
+
+	retval = 0;
+
+	if (!spool || !text) {
+		agh_log_xmpp_spool_crit("no spool or NULL text");
+		retval = 1;
+		goto out;
+	}
+
+	if (strlen(text) + 32 > spool->max_size) {
+		agh_log_xmpp_spool_dbg("text too big for the spool");
+		spool->discarded++;
+		retval = 2;
+		goto out;
+	}
+
+	if (!spool->batch->len)
+		spool->batch_since = g_get_monotonic_time();
+
+	agh_xmpp_spool_record_append(spool->batch, g_get_real_time(), text);
+
+	if (spool->batch->len >= AGH_XMPP_SPOOL_BATCH_SIZE)
+		agh_xmpp_spool_flush(spool);
+
+out:
+	return retval;
+}
+
+/*
+ * To be called periodically: writes batched records out when they have been waiting for long enough.
+ *
+ * Returns: an integer with value 0 on success, or 1 on failure.
+*/
+gint agh_xmpp_spool_tick(struct agh_xmpp_spool *spool) {
+
+	if (!spool || !spool->batch->len)
+		return 0;
+
+	if (g_get_monotonic_time() - spool->batch_since < (gint64)AGH_XMPP_SPOOL_BATCH_INTERVAL * G_USEC_PER_SEC)
+		return 0;
+
+	return agh_xmpp_spool_flush(spool);
+}
+
+/*
+ * Moves all spooled records (from file and batch) to the replay queue, in order, and removes the spool file.
+ *
+ * Returns: the number of records queued for replay.
+*/
+gint agh_xmpp_spool_load(struct agh_xmpp_spool *spool) {
+	GQueue *records;
+	gchar *contents;
+	gsize len;
+	gint count;
+
+	if (!spool)
+		return 0;
+
+	records = g_queue_new();
+
+	contents = agh_xmpp_spool_read(spool, &len);
+	if (contents) {
+		agh_xmpp_spool_parse(spool, contents, len, records);
+		g_free(contents);
+		g_unlink(spool->path);
+	}
+
+	agh_xmpp_spool_parse(spool, spool->batch->str, spool->batch->len, records);
+	g_string_truncate(spool->batch, 0);
+	spool->batch_since = 0;
+
+	agh_xmpp_spool_prune(spool, records);
+
+	count = g_queue_get_length(records);
+
+	while (!g_queue_is_empty(records))
+		g_queue_push_tail(spool->replay, g_queue_pop_head(records));
+
+	g_queue_free(records);
+
+	if (count)
+		agh_log_xmpp_spool_dbg("%" G_GINT16_FORMAT" spooled records will be sent", count);
+
+	return count;
+}
+
+/*
+ * Gets the next text to be sent from the replay queue, and the time it was spooled at when ts is not NULL.
+ *
+ * Returns: a newly allocated string, or NULL when the replay queue is empty.
+*/
+gchar *agh_xmpp_spool_next(struct agh_xmpp_spool *spool, gint64 *ts) {
+	struct agh_xmpp_spool_record *r;
+	gchar *text;
+
+	if (!spool)
+		return NULL;
+
+	r = g_queue_pop_head(spool->replay);
+	if (!r)
+		return NULL;
+
+	if (ts)
+		*ts = r->ts;
+
+	text = r->text;
+	g_free(r);
+
+	return text;
+}
+
+/*
+ * Puts a text obtained via agh_xmpp_spool_next back at the head of the replay queue, e.g. because it could not be sent.
+ * The spool takes ownership of the text.
+ *
+ * Returns: an integer with value 0 on success, or
+ *  - 1: bad parameters
+ *  - 2: memory allocation failure (text is released)
+*/
+gint agh_xmpp_spool_requeue(struct agh_xmpp_spool *spool, gchar *text, gint64 ts) {
+	struct agh_xmpp_spool_record *r;
+
+	if (!spool || !text) {
+		agh_log_xmpp_spool_crit("no spool or NULL text");
+		return 1;
+	}
+
+	r = g_try_malloc0(sizeof(*r));
+	if (!r) {
+		agh_log_xmpp_spool_crit("failure while allocating record, text lost");
+		spool->discarded++;
+		g_free(text);
+		return 2;
+	}
+
+	r->ts = ts;
+	r->text = text;
+	g_queue_push_head(spool->replay, r);
+
+	return 0;
+}
+
+/*
+ * Returns: the number of records discarded since last call.
+*/
+guint64 agh_xmpp_spool_take_discarded(struct agh_xmpp_spool *spool) {
+	guint64 discarded;
+
+	if (!spool)
+		return 0;
+
+	discarded = spool->discarded;
+	spool->discarded = 0;
+
+	return discarded;
+}
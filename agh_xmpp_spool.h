@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+
+#ifndef __agh_xmpp_spool_h__
+#define __agh_xmpp_spool_h__
+#include <glib.h>
+
+/* Defaults. */
+#define AGH_XMPP_SPOOL_DEFAULT_PATH "/tmp/agh_xmpp_spool"
+#define AGH_XMPP_SPOOL_DEFAULT_MAX_SIZE 262144
+#define AGH_XMPP_SPOOL_DEFAULT_MAX_AGE 86400
+
+/* Batched records are written out once they reach this size (in bytes), or after this many seconds. */
+#define AGH_XMPP_SPOOL_BATCH_SIZE 4096
+#define AGH_XMPP_SPOOL_BATCH_INTERVAL 30
+
+/* Spooled records are replayed up to this many bytes at a time, so they do not hold other messages back for long. */
+#define AGH_XMPP_SPOOL_REPLAY_BUDGET 16384
+
+/* Spool event name. */
+#define AGH_XMPP_SPOOL_EVENT_NAME "XMPP_SPOOL"
+
+struct agh_xmpp_spool {
+	gchar *path;
+	gsize max_size;
+	gint64 max_age;
+
+	/* Records not yet written out. */
+	GString *batch;
+	gint64 batch_since;
+
+	/* Records loaded from the spool, waiting to be sent. */
+	GQueue *replay;
+
+	guint64 discarded;
+};
+
+struct agh_xmpp_spool *agh_xmpp_spool_new(void);
+void agh_xmpp_spool_free(struct agh_xmpp_spool *spool);
+
+gint agh_xmpp_spool_add(struct agh_xmpp_spool *spool, const gchar *text);
+gint agh_xmpp_spool_tick(struct agh_xmpp_spool *spool);
+gint agh_xmpp_spool_load(struct agh_xmpp_spool *spool);
+gchar *agh_xmpp_spool_next(struct agh_xmpp_spool *spool, gint64 *ts);
+gint agh_xmpp_spool_requeue(struct agh_xmpp_spool *spool, gchar *text, gint64 ts);
+guint64 agh_xmpp_spool_take_discarded(struct agh_xmpp_spool *spool);
+
+#endif